@@ -1,13 +1,129 @@
 #ifndef _PROTO_S3GW_H
 #define _PROTO_S3GW_H
 
+#include <stdlib.h>
+
+#include <types/s3gw.h>
+
 struct http_txn;
 
+/* the message is not even formatted when no log server would take it */
+#define S3_LOG(proxy, level, format, ...)					\
+	do {									\
+		if ((level) <= s3gw_log_maxlevel)				\
+			send_log(proxy, level, "[s3] " format "\n", ## __VA_ARGS__); \
+	} while (0)
+
+extern struct s3gw_counters s3gw_counters;
+extern int s3gw_log_maxlevel;
+extern struct pool_head *pool2_s3key;
+
 /* inital = 1 if called form main haproxy */
 int s3gw_connect(int initial);
 void s3gw_deinit();
+unsigned int s3gw_query_flags(struct http_txn *txn);
+void s3gw_capture(struct http_txn *txn);
 void s3gw_enqueue(struct http_txn *txn);
+struct s3gw_bucket *s3gw_bucket_add(const char *name);
+struct s3gw_bucket *s3gw_bucket_lookup(const char *name, int len);
+int s3gw_bucket_parse_opts(char **args, struct s3gw_bucket_opts *opts, char **err);
+int s3gw_bucket_set_opts(struct s3gw_bucket *bucket, const struct s3gw_bucket_opts *opts, char **err);
+struct s3gw_bucket *s3gw_bucket_enable(const char *name, const struct s3gw_bucket_opts *opts, char **err);
+int s3gw_bucket_disable(const char *name);
+int s3gw_bucket_clear_filters(const char *name);
+void s3gw_bucket_free_all();
+struct s3gw_shard *s3gw_shard_add(const char *addr, int weight, const struct s3gw_sink_ops *sink);
+unsigned int s3gw_pending_count();
 
 extern int s3gw_enable;
 
+/* accounts for a key of bucket <b> skipped by the key filters */
+static inline void s3gw_bucket_filtered(struct s3gw_bucket *b)
+{
+	b->counters.filtered++;
+	s3gw_counters.filtered++;
+}
+
+/* the parts of an event stored in its <data> area */
+static inline const char *s3gw_ev_key(const struct s3gw_event *ev)
+{
+	return ev->data + ev->bucket_len;
+}
+
+static inline const char *s3gw_ev_source(const struct s3gw_event *ev)
+{
+	return s3gw_ev_key(ev) + ev->key_len;
+}
+
+static inline const char *s3gw_ev_etag(const struct s3gw_event *ev)
+{
+	return s3gw_ev_source(ev) + ev->source_len;
+}
+
+static inline const char *s3gw_ev_version(const struct s3gw_event *ev)
+{
+	return s3gw_ev_etag(ev) + ev->etag_len;
+}
+
+static inline const char *s3gw_ev_request_id(const struct s3gw_event *ev)
+{
+	return s3gw_ev_version(ev) + ev->version_len;
+}
+
+/* allocates the slots of <ring> for at least <size> events, rounded up to the
+ * next power of two. Returns non-zero on failure.
+ */
+static inline int s3gw_ring_init(struct s3gw_ring *ring, unsigned int size)
+{
+	ring->size = 1;
+	while (ring->size < size)
+		ring->size <<= 1;
+	ring->head = ring->tail = 0;
+	ring->slots = calloc(ring->size, sizeof(*ring->slots));
+	return ring->slots == NULL;
+}
+
+static inline void s3gw_ring_destroy(struct s3gw_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+	ring->head = ring->tail = 0;
+}
+
+/* returns the number of queued events */
+static inline unsigned int s3gw_ring_count(const struct s3gw_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static inline int s3gw_ring_full(const struct s3gw_ring *ring)
+{
+	return s3gw_ring_count(ring) == ring->size;
+}
+
+/* returns the <n>th oldest queued event */
+static inline struct s3gw_event *s3gw_ring_peek(struct s3gw_ring *ring, unsigned int n)
+{
+	return &ring->slots[(ring->head + n) & (ring->size - 1)];
+}
+
+/* releases the <n> oldest events */
+static inline void s3gw_ring_skip(struct s3gw_ring *ring, unsigned int n)
+{
+	ring->head += n;
+}
+
+/* returns the next free slot, to be filled then published with
+ * s3gw_ring_commit(). The ring must not be full.
+ */
+static inline struct s3gw_event *s3gw_ring_tail(struct s3gw_ring *ring)
+{
+	return &ring->slots[ring->tail & (ring->size - 1)];
+}
+
+static inline void s3gw_ring_commit(struct s3gw_ring *ring)
+{
+	ring->tail++;
+}
+
 #endif /* _PROTO_S3GW_H */
@@ -0,0 +1,21 @@
+#ifndef _PROTO_S3GW_DELETE_H
+#define _PROTO_S3GW_DELETE_H
+
+#include <common/buffer.h>
+
+#include <types/s3gw.h>
+
+struct s3gw_delete *s3gw_delete_new(struct s3gw_bucket *bucket);
+void s3gw_delete_free(struct s3gw_delete *del);
+void s3gw_delete_parse_buf(struct s3gw_delete *del, const struct buffer *buf, int ofs, int len);
+int s3gw_delete_next_key(const struct s3gw_delete *del, const struct s3gw_delete_blk **blk, int *ofs, const char **key);
+int s3gw_delete_init();
+void s3gw_delete_deinit();
+
+/* returns non-zero while the body of <del> may still hold keys */
+static inline int s3gw_delete_parsing(const struct s3gw_delete *del)
+{
+	return del->state != S3GW_DEL_DONE;
+}
+
+#endif /* _PROTO_S3GW_DELETE_H */
@@ -0,0 +1,12 @@
+#ifndef _PROTO_S3GW_FILTER_H
+#define _PROTO_S3GW_FILTER_H
+
+#include <types/s3gw.h>
+
+int s3gw_filter_add(struct s3gw_bucket *bucket, const char *prefix, const char *suffix, char **err);
+void s3gw_filter_clear(struct s3gw_bucket *bucket);
+void s3gw_filter_build();
+int s3gw_filter_match(const struct s3gw_bucket *bucket, const char *key, int len);
+void s3gw_filter_free_all();
+
+#endif /* _PROTO_S3GW_FILTER_H */
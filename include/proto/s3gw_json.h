@@ -0,0 +1,14 @@
+#ifndef _PROTO_S3GW_JSON_H
+#define _PROTO_S3GW_JSON_H
+
+#include <common/chunk.h>
+
+#include <proto/s3gw.h>
+#include <types/s3gw.h>
+
+int s3gw_json_escape(struct chunk *out, const char *str, int len);
+int s3gw_json_encode_event(struct chunk *out, const struct s3gw_event *ev);
+int s3gw_json_time(struct chunk *out, unsigned long long ms);
+int s3gw_json_hex16(struct chunk *out, unsigned long long n);
+
+#endif /* _PROTO_S3GW_JSON_H */
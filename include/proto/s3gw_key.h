@@ -0,0 +1,7 @@
+#ifndef _PROTO_S3GW_KEY_H
+#define _PROTO_S3GW_KEY_H
+
+int s3gw_url_decode(char *dst, int size, const char *src, int len);
+int s3gw_utf8_valid(const char *str, int len);
+
+#endif /* _PROTO_S3GW_KEY_H */
@@ -0,0 +1,11 @@
+#ifndef _PROTO_S3GW_MSGPACK_H
+#define _PROTO_S3GW_MSGPACK_H
+
+#include <common/chunk.h>
+
+#include <proto/s3gw.h>
+#include <types/s3gw.h>
+
+int s3gw_msgpack_encode_event(struct chunk *out, const struct s3gw_event *ev);
+
+#endif /* _PROTO_S3GW_MSGPACK_H */
@@ -0,0 +1,26 @@
+#ifndef _PROTO_S3GW_SHM_H
+#define _PROTO_S3GW_SHM_H
+
+#include <types/s3gw.h>
+#include <types/s3gw_shm.h>
+#include <types/global.h>
+#include <types/task.h>
+
+extern struct s3gw_shm *s3gw_shm;
+
+int s3gw_shm_init();
+void s3gw_shm_deinit();
+int s3gw_shm_attach(struct task *t);
+struct s3gw_event *s3gw_shm_reserve(unsigned int *pos);
+void s3gw_shm_commit(unsigned int pos);
+struct s3gw_event *s3gw_shm_peek();
+void s3gw_shm_release();
+int s3gw_shm_idle();
+
+/* returns non-zero if this process hands its events to the publisher */
+static inline int s3gw_shm_producer()
+{
+	return s3gw_shm && relative_pid != S3GW_SHM_PUBLISHER;
+}
+
+#endif /* _PROTO_S3GW_SHM_H */
@@ -0,0 +1,42 @@
+#ifndef _PROTO_S3GW_SINK_H
+#define _PROTO_S3GW_SINK_H
+
+#include <proto/freq_ctr.h>
+#include <proto/s3gw.h>
+#include <proto/s3gw_json.h>
+#include <proto/s3gw_msgpack.h>
+#include <types/s3gw.h>
+
+/* kinds of servers, see struct s3gw_sink_ops */
+extern const struct s3gw_sink_ops s3gw_redis_sink;
+extern const struct s3gw_sink_ops s3gw_unix_sink;
+extern const struct s3gw_sink_ops s3gw_webhook_sink;
+
+/* what the sinks report to the common code */
+void s3gw_shard_ready(struct s3gw_shard *shard);
+void s3gw_shard_retry(struct s3gw_shard *shard);
+void s3gw_shard_lost(struct s3gw_shard *shard);
+struct s3gw_cmd *s3gw_cmd_new(struct s3gw_bucket *bucket, const unsigned long long *stamps, int events);
+void s3gw_cmd_sent(struct s3gw_shard *shard, struct s3gw_cmd *cmd);
+void s3gw_cmd_done(struct s3gw_shard *shard, struct s3gw_cmd *cmd, int ok);
+void s3gw_cmd_free(struct s3gw_cmd *cmd);
+
+/* accounts for <n> lost events */
+static inline void s3gw_dropped(unsigned int n)
+{
+	s3gw_counters.dropped += n;
+	update_freq_ctr(&s3gw_counters.dropped_rate, n);
+}
+
+/* Appends the notification of <ev> to <out> in the encoding of its bucket <b>,
+ * JSON if it is unknown. Returns 0 if it does not fit.
+ */
+static inline int s3gw_encode_event(struct chunk *out, const struct s3gw_event *ev,
+                                    const struct s3gw_bucket *b)
+{
+	if (b && b->encoding == S3GW_ENC_MSGPACK)
+		return s3gw_msgpack_encode_event(out, ev);
+	return s3gw_json_encode_event(out, ev);
+}
+
+#endif /* _PROTO_S3GW_SINK_H */
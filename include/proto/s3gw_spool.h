@@ -0,0 +1,13 @@
+#ifndef _PROTO_S3GW_SPOOL_H
+#define _PROTO_S3GW_SPOOL_H
+
+#include <types/s3gw.h>
+#include <types/s3gw_spool.h>
+
+int s3gw_spool_init();
+void s3gw_spool_deinit();
+int s3gw_spool_write(const struct s3gw_event *ev);
+int s3gw_spool_read(struct s3gw_event *ev);
+unsigned int s3gw_spool_pending();
+
+#endif /* _PROTO_S3GW_SPOOL_H */
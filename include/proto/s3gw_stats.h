@@ -0,0 +1,13 @@
+#ifndef _PROTO_S3GW_STATS_H
+#define _PROTO_S3GW_STATS_H
+
+#include <common/chunk.h>
+
+#include <types/s3gw.h>
+
+void s3gw_stats_acked(const struct s3gw_cmd *cmd);
+void s3gw_stats_dump_info(struct chunk *out);
+void s3gw_stats_dump_bucket(struct chunk *out, struct s3gw_bucket *b);
+void s3gw_stats_dump_html(struct chunk *out);
+
+#endif /* _PROTO_S3GW_STATS_H */
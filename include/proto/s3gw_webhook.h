@@ -0,0 +1,8 @@
+#ifndef _PROTO_S3GW_WEBHOOK_H
+#define _PROTO_S3GW_WEBHOOK_H
+
+#include <types/s3gw.h>
+
+struct s3gw_shard *s3gw_webhook_add(char **args, char **err);
+
+#endif /* _PROTO_S3GW_WEBHOOK_H */
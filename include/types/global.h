@@ -160,11 +160,34 @@ struct global {
 	struct {
 		int enabled;
 		struct list buckets;
+		struct list base_domains;       /* struct s3gw_domain */
 		char *bucket_prefix;
 		char *redis_ip;
 		int redis_port;
 		char *bind_ip;
 		char *redis_unix_path;
+		struct list servers;    /* Redis servers (struct s3gw_shard) */
+		unsigned int redis_timeout;       /* ms to connect and answer the probe */
+		unsigned int redis_reconnect_min; /* ms before the first retry */
+		unsigned int redis_reconnect_max; /* max ms between two retries */
+		unsigned int webhook_timeout;     /* ms to connect and complete a request */
+		unsigned int webhook_retries;     /* attempts after a failed request */
+		unsigned int webhook_retry_delay; /* ms before retrying a request */
+		int redis_sink;         /* S3GW_SINK_* */
+		unsigned int redis_stream_maxlen; /* approximate stream length, 0 = unlimited */
+		int event_time;         /* add the response date to schema v1 payloads */
+		int flush_max_events;   /* max number of events per pipelined flush */
+		int flush_delay;        /* ms to wait for more events before flushing */
+		int queue_size;         /* number of events the ring can hold */
+		int queue_overflow;     /* S3GW_OVF_* policy when the ring is full */
+		unsigned int shared_queue_size; /* ring shared by the processes, 0 = none */
+		unsigned int coalesce_size;     /* max events held by coalescing windows */
+		int max_inflight;       /* max events sent but not acknowledged yet */
+		char *spool_dir;        /* directory of the on-disk spool */
+		unsigned int spool_segment_size;
+		unsigned int spool_max_segments;
+		unsigned int spool_fsync;       /* ms between two syncs, 0 = always */
+		unsigned int spool_replay_rate; /* max events replayed per second */
 	} s3;
 #endif
 #ifdef USE_CPU_AFFINITY
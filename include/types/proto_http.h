@@ -466,10 +466,22 @@ struct http_res_rule {
 	} arg;                                 /* arguments used by some actions */
 };
 
+struct s3gw_bucket;
+struct s3gw_delete;
+
+/* What is kept from an S3 write request until its response is known. Only
+ * requests to a bucket enabled for notifications have <bucket> set, and only
+ * those get a copy of their object key and copy source in <key>.
+ */
 struct s3gateway {
-	char *copy_source;
-	char *path;
-	int ignore:1;
+	struct s3gw_bucket *bucket;	/* enabled bucket, or NULL */
+	char *key;			/* object key followed by the copy source, from pool2_s3key */
+	unsigned short key_len;
+	unsigned short source_len;	/* 0 if not a copy */
+	int type;			/* S3GW_EV_* */
+	long long size;			/* x-amz-decoded-content-length, or -1 */
+	unsigned int query;		/* S3GW_Q_* flags, see s3gw_query_flags() */
+	struct s3gw_delete *del;	/* keys of a multi-object delete, or NULL */
 };
 
 /* This is an HTTP transaction. It contains both a request message and a
@@ -1,11 +1,376 @@
 #ifndef _TYPES_S3GW
 #define _TYPES_S3GW
 
+#include <sys/time.h>
+
+#include <common/defaults.h>
 #include <common/mini-clist.h>
 
-struct s3gw_buckets {
-    struct list list;
-    char *bucket;
+#include <eb32tree.h>
+#include <ebmbtree.h>
+
+#include <types/freq_ctr.h>
+
+struct redisAsyncContext;
+struct task;
+
+/* default number of events published per flush */
+#define S3GW_DEF_FLUSH_MAX_EVENTS 256
+
+/* default number of slots of the event ring */
+#define S3GW_DEF_QUEUE_SIZE 1024
+
+/* a Redis server of weight 1 appears this many times on the hash ring */
+#define S3GW_SHARD_POINTS 64
+#define S3GW_SHARD_MAX_WEIGHT 256
+
+/* default Redis connect and probe timeout, and reconnect backoff bounds (ms) */
+#define S3GW_DEF_REDIS_TIMEOUT       5000
+#define S3GW_DEF_RECONNECT_MIN       500
+#define S3GW_DEF_RECONNECT_MAX       30000
+
+/* webhooks: connections per endpoint, retries of a failed request, delay
+ * before a retry and request timeout (ms)
+ */
+#define S3GW_DEF_WEBHOOK_CONNS       2
+#define S3GW_MAX_WEBHOOK_CONNS       64
+#define S3GW_DEF_WEBHOOK_RETRIES     3
+#define S3GW_DEF_WEBHOOK_RETRY_DELAY 500
+#define S3GW_DEF_WEBHOOK_TIMEOUT     5000
+
+/* default max number of events held by the coalescing windows */
+#define S3GW_DEF_COALESCE_SIZE 4096
+
+/* default approximate length of the Redis streams */
+#define S3GW_DEF_STREAM_MAXLEN 100000
+
+/* sub-resources found in the query string of a request */
+#define S3GW_Q_UPLOADS     0x0001  /* ?uploads: multipart initiate or list */
+#define S3GW_Q_UPLOAD_ID   0x0002  /* ?uploadId: multipart part, complete or abort */
+#define S3GW_Q_PART_NUMBER 0x0004  /* ?partNumber */
+#define S3GW_Q_TAGGING     0x0008  /* ?tagging */
+#define S3GW_Q_ACL         0x0010  /* ?acl */
+#define S3GW_Q_VERSION_ID  0x0020  /* ?versionId */
+#define S3GW_Q_DELETE      0x0040  /* ?delete: multi-object delete */
+#define S3GW_Q_DONE        0x8000  /* the query string was classified */
+
+/* max length of a bucket name */
+#define S3GW_BUCKET_LEN 255
+
+/* max length of a key prefix or suffix filter, and number of filter rules of
+ * a bucket.
+ */
+#define S3GW_FILTER_LEN 255
+#define S3GW_FILTER_MAX 64
+
+/* max length of the ETag, version id and request id kept for schema v2 */
+#define S3GW_META_LEN 128
+
+/* The latency histograms count durations below 2^S3GW_LAT_SHIFT us in their
+ * first slot, and double the bound with each slot. The last one takes
+ * everything above.
+ */
+#define S3GW_LAT_SHIFT   6
+#define S3GW_LAT_SLOTS   18
+
+/* max length of a Redis key ("<bucket_prefix>:<bucket>") */
+#define S3GW_KEY_LEN 256
+
+/* max number of keys of a multi-object delete, as S3, and size of the blocks
+ * which store them.
+ */
+#define S3GW_DELETE_MAX_KEYS 1000
+#define S3GW_DELETE_BLK_LEN  8192
+
+/* max length kept of a tag name and of a character reference of the
+ * multi-object delete body.
+ */
+#define S3GW_DELETE_NAME_LEN 32
+#define S3GW_DELETE_ENT_LEN  12
+
+/* notification event types */
+enum {
+	S3GW_EV_POST = 0,
+	S3GW_EV_PUT,
+	S3GW_EV_COPY,
+	S3GW_EV_DELETE,
+	S3GW_EV_MAX
+};
+
+/* notification formats */
+enum {
+	S3GW_SCHEMA_V1 = 0,             /* {"event", "objectKey", "source"} */
+	S3GW_SCHEMA_V2,                 /* AWS-style {"Records": [...]} */
+};
+
+/* how the notifications of a bucket are serialized */
+enum {
+	S3GW_ENC_JSON = 0,
+	S3GW_ENC_MSGPACK,               /* the same object as MessagePack */
+};
+
+/* how events are stored in Redis */
+enum {
+	S3GW_SINK_LIST = 0,             /* LPUSH to a list per bucket */
+	S3GW_SINK_STREAM,               /* XADD to a stream per bucket */
+};
+
+/* what to do when an event arrives while the ring is full */
+enum {
+	S3GW_OVF_DROP_NEWEST = 0,       /* reject the incoming event */
+	S3GW_OVF_DROP_OLDEST,           /* overwrite the oldest queued event */
+	S3GW_OVF_SPILL,                 /* write the event to the on-disk spool */
+};
+
+/* connection states of a Redis server */
+enum {
+	S3GW_SHARD_DOWN = 0,            /* waiting for the next attempt */
+	S3GW_SHARD_CONNECTING,          /* non-blocking connect in progress */
+	S3GW_SHARD_PROBING,             /* connected, waiting for the PING reply */
+	S3GW_SHARD_UP,                  /* publishing */
+};
+
+/* states of the multi-object delete body parser */
+enum {
+	S3GW_DEL_TEXT = 0,              /* between two tags */
+	S3GW_DEL_TAG,                   /* in a tag, up to '>' */
+	S3GW_DEL_ENTITY,                /* in a character reference of a key */
+	S3GW_DEL_COMMENT,               /* in a comment, up to "-->" */
+	S3GW_DEL_DONE,                  /* after </Delete>, or given up */
+};
+
+/* elements of the multi-object delete body which lead to a key */
+enum {
+	S3GW_DEL_IN_DELETE = 1,
+	S3GW_DEL_IN_OBJECT,
+	S3GW_DEL_IN_KEY,
+};
+
+/* per-bucket notification counters */
+struct s3gw_bucket_counters {
+	unsigned long long events;      /* events of successful requests */
+	unsigned long long filtered;    /* keys skipped by the key filters */
+	unsigned long long published;   /* events acknowledged by Redis */
+	unsigned long long failed;      /* events refused by Redis or lost with it */
+	struct freq_ctr events_rate;
+	struct freq_ctr published_rate;
+};
+
+/* A bucket enabled for notifications. Buckets removed on the CLI are only
+ * marked disabled and are never freed, since pending requests and events may
+ * still point to them. Enabling them again restores them.
+ */
+struct s3gw_bucket {
+	struct list list;               /* linked into global.s3.buckets */
+	int len;                        /* length of the name */
+	int schema;                     /* S3GW_SCHEMA_* */
+	int encoding;                   /* S3GW_ENC_* */
+	unsigned int hash;              /* position on the Redis server ring */
+	unsigned int coalesce;          /* ms during which events of a key merge, 0 = off */
+	unsigned int id;                /* unique, used in the filter keys */
+	int nb_rules;                   /* key filter rules, 0 = notify all keys */
+	unsigned long long no_prefix;   /* rules without a prefix */
+	unsigned long long no_suffix;   /* rules without a suffix */
+	int disabled;                   /* removed at runtime, see below */
+	struct s3gw_bucket_counters counters;
+	struct ebmb_node node;          /* indexed by name, must be last */
+};
+
+/* options of a "s3.buckets" line or of "add s3 bucket" */
+struct s3gw_bucket_opts {
+	int schema;                     /* S3GW_SCHEMA_*, -1 if not set */
+	int encoding;                   /* S3GW_ENC_*, -1 if not set */
+	unsigned int coalesce;          /* ms, -1 if not set */
+	const char *prefix;             /* key filter rule, NULL if not set */
+	const char *suffix;
+};
+
+/* domain under which buckets are addressed as virtual hosts */
+struct s3gw_domain {
+	struct list list;               /* linked into global.s3.base_domains */
+	int len;
+	char name[0];
+};
+
+/* A key prefix or suffix used by filter rules. The key is the id of the bucket
+ * followed by the prefix, or by the reversed suffix, so that the filters of all
+ * the buckets share one tree and a single longest match finds every rule whose
+ * prefix (suffix) matches.
+ */
+struct s3gw_filter {
+	struct list list;               /* all the filters of a tree */
+	int len;                        /* bytes of the key */
+	unsigned long long own;         /* rules using exactly this affix */
+	unsigned long long rules;       /* rules using this affix or a shorter one */
+	struct ebmb_node node;          /* must be last */
+};
+
+/* a notification waiting to be published. <data> holds the bucket name,
+ * immediately followed by the object key, the copy source, the ETag, the
+ * version id and the request id, each of them possibly empty. The last three
+ * ones and <size> are only filled for schema v2.
+ */
+struct s3gw_event {
+	int type;                       /* S3GW_EV_* */
+	int schema;                     /* S3GW_SCHEMA_* */
+	int bucket_len;
+	int key_len;
+	int source_len;
+	int etag_len;
+	int version_len;
+	int request_id_len;
+	long long size;                 /* object size, -1 if unknown */
+	unsigned long long stamp;       /* date of the response, in us */
+	unsigned long long sequencer;   /* increases with each event of a process */
+	unsigned int count;             /* number of events merged into this one */
+	char data[2 * REQURI_LEN];
+};
+
+/* An event held during the coalescing window of its bucket. Later events of
+ * the same bucket, key and type replace its contents and increase its count.
+ * It is queued once the window started by the first one expires.
+ */
+struct s3gw_pending {
+	struct eb32_node node;          /* keyed by hash of bucket, key and type */
+	struct eb32_node exp;           /* keyed by expiration date */
+	struct s3gw_event ev;
+};
+
+/* Fixed-size ring of preallocated events. <size> is a power of two, <head>
+ * and <tail> are free-running counters, the ring holds <tail> - <head> events.
+ */
+struct s3gw_ring {
+	struct s3gw_event *slots;
+	unsigned int size;
+	unsigned int head;              /* oldest queued event */
+	unsigned int tail;              /* next free slot */
+};
+
+struct s3gw_shard;
+struct s3gw_usock;
+struct s3gw_webhook;
+
+/* What a kind of server does with the events of its shards. The ring, the
+ * hashing, the failover and the connection timer are common, the operations
+ * report back through the functions of proto/s3gw_sink.h.
+ */
+struct s3gw_sink_ops {
+	const char *name;               /* kind of server, for the logs */
+	const char *type;               /* short name, for the stats */
+	/* starts connecting, the shard is usable once s3gw_shard_ready() is
+	 * called. A failure calls s3gw_shard_retry().
+	 */
+	void (*connect)(struct s3gw_shard *shard);
+	/* publishes up to <count> of the oldest queued events, returns the
+	 * number of events taken from the ring.
+	 */
+	int (*flush)(struct s3gw_shard *shard, int count);
+	/* closes the connection, if any, after a timeout or on exit */
+	void (*close)(struct s3gw_shard *shard);
+	/* frees what the configuration allocated, on exit. Optional. */
+	void (*release)(struct s3gw_shard *shard);
+};
+
+/* one occurrence of a server on the consistent hash ring */
+struct s3gw_shard_node {
+	struct s3gw_shard *shard;
+	struct eb32_node node;
+};
+
+/* A Redis server or a local sink, which receives the notifications of the
+ * buckets hashed to it. Each one has its own connection, queue and flush task.
+ * Only connected servers have their nodes on the ring, so that the buckets of
+ * a failed server move to the next one.
+ */
+struct s3gw_shard {
+	struct list list;               /* linked into global.s3.servers */
+	const struct s3gw_sink_ops *sink;
+	char *addr;                     /* as configured, for the logs */
+	char *ip;
+	int port;
+	char *unix_path;
+	int weight;
+	struct redisAsyncContext *ctx;  /* owned by hiredis once connecting */
+	struct s3gw_usock *usock;       /* connection of a UNIX sink */
+	struct s3gw_webhook *webhook;   /* endpoint and connections of a webhook */
+	int state;                      /* S3GW_SHARD_* */
+	int connected;                  /* usable, its nodes are on the ring */
+	unsigned int failures;          /* consecutive failed attempts */
+	unsigned int retries;           /* attempts after a failure or a disconnection */
+	struct task *conn_task;         /* connect and probe timeouts, backoff */
+	struct s3gw_ring ring;          /* events waiting for the next flush */
+	int inflight;                   /* events sent but not acknowledged yet */
+	struct task *flush_task;
+	struct s3gw_shard_node *nodes;  /* weight * S3GW_SHARD_POINTS nodes */
+	int nb_nodes;
+};
+
+/* keys found in a multi-object delete body, each one stored as its length on
+ * two bytes followed by its bytes.
+ */
+struct s3gw_delete_blk {
+	struct s3gw_delete_blk *next;
+	int len;                        /* bytes used in <data> */
+	char data[S3GW_DELETE_BLK_LEN];
+};
+
+/* a multi-object delete ("POST /<bucket>?delete") being forwarded. Its body
+ * is parsed as it passes, and the keys are kept until the response tells if
+ * they are to be notified.
+ */
+struct s3gw_delete {
+	struct s3gw_bucket *bucket;
+	struct s3gw_delete_blk *head, *tail;
+	unsigned int nb_keys;
+	unsigned char state;            /* S3GW_DEL_* */
+	unsigned char depth;            /* of the current element */
+	unsigned char match;            /* S3GW_DEL_IN_* reached, 0 if none */
+	unsigned char name_len;
+	unsigned char ent_len;
+	char last;                      /* last char of the current tag */
+	unsigned char dashes;           /* consecutive '-' seen in a comment */
+	char name[S3GW_DELETE_NAME_LEN];
+	char ent[S3GW_DELETE_ENT_LEN];
+	int key_len;                    /* of the current key, -1 if it is invalid */
+	char key[REQURI_LEN];
+};
+
+/* a command sent to Redis, given to its reply callback, or a batch of records
+ * written to a UNIX sink.
+ */
+struct s3gw_cmd {
+	struct list list;               /* UNIX sink: batches not fully written */
+	struct s3gw_bucket *bucket;     /* of the events, NULL if unknown */
+	unsigned int events;            /* number of events carried */
+	unsigned int end;               /* UNIX sink: output offset after the batch */
+	struct timeval sent;
+	unsigned long long stamps[0];   /* s3gw_event->stamp of each event */
+};
+
+/* a latency histogram, see S3GW_LAT_SHIFT */
+struct s3gw_hist {
+	unsigned long long count;
+	unsigned long long sum;         /* total duration, in us */
+	unsigned long long max;         /* in us */
+	unsigned long long slots[S3GW_LAT_SLOTS];
+};
+
+/* global notification counters */
+struct s3gw_counters {
+	unsigned long long enqueued;    /* events accepted in the ring */
+	unsigned long long flushed;     /* events handed to Redis */
+	unsigned long long published;   /* events acknowledged by Redis */
+	unsigned long long dropped;     /* events lost (overflow, errors) */
+	unsigned long long spooled;     /* events written to the spool */
+	unsigned long long replayed;    /* events moved back from the spool */
+	unsigned long long coalesced;   /* events merged into a pending one */
+	unsigned long long filtered;    /* keys skipped by the key filters */
+	unsigned long long retries;     /* Redis connection attempts after a failure */
+	struct freq_ctr enqueued_rate;
+	struct freq_ctr published_rate;
+	struct freq_ctr dropped_rate;
+	struct s3gw_hist rtt;           /* from sending a command to its reply */
+	struct s3gw_hist delivery;      /* from the response to the reply */
 };
 
 #endif /* _TYPES_S3GW */
@@ -0,0 +1,34 @@
+#ifndef _TYPES_S3GW_SHM_H
+#define _TYPES_S3GW_SHM_H
+
+#include <types/s3gw.h>
+
+/* process which publishes the events of all the others */
+#define S3GW_SHM_PUBLISHER 1
+
+/* One slot of the shared ring. <seq> tells who owns it: it equals the
+ * position of the slot when a producer may fill it, that position + 1 once
+ * the event may be consumed, and the position + the ring size once consumed.
+ */
+struct s3gw_shm_slot {
+	unsigned int seq;
+	struct s3gw_event ev;
+};
+
+/* Ring shared by all the processes, mapped before they are forked. Any
+ * process may produce, only the publisher consumes. <tail> and <head> are
+ * free-running counters kept on separate cache lines.
+ */
+struct s3gw_shm {
+	unsigned int size;              /* power of two */
+	unsigned int mask;
+	unsigned int sleeping;          /* the publisher waits for the doorbell */
+	char pad1[64 - 3 * sizeof(unsigned int)];
+	unsigned int tail;              /* next slot to reserve, producers */
+	char pad2[64 - sizeof(unsigned int)];
+	unsigned int head;              /* next slot to consume, publisher */
+	char pad3[64 - sizeof(unsigned int)];
+	struct s3gw_shm_slot slots[0];
+};
+
+#endif /* _TYPES_S3GW_SHM_H */
@@ -0,0 +1,69 @@
+#ifndef _TYPES_S3GW_SPOOL_H
+#define _TYPES_S3GW_SPOOL_H
+
+#include <stdint.h>
+
+#include <common/mini-clist.h>
+
+#define S3GW_SPOOL_SEG_MAGIC  0x53335350  /* "S3SP" */
+#define S3GW_SPOOL_REC_MAGIC  0x53335245  /* "S3RE" */
+#define S3GW_SPOOL_VERSION    2
+
+/* default spool settings */
+#define S3GW_DEF_SPOOL_SEGMENT_SIZE (16 * 1024 * 1024)
+#define S3GW_DEF_SPOOL_MAX_SEGMENTS 64
+#define S3GW_DEF_SPOOL_FSYNC        1000   /* ms */
+#define S3GW_DEF_SPOOL_REPLAY_RATE  1000   /* events per second */
+
+/* Segment files start with this header. <rpos> is the offset of the first
+ * record not replayed yet, it is saved every s3.spool_fsync ms so that a
+ * restart does not replay the whole segment again.
+ */
+struct s3gw_spool_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t rpos;
+};
+
+/* Each record is made of this header followed by <len> bytes of payload, the
+ * whole being padded to 8 bytes. <crc> covers the payload only.
+ */
+struct s3gw_spool_rec {
+	uint32_t magic;
+	uint32_t len;
+	uint32_t crc;
+	uint32_t reserved;
+};
+
+/* record payload, followed by the parts of the event data */
+struct s3gw_spool_event {
+	uint16_t type;
+	uint16_t bucket_len;
+	uint16_t key_len;
+	uint16_t source_len;
+	uint8_t schema;
+	uint8_t etag_len;
+	uint8_t version_len;
+	uint8_t request_id_len;
+	uint32_t count;
+	int64_t size;
+	uint64_t time;
+	uint64_t sequencer;
+};
+
+/* one mapped segment file */
+struct s3gw_spool_seg {
+	struct list list;
+	unsigned long long seq;         /* sequence number in the file name */
+	int fd;
+	char *area;                     /* mapped file */
+	size_t size;                    /* size of the mapping */
+	size_t wpos;                    /* end of valid records */
+	size_t rpos;                    /* next record to replay */
+	size_t spos;                    /* end of the records flushed so far */
+	int rpos_dirty;                 /* rpos not saved in the header yet */
+	unsigned int records;           /* records not replayed yet */
+	int sealed;                     /* no more writes to this segment */
+};
+
+#endif /* _TYPES_S3GW_SPOOL_H */
@@ -142,6 +142,9 @@ struct appctx {
 		struct {
 			void *ptr;              /* multi-purpose pointer for peers */
 		} peers;
+		struct {
+			struct list *bucket;    /* next bucket to dump for "show s3" */
+		} s3;
 		struct {
 			unsigned int display_flags;
 			struct pat_ref *ref;
@@ -80,6 +80,9 @@
 #ifdef USE_S3GW
 #include <types/s3gw.h>
 #include <proto/s3gw.h>
+#include <proto/s3gw_filter.h>
+#include <proto/s3gw_sink.h>
+#include <proto/s3gw_webhook.h>
 #endif
 
 #ifdef USE_OPENSSL
@@ -1332,6 +1335,27 @@ int cfg_parse_global(const char *file, int linenum, char **args, int kwm)
 		}
 		global.s3.redis_port = atol(args[1]);
 	}
+	else if (!strcmp(args[0], "s3.base_domain")) {
+		struct s3gw_domain *dom;
+		int len = strlen(args[1]);
+
+		if (!len || *(args[2])) {
+			Alert("parsing [%s:%d] : '%s' expects a domain name as argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		dom = calloc(1, sizeof(*dom) + len + 1);
+		if (!dom) {
+			Alert("parsing [%s:%d] : '%s' : out of memory.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		dom->len = len;
+		memcpy(dom->name, args[1], len + 1);
+		LIST_ADDQ(&global.s3.base_domains, &dom->list);
+	}
 	else if (!strcmp(args[0], "s3.redis_unix_path")) {
 		if (global.s3.redis_unix_path) {
 			err_code |= ERR_ALERT | ERR_FATAL;
@@ -1341,18 +1365,298 @@ int cfg_parse_global(const char *file, int linenum, char **args, int kwm)
 		}
 		global.s3.redis_unix_path = strdup(args[1]);
 	}
+	else if (!strcmp(args[0], "s3.flush_max_events")) {
+		if (*(args[1]) == 0 || atol(args[1]) <= 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.flush_max_events = atol(args[1]);
+	}
+	else if (!strcmp(args[0], "s3.flush_delay")) {
+		const char *res;
+		unsigned int delay;
+
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects a delay in milliseconds.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		res = parse_time_err(args[1], &delay, TIME_UNIT_MS);
+		if (res) {
+			Alert("parsing [%s:%d]: unexpected character '%c' in argument to <%s>.\n",
+			      file, linenum, *res, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.flush_delay = delay;
+	}
+	else if (!strcmp(args[0], "s3.queue_size")) {
+		if (*(args[1]) == 0 || atol(args[1]) <= 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.queue_size = atol(args[1]);
+	}
+	else if (!strcmp(args[0], "s3.shared_queue_size")) {
+		if (*(args[1]) == 0 || atol(args[1]) < 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer argument, or 0 to disable.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.shared_queue_size = atol(args[1]);
+	}
+	else if (!strcmp(args[0], "s3.queue_overflow")) {
+		if (!strcmp(args[1], "drop-newest"))
+			global.s3.queue_overflow = S3GW_OVF_DROP_NEWEST;
+		else if (!strcmp(args[1], "drop-oldest"))
+			global.s3.queue_overflow = S3GW_OVF_DROP_OLDEST;
+		else if (!strcmp(args[1], "spill"))
+			global.s3.queue_overflow = S3GW_OVF_SPILL;
+		else {
+			Alert("parsing [%s:%d] : '%s' expects 'drop-newest', 'drop-oldest' or 'spill'.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
+	else if (!strcmp(args[0], "s3.redis_server") ||
+		 !strcmp(args[0], "s3.unix_sink")) {
+		const struct s3gw_sink_ops *sink = &s3gw_redis_sink;
+		int weight = 1;
+
+		if (!strcmp(args[0], "s3.unix_sink"))
+			sink = &s3gw_unix_sink;
+
+		if (*(args[1]) == 0 ||
+		    (*(args[2]) && (strcmp(args[2], "weight") != 0 ||
+				    (weight = atol(args[3])) < 1 || weight > S3GW_SHARD_MAX_WEIGHT))) {
+			Alert("parsing [%s:%d] : '%s' expects <%s> [weight <1-%d>] as arguments.\n",
+			      file, linenum, args[0], sink == &s3gw_unix_sink ? "/unix/path" : "ip:port|/unix/path",
+			      S3GW_SHARD_MAX_WEIGHT);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		if (!s3gw_shard_add(args[1], weight, sink)) {
+			Alert("parsing [%s:%d] : '%s' : invalid address '%s'.\n",
+			      file, linenum, args[0], args[1]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
+	else if (!strcmp(args[0], "s3.webhook")) {
+		if (!s3gw_webhook_add(args + 1, &errmsg)) {
+			Alert("parsing [%s:%d] : '%s' : %s.\n", file, linenum, args[0], errmsg);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
+	else if (!strcmp(args[0], "s3.webhook_retries")) {
+		if (*(args[1]) == 0 || atol(args[1]) < 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer or 0.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.webhook_retries = atol(args[1]);
+	}
+	else if (!strcmp(args[0], "s3.redis_timeout") ||
+		 !strcmp(args[0], "s3.webhook_timeout") ||
+		 !strcmp(args[0], "s3.webhook_retry_delay") ||
+		 !strcmp(args[0], "s3.redis_reconnect_min") ||
+		 !strcmp(args[0], "s3.redis_reconnect_max")) {
+		const char *res;
+		unsigned int delay;
+
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects a delay in milliseconds.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		res = parse_time_err(args[1], &delay, TIME_UNIT_MS);
+		if (res) {
+			Alert("parsing [%s:%d]: unexpected character '%c' in argument to <%s>.\n",
+			      file, linenum, *res, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		if (!delay) {
+			Alert("parsing [%s:%d] : '%s' expects a non-null delay.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		if (!strcmp(args[0], "s3.redis_timeout"))
+			global.s3.redis_timeout = delay;
+		else if (!strcmp(args[0], "s3.webhook_timeout"))
+			global.s3.webhook_timeout = delay;
+		else if (!strcmp(args[0], "s3.webhook_retry_delay"))
+			global.s3.webhook_retry_delay = delay;
+		else if (!strcmp(args[0], "s3.redis_reconnect_min"))
+			global.s3.redis_reconnect_min = delay;
+		else
+			global.s3.redis_reconnect_max = delay;
+	}
+	else if (!strcmp(args[0], "s3.redis_sink")) {
+		if (!strcmp(args[1], "list"))
+			global.s3.redis_sink = S3GW_SINK_LIST;
+		else if (!strcmp(args[1], "stream"))
+			global.s3.redis_sink = S3GW_SINK_STREAM;
+		else {
+			Alert("parsing [%s:%d] : '%s' expects 'list' or 'stream'.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
+	else if (!strcmp(args[0], "s3.event_time")) {
+		global.s3.event_time = 1;
+	}
+	else if (!strcmp(args[0], "s3.redis_stream_maxlen")) {
+		if (*(args[1]) == 0 || atol(args[1]) < 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer argument, or 0 for no limit.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.redis_stream_maxlen = atol(args[1]);
+	}
+	else if (!strcmp(args[0], "s3.max_inflight")) {
+		if (*(args[1]) == 0 || atol(args[1]) <= 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.max_inflight = atol(args[1]);
+	}
+	else if (!strcmp(args[0], "s3.spool_dir")) {
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects a directory as argument.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		free(global.s3.spool_dir);
+		global.s3.spool_dir = strdup(args[1]);
+	}
+	else if (!strcmp(args[0], "s3.spool_segment_size")) {
+		const char *res;
+		unsigned int size;
+
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects a size argument.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		res = parse_size_err(args[1], &size);
+		if (res) {
+			Alert("parsing [%s:%d]: unexpected character '%c' in argument to <%s>.\n",
+			      file, linenum, *res, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		if (size < 65536) {
+			Alert("parsing [%s:%d] : '%s' must be at least 64k.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.spool_segment_size = size;
+	}
+	else if (!strcmp(args[0], "s3.spool_max_segments")) {
+		if (*(args[1]) == 0 || atol(args[1]) <= 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.spool_max_segments = atol(args[1]);
+	}
+	else if (!strcmp(args[0], "s3.spool_fsync")) {
+		const char *res;
+		unsigned int delay;
+
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects a delay in milliseconds.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		res = parse_time_err(args[1], &delay, TIME_UNIT_MS);
+		if (res) {
+			Alert("parsing [%s:%d]: unexpected character '%c' in argument to <%s>.\n",
+			      file, linenum, *res, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.spool_fsync = delay;
+	}
+	else if (!strcmp(args[0], "s3.spool_replay_rate")) {
+		if (*(args[1]) == 0 || atol(args[1]) <= 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.spool_replay_rate = atol(args[1]);
+	}
 	else if (!strcmp(args[0], "s3.buckets")) {
-		struct s3gw_buckets *bucket;
-		if (*(args[1]) == 1) {
-			Alert("parsing [%s:%d] : '%s' expects <bucketname> as argument.\n", file, linenum, args[0]);
+		struct s3gw_bucket *bucket;
+		struct s3gw_bucket_opts opts;
+		char *err = NULL;
+
+		if (*(args[1]) == 0) {
+			Alert("parsing [%s:%d] : '%s' expects <bucketname> [schema <v1|v2>] [encoding <json|msgpack>] [coalesce <time>] [prefix <str>] [suffix <str>] as arguments.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		if (!s3gw_bucket_parse_opts(args + 2, &opts, &err)) {
+			Alert("parsing [%s:%d] : '%s' : %s.\n", file, linenum, args[0], err);
+			free(err);
 			err_code |= ERR_ALERT | ERR_FATAL;
 			goto out;
 		}
 
-		bucket = calloc(1, sizeof(struct s3gw_buckets));
-		bucket->bucket = strdup(args[1]);
+		if (strlen(args[1]) > S3GW_BUCKET_LEN) {
+			Alert("parsing [%s:%d] : '%s' : bucket name '%s' is too long (max %d chars).\n",
+			      file, linenum, args[0], args[1], S3GW_BUCKET_LEN);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+
+		bucket = s3gw_bucket_add(args[1]);
+		if (!bucket) {
+			Alert("parsing [%s:%d] : '%s' : out of memory.\n", file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
 
-		LIST_ADDQ(&global.s3.buckets, &bucket->list);
+		/* options given on a previous line are kept, and each line
+		 * with a filter adds a rule to the bucket.
+		 */
+		if (!s3gw_bucket_set_opts(bucket, &opts, &err)) {
+			Alert("parsing [%s:%d] : '%s' : bucket '%s' : %s.\n",
+			      file, linenum, args[0], args[1], err);
+			free(err);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+	}
+	else if (!strcmp(args[0], "s3.coalesce_size")) {
+		if (*(args[1]) == 0 || atol(args[1]) <= 0) {
+			Alert("parsing [%s:%d] : '%s' expects a positive integer argument.\n",
+			      file, linenum, args[0]);
+			err_code |= ERR_ALERT | ERR_FATAL;
+			goto out;
+		}
+		global.s3.coalesce_size = atol(args[1]);
 	}
 #endif /* USE_S3GW */
 	else if (!strcmp(args[0], "log")) {  /* syslog server address */
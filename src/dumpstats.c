@@ -65,6 +65,11 @@
 #include <proto/ssl_sock.h>
 #endif
 
+#ifdef USE_S3GW
+#include <proto/s3gw.h>
+#include <proto/s3gw_stats.h>
+#endif
+
 /* stats socket states */
 enum {
 	STAT_CLI_INIT = 0,   /* initial state, must leave to zero ! */
@@ -85,6 +90,8 @@ enum {
 	STAT_CLI_O_PAT,      /* list all entries of a pattern */
 	STAT_CLI_O_MLOOK,    /* lookup a map entry */
 	STAT_CLI_O_POOLS,    /* dump memory pools */
+	STAT_CLI_O_S3,       /* dump S3 notification stats */
+	STAT_CLI_O_S3_BKT,   /* dump S3 notification buckets */
 };
 
 /* Actions available for the stats admin forms */
@@ -122,6 +129,10 @@ enum {
 
 static int stats_dump_info_to_buffer(struct stream_interface *si);
 static int stats_dump_pools_to_buffer(struct stream_interface *si);
+#ifdef USE_S3GW
+static int stats_dump_s3_to_buffer(struct stream_interface *si);
+static int stats_sock_parse_s3_bucket(struct stream_interface *si, char **args);
+#endif
 static int stats_dump_full_sess_to_buffer(struct stream_interface *si, struct session *sess);
 static int stats_dump_sess_to_buffer(struct stream_interface *si);
 static int stats_dump_errors_to_buffer(struct stream_interface *si);
@@ -138,6 +149,7 @@ static void cli_release_handler(struct stream_interface *si);
  *     -> stats_dump_sess_to_buffer()     // "show sess"
  *     -> stats_dump_errors_to_buffer()   // "show errors"
  *     -> stats_dump_info_to_buffer()     // "show info"
+ *     -> stats_dump_s3_to_buffer()       // "show s3", "show s3 buckets"
  *     -> stats_dump_stat_to_buffer()     // "show stat"
  *        -> stats_dump_csv_header()
  *        -> stats_dump_proxy_to_buffer()
@@ -198,6 +210,12 @@ static const char stats_sock_usage_msg[] =
 	"  del map        : delete map entry\n"
 	"  clear map <id> : clear the content of this map\n"
 	"  set ssl <stmt> : set statement for ssl\n"
+#ifdef USE_S3GW
+	"  show s3 [buckets] : report S3 notification counters or buckets\n"
+	"  add s3 bucket  : enable S3 notifications for a bucket\n"
+	"  del s3 bucket  : disable S3 notifications for a bucket\n"
+	"  clear s3 filters : remove the key filters of a bucket\n"
+#endif
 	"";
 
 static const char stats_permission_denied_msg[] =
@@ -1132,6 +1150,20 @@ static int stats_sock_parse_request(struct stream_interface *si, char *line)
 			appctx->st2 = STAT_ST_INIT;
 			appctx->st0 = STAT_CLI_O_POOLS; // stats_dump_pools_to_buffer
 		}
+#ifdef USE_S3GW
+		else if (strcmp(args[1], "s3") == 0) {
+			if (!global.s3.enabled) {
+				appctx->ctx.cli.msg = "S3 notifications are not enabled.\n";
+				appctx->st0 = STAT_CLI_PRINT;
+				return 1;
+			}
+			appctx->st2 = STAT_ST_INIT;
+			if (strcmp(args[2], "buckets") == 0)
+				appctx->st0 = STAT_CLI_O_S3_BKT; // stats_dump_s3_to_buffer
+			else
+				appctx->st0 = STAT_CLI_O_S3; // stats_dump_s3_to_buffer
+		}
+#endif
 		else if (strcmp(args[1], "sess") == 0) {
 			appctx->st2 = STAT_ST_INIT;
 			if (s->listener->bind_conf->level < ACCESS_LVL_OPER) {
@@ -1300,6 +1332,11 @@ static int stats_sock_parse_request(struct stream_interface *si, char *line)
 			appctx->st0 = STAT_CLI_PROMPT;
 			return 1;
 		}
+#ifdef USE_S3GW
+		else if (strcmp(args[1], "s3") == 0) {
+			return stats_sock_parse_s3_bucket(si, args);
+		}
+#endif
 		else {
 			/* unknown "clear" argument */
 			return 0;
@@ -2141,6 +2178,11 @@ static int stats_sock_parse_request(struct stream_interface *si, char *line)
 			appctx->st0 = STAT_CLI_PROMPT;
 			return 1;
 		}
+#ifdef USE_S3GW
+		else if (strcmp(args[1], "s3") == 0) {
+			return stats_sock_parse_s3_bucket(si, args);
+		}
+#endif
 		else { /* unknown "del" parameter */
 			appctx->ctx.cli.msg = "'del' only supports 'map' or 'acl'.\n";
 			appctx->st0 = STAT_CLI_PRINT;
@@ -2217,6 +2259,11 @@ static int stats_sock_parse_request(struct stream_interface *si, char *line)
 			appctx->st0 = STAT_CLI_PROMPT;
 			return 1;
 		}
+#ifdef USE_S3GW
+		else if (strcmp(args[1], "s3") == 0) {
+			return stats_sock_parse_s3_bucket(si, args);
+		}
+#endif
 		else { /* unknown "del" parameter */
 			appctx->ctx.cli.msg = "'add' only supports 'map'.\n";
 			appctx->st0 = STAT_CLI_PRINT;
@@ -2388,6 +2435,13 @@ static void cli_io_handler(struct stream_interface *si)
 				if (stats_dump_pools_to_buffer(si))
 					appctx->st0 = STAT_CLI_PROMPT;
 				break;
+#ifdef USE_S3GW
+			case STAT_CLI_O_S3:
+			case STAT_CLI_O_S3_BKT:
+				if (stats_dump_s3_to_buffer(si))
+					appctx->st0 = STAT_CLI_PROMPT;
+				break;
+#endif
 			default: /* abnormal state */
 				cli_release_handler(si);
 				appctx->st0 = STAT_CLI_PROMPT;
@@ -2583,6 +2637,125 @@ static int stats_dump_pools_to_buffer(struct stream_interface *si)
 	return 1;
 }
 
+#ifdef USE_S3GW
+/* Processes "add s3 bucket <name> [options]", "del s3 bucket <name>" and
+ * "clear s3 filters <name>" found
+ * in <args>. Always returns 1, the result being set in appctx->st0.
+ */
+static int stats_sock_parse_s3_bucket(struct stream_interface *si, char **args)
+{
+	struct session *s = session_from_task(si->owner);
+	struct appctx *appctx = __objt_appctx(si->end);
+	struct s3gw_bucket_opts opts;
+	char *err = NULL;
+
+	if (s->listener->bind_conf->level < ACCESS_LVL_ADMIN) {
+		appctx->ctx.cli.msg = stats_permission_denied_msg;
+		appctx->st0 = STAT_CLI_PRINT;
+		return 1;
+	}
+
+	if (!global.s3.enabled) {
+		appctx->ctx.cli.msg = "S3 notifications are not enabled.\n";
+		appctx->st0 = STAT_CLI_PRINT;
+		return 1;
+	}
+
+	if (args[0][0] == 'c') {
+		if (strcmp(args[2], "filters") != 0 || !*args[3] || *args[4]) {
+			appctx->ctx.cli.msg = "'clear s3' expects 'filters' and a bucket name.\n";
+			appctx->st0 = STAT_CLI_PRINT;
+			return 1;
+		}
+		if (!s3gw_bucket_clear_filters(args[3])) {
+			appctx->ctx.cli.msg = "Unknown bucket.\n";
+			appctx->st0 = STAT_CLI_PRINT;
+			return 1;
+		}
+		appctx->st0 = STAT_CLI_PROMPT;
+		return 1;
+	}
+
+	if (strcmp(args[2], "bucket") != 0 || !*args[3]) {
+		appctx->ctx.cli.msg = "Expects 'bucket' and a bucket name.\n";
+		appctx->st0 = STAT_CLI_PRINT;
+		return 1;
+	}
+
+	if (args[0][0] == 'd') {
+		if (*args[4] || !s3gw_bucket_disable(args[3])) {
+			appctx->ctx.cli.msg = *args[4] ? "'del s3 bucket' expects only a bucket name.\n" :
+			                                 "Bucket not enabled for notifications.\n";
+			appctx->st0 = STAT_CLI_PRINT;
+			return 1;
+		}
+		appctx->st0 = STAT_CLI_PROMPT;
+		return 1;
+	}
+
+	if (!s3gw_bucket_parse_opts(args + 4, &opts, &err) ||
+	    !s3gw_bucket_enable(args[3], &opts, &err)) {
+		memprintf(&err, "%s.\n", err);
+		appctx->ctx.cli.err = err;
+		appctx->st0 = STAT_CLI_PRINT_FREE;
+		return 1;
+	}
+	appctx->st0 = STAT_CLI_PROMPT;
+	return 1;
+}
+
+/* This function dumps the S3 notification counters onto the stream
+ * interface's read buffer, then one line per bucket, or only the settings of
+ * the buckets for "show s3 buckets". It returns 0 as long as it does not
+ * complete, non-zero upon completion. The next bucket to dump is kept in
+ * appctx->ctx.s3.
+ */
+static int stats_dump_s3_to_buffer(struct stream_interface *si)
+{
+	struct appctx *appctx = __objt_appctx(si->end);
+	struct s3gw_bucket *b;
+
+	switch (appctx->st2) {
+	case STAT_ST_INIT:
+		chunk_reset(&trash);
+		if (appctx->st0 == STAT_CLI_O_S3)
+			s3gw_stats_dump_info(&trash);
+		else
+			chunk_appendf(&trash, "# name schema coalesce filters encoding\n");
+		if (bi_putchk(si->ib, &trash) == -1)
+			return 0;
+
+		appctx->ctx.s3.bucket = global.s3.buckets.n;
+		appctx->st2 = STAT_ST_LIST;
+		/* fall through */
+
+	case STAT_ST_LIST:
+		while (appctx->ctx.s3.bucket != &global.s3.buckets) {
+			b = LIST_ELEM(appctx->ctx.s3.bucket, struct s3gw_bucket *, list);
+			if (b->disabled) {
+				appctx->ctx.s3.bucket = b->list.n;
+				continue;
+			}
+			chunk_reset(&trash);
+			if (appctx->st0 == STAT_CLI_O_S3)
+				s3gw_stats_dump_bucket(&trash, b);
+			else
+				chunk_appendf(&trash, "%s v%d %u %d %s\n", (const char *)b->node.key,
+				              b->schema + 1, b->coalesce, b->nb_rules,
+				              b->encoding == S3GW_ENC_MSGPACK ? "msgpack" : "json");
+			if (bi_putchk(si->ib, &trash) == -1)
+				return 0;
+			appctx->ctx.s3.bucket = b->list.n;
+		}
+		appctx->st2 = STAT_ST_FIN;
+		/* fall through */
+
+	default:
+		return 1;
+	}
+}
+#endif /* USE_S3GW */
+
 /* Dumps a frontend's line to the trash for the current proxy <px> and uses
  * the state from stream interface <si>. The caller is responsible for clearing
  * the trash if needed. Returns non-zero if it emits anything, zero otherwise.
@@ -4372,6 +4545,10 @@ static int stats_dump_stat_to_buffer(struct stream_interface *si, struct uri_aut
 
 	case STAT_ST_END:
 		if (appctx->ctx.stats.flags & STAT_FMT_HTML) {
+#ifdef USE_S3GW
+			if (global.s3.enabled)
+				s3gw_stats_dump_html(&trash);
+#endif
 			stats_dump_html_end();
 			if (bi_putchk(rep, &trash) == -1)
 				return 0;
@@ -109,7 +109,9 @@
 
 #ifdef USE_S3GW
 #include <types/s3gw.h>
+#include <types/s3gw_spool.h>
 #include <proto/s3gw.h>
+#include <proto/s3gw_shm.h>
 #endif /* USE_S3GW */
 
 /*********************************************************************/
@@ -172,8 +174,26 @@ struct global global = {
 #ifdef USE_S3GW
 	.s3 = {
 		.buckets = LIST_HEAD_INIT(global.s3.buckets),
+		.base_domains = LIST_HEAD_INIT(global.s3.base_domains),
+		.servers = LIST_HEAD_INIT(global.s3.servers),
 		.bucket_prefix = "s3notifications",
 		.redis_port = 6379,
+		.redis_timeout = S3GW_DEF_REDIS_TIMEOUT,
+		.redis_reconnect_min = S3GW_DEF_RECONNECT_MIN,
+		.redis_reconnect_max = S3GW_DEF_RECONNECT_MAX,
+		.webhook_timeout = S3GW_DEF_WEBHOOK_TIMEOUT,
+		.webhook_retries = S3GW_DEF_WEBHOOK_RETRIES,
+		.webhook_retry_delay = S3GW_DEF_WEBHOOK_RETRY_DELAY,
+		.redis_sink = S3GW_SINK_LIST,
+		.redis_stream_maxlen = S3GW_DEF_STREAM_MAXLEN,
+		.flush_max_events = S3GW_DEF_FLUSH_MAX_EVENTS,
+		.queue_size = S3GW_DEF_QUEUE_SIZE,
+		.queue_overflow = S3GW_OVF_DROP_NEWEST,
+		.coalesce_size = S3GW_DEF_COALESCE_SIZE,
+		.spool_segment_size = S3GW_DEF_SPOOL_SEGMENT_SIZE,
+		.spool_max_segments = S3GW_DEF_SPOOL_MAX_SEGMENTS,
+		.spool_fsync = S3GW_DEF_SPOOL_FSYNC,
+		.spool_replay_rate = S3GW_DEF_SPOOL_REPLAY_RATE,
 	}
 #endif
 	/* others NULL OK */
@@ -998,7 +1018,7 @@ void deinit(void)
 	struct logformat_node *lf, *lfb;
 	struct bind_conf *bind_conf, *bind_back;
 #ifdef USE_S3GW
-	struct s3gw_buckets *buckets, *bucketsb;
+	struct s3gw_domain *dom, *domb;
 #endif
 	int i;
 
@@ -1252,6 +1272,10 @@ void deinit(void)
 	free(global.pidfile); global.pidfile = NULL;
 	free(global.node);    global.node = NULL;
 	free(global.desc);    global.desc = NULL;
+#ifdef USE_S3GW
+	/* the sinks still own file descriptors */
+	s3gw_deinit();
+#endif
 	free(fdinfo);         fdinfo  = NULL;
 	free(fdtab);          fdtab   = NULL;
 	free(oldpids);        oldpids = NULL;
@@ -1266,15 +1290,16 @@ void deinit(void)
 		free(wl);
 	}
 #ifdef USE_S3GW
-	list_for_each_entry_safe(buckets, bucketsb, &global.s3.buckets, list) {
-		free(buckets->bucket);
-		LIST_DEL(&buckets->list);
-		free(buckets);
+	s3gw_bucket_free_all();
+	list_for_each_entry_safe(dom, domb, &global.s3.base_domains, list) {
+		LIST_DEL(&dom->list);
+		free(dom);
 	}
 	free(global.s3.bind_ip); global.s3.bind_ip = NULL;
 	free(global.s3.bucket_prefix); global.s3.bucket_prefix = NULL;
 	free(global.s3.redis_ip); global.s3.redis_ip = NULL;
 	free(global.s3.redis_unix_path); global.s3.redis_unix_path = NULL;
+	free(global.s3.spool_dir); global.s3.spool_dir = NULL;
 #endif /* USE_S3GW */
 
 	pool_destroy2(pool2_session);
@@ -1575,6 +1600,15 @@ int main(int argc, char **argv)
 			argv[0], (int)limit.rlim_cur, global.maxconn, global.maxsock, global.maxsock);
 	}
 
+#ifdef USE_S3GW
+	/* the shared notification queue must exist before the fork */
+	if (global.s3.enabled && s3gw_shm_init()) {
+		Alert("[%s.main()] Cannot allocate the shared s3 notification queue.\n", argv[0]);
+		protocol_unbind_all();
+		exit(1);
+	}
+#endif /* USE_S3GW */
+
 	if (global.mode & (MODE_DAEMON | MODE_SYSTEMD)) {
 		struct proxy *px;
 		struct peers *curpeers;
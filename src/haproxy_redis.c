@@ -48,6 +48,12 @@ static void ha_cleanup(void *privdata) {
 	fd_stop_both(hap->fd);
 	fd_delete(hap->fd);
 
+	/* fd_delete() already closed the socket, prevent redisFree() from
+	 * closing it a second time.
+	 */
+	hap->async->c.fd = -1;
+	hap->async->ev.data = NULL;
+
 	free(hap);
 }
 
@@ -55,11 +61,19 @@ static int fd_handler(int fd) {
 	struct redisHaproxyAsync *hap = fdtab[fd].owner;
 	assert(hap);
 
+	/* hiredis performs a single read()/write() per call, so we go back to
+	 * polling after each of them. The context may be released from within
+	 * any of the handlers (eg: disconnect), in which case the fd is gone.
+	 */
 	if (fd_recv_active(fd) && fd_recv_ready(fd)) {
+		fd_cant_recv(fd);
 		redisAsyncHandleRead(hap->async);
+		if (fdtab[fd].owner != hap)
+			return 0;
 	}
 
 	if (fd_send_active(fd) && fd_send_ready(fd)) {
+		fd_cant_send(fd);
 		redisAsyncHandleWrite(hap->async);
 	}
 
@@ -69,7 +83,7 @@ static int fd_handler(int fd) {
 int redisHaAttach(redisAsyncContext *async) {
 	struct redisHaproxyAsync *hap;
 
-	if (async->c.fd > global.maxsock)
+	if (async->c.fd >= global.maxsock)
 		return REDIS_ERR_OTHER;
 
 	/* already attached */
@@ -77,6 +91,8 @@ int redisHaAttach(redisAsyncContext *async) {
 	    return REDIS_ERR;
 
 	hap = (struct redisHaproxyAsync *) malloc(sizeof(*hap));
+	if (!hap)
+		return REDIS_ERR_OOM;
 	hap->fd = async->c.fd;
 	hap->async = async;
 
@@ -92,5 +108,11 @@ int redisHaAttach(redisAsyncContext *async) {
 
 	fd_insert(hap->fd);
 
+	/* a non-blocking connect() is still pending, its completion is
+	 * reported as a write event.
+	 */
+	if (!(async->c.flags & REDIS_CONNECTED))
+		fd_want_send(hap->fd);
+
 	return REDIS_OK;
 }
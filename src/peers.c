@@ -1238,6 +1238,12 @@ static struct session *peer_session_create(struct peer *peer, struct peer_sessio
 	txn->srv_cookie = NULL;
 	txn->cli_cookie = NULL;
 	txn->uri = NULL;
+#ifdef USE_S3GW
+	txn->s3gw.bucket = NULL;
+	txn->s3gw.key = NULL;
+	txn->s3gw.del = NULL;
+	txn->s3gw.query = 0;
+#endif
 	txn->req.cap = NULL;
 	txn->rsp.cap = NULL;
 	txn->hdr_idx.v = NULL;
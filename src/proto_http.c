@@ -68,6 +68,7 @@
 
 #ifdef USE_S3GW
 #include <proto/s3gw.h>
+#include <proto/s3gw_delete.h>
 #endif /* S3GW */
 
 const char HTTP_100[] =
@@ -236,8 +237,6 @@ struct http_res_action_kw_list http_res_keywords = {
  */
 struct chunk http_err_chunks[HTTP_ERR_SIZE];
 
-struct pool_head *pool2_s3path;
-struct pool_head *pool2_s3copy_source;
 
 /* this struct is used between calls to smp_fetch_hdr() or smp_fetch_cookie() */
 static struct hdr_ctx static_hdr_ctx;
@@ -334,8 +333,6 @@ void init_proto_http()
 
 	/* memory allocations */
 	pool2_requri = create_pool("requri", REQURI_LEN, MEM_F_SHARED);
-	pool2_s3path = create_pool("s3path", REQURI_LEN, MEM_F_SHARED);
-	pool2_s3copy_source = create_pool("s3copy_source", REQURI_LEN, MEM_F_SHARED);
 	pool2_uniqueid = create_pool("uniqueid", UNIQUEID_LEN, MEM_F_SHARED);
 }
 
@@ -2993,62 +2990,8 @@ int http_wait_for_request(struct session *s, struct channel *req, int an_bit)
 	char buffer[1024];
 	memset(buffer, '\0', 1024);
 #ifdef USE_S3GW
-	if (global.s3.enabled) {
-		int path_len = 0;
-		memset(&txn->s3gw, 0, sizeof(txn->s3gw));
-
-		if (likely(txn->meth != HTTP_METH_DELETE &&
-				txn->meth != HTTP_METH_POST &&
-				txn->meth != HTTP_METH_PUT)) {
-			txn->s3gw.ignore = 1;
-			goto no_notification;
-		}
-
-		/* TODO: not use the first appearance, use the latest one */
-		ctx.idx = 0;
-		if (http_find_header2("X-Notifications", 15, txn->req.chn->buf->p, &txn->hdr_idx, &ctx)) {
-			if (ctx.vlen == 5 && strncasecmp(ctx.line + ctx.val, "False", 5)) {
-				txn->s3gw.ignore = 1;
-				goto no_notification;
-			}
-		}
-
-		ctx.idx = 0;
-		if (unlikely(http_find_header2("x-amz-copy-source", 17, txn->req.chn->buf->p, &txn->hdr_idx, &ctx))) {
-			if (unlikely(ctx.vlen >= REQURI_LEN)) {
-				char *long_url = calloc(1, ctx.vlen);
-				memcpy(long_url, ctx.line + ctx.val, ctx.vlen);
-				send_log(NULL, LOG_ERR, "[s3] x-amz-copy-source is too long. Url: %s\n", long_url);
-				free(long_url);
-				txn->s3gw.ignore = 1;
-				goto no_notification;
-			}
-			txn->s3gw.copy_source = pool_alloc2(pool2_s3copy_source);
-			memcpy(txn->s3gw.copy_source, ctx.line + ctx.val, ctx.vlen);
-			txn->s3gw.copy_source[ctx.vlen] = 0;
-		}
-
-		if (unlikely(!txn->req.sl.rq.u_l)) {
-			/* no path - we can skip */
-			txn->s3gw.ignore = 1;
-			goto no_notification;
-		}
-
-		/* copy url path */
-		if (unlikely(path_len >= REQURI_LEN)) {
-			char *long_url = calloc(1, txn->req.sl.rq.u_l);
-			memcpy(long_url, req->buf->p + txn->req.sl.rq.u, txn->req.sl.rq.u_l);
-			send_log(NULL, LOG_ERR, "[s3] URL path is too long. Url: %s\n", long_url);
-			free(long_url);
-			txn->s3gw.ignore = 1;
-			goto no_notification;
-		}
-		txn->s3gw.path = pool_alloc2(pool2_s3path);
-		path_len = txn->req.sl.rq.u_l;
-		memcpy(txn->s3gw.path, req->buf->p + txn->req.sl.rq.u, path_len);
-		txn->s3gw.path[path_len] = 0;
-	}
-no_notification:
+	if (global.s3.enabled)
+		s3gw_capture(txn);
 #endif /* S3GW */
 
 	ctx.idx = 0;
@@ -5450,6 +5393,18 @@ int http_request_forward_body(struct session *s, struct channel *req, int an_bit
 
 	while (1) {
 		if (msg->msg_state == HTTP_MSG_DATA) {
+#ifdef USE_S3GW
+			/* the body of a multi-object delete is parsed as it
+			 * arrives, and only what was parsed gets forwarded.
+			 */
+			if (unlikely(txn->s3gw.del != NULL) && s3gw_delete_parsing(txn->s3gw.del)) {
+				int len = MIN(msg->chunk_len, req->buf->i - msg->next);
+
+				s3gw_delete_parse_buf(txn->s3gw.del, req->buf, msg->next, len);
+				msg->next += len;
+				msg->chunk_len -= len;
+			}
+#endif /* USE_S3GW */
 			/* must still forward */
 			/* we may have some pending data starting at req->buf->p */
 			if (msg->chunk_len > req->buf->i - msg->next) {
@@ -5580,7 +5535,11 @@ int http_request_forward_body(struct session *s, struct channel *req, int an_bit
 		msg->sov -= msg->next + MIN(msg->chunk_len, req->buf->i);
 
 	msg->next = 0;
-	msg->chunk_len -= channel_forward(req, msg->chunk_len);
+#ifdef USE_S3GW
+	/* the rest of a multi-object delete must go through the parser */
+	if (likely(txn->s3gw.del == NULL) || !s3gw_delete_parsing(txn->s3gw.del))
+#endif /* USE_S3GW */
+		msg->chunk_len -= channel_forward(req, msg->chunk_len);
 
 	/* stop waiting for data if the input is closed before the end */
 	if (req->flags & CF_SHUTR) {
@@ -6064,7 +6023,7 @@ int http_wait_for_response(struct session *s, struct channel *rep, int an_bit)
 	}
 
 #ifdef USE_S3GW
-	if (!txn->s3gw.ignore)
+	if (txn->s3gw.bucket)
 		s3gw_enqueue(txn);
 #endif /* S3GW */
 
@@ -8848,10 +8807,12 @@ void http_end_txn(struct session *s)
 	pool_free2(pool2_uniqueid, s->unique_id);
 
 #ifdef USE_S3GW
-	pool_free2(pool2_s3path, txn->s3gw.path);
-	txn->s3gw.path = NULL;
-	pool_free2(pool2_s3copy_source, txn->s3gw.copy_source);
-	txn->s3gw.copy_source = NULL;
+	pool_free2(pool2_s3key, txn->s3gw.key);
+	txn->s3gw.key = NULL;
+	s3gw_delete_free(txn->s3gw.del);
+	txn->s3gw.del = NULL;
+	txn->s3gw.bucket = NULL;
+	txn->s3gw.query = 0;
 #endif /* USE_S3GW */
 
 	s->unique_id = NULL;
@@ -9822,7 +9783,7 @@ struct redirect_rule *http_parse_redirect_rule(const char *file, int linenum, st
  *     we'll never have any HTTP message there ;
  *   1 if an HTTP message is ready
  */
-static int
+int
 smp_prefetch_http(struct proxy *px, struct session *s, void *l7, unsigned int opt,
                   const struct arg *args, struct sample *smp, int req_vol)
 {
@@ -1,11 +1,28 @@
 #include <assert.h>
+#include <ctype.h>
 
+#include <common/chunk.h>
+#include <common/hash.h>
+#include <common/memory.h>
+#include <common/standard.h>
 #include <common/time.h>
 
+#include <ebsttree.h>
+
 #include <proto/haproxy_redis.h>
 #include <proto/log.h>
 #include <proto/proto_http.h>
+#include <proto/freq_ctr.h>
 #include <proto/s3gw.h>
+#include <proto/s3gw_delete.h>
+#include <proto/s3gw_filter.h>
+#include <proto/s3gw_json.h>
+#include <proto/s3gw_key.h>
+#include <proto/s3gw_shm.h>
+#include <proto/s3gw_sink.h>
+#include <proto/s3gw_spool.h>
+#include <proto/s3gw_stats.h>
+#include <proto/sample.h>
 #include <proto/task.h>
 
 #include <types/global.h>
@@ -14,280 +31,1856 @@
 #include <types/task.h>
 
 #include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+/* Servers with their nodes on the ring, that is the connected ones. A
+ * bucket is published to the server whose node is the closest to its hash.
+ */
+static struct eb_root shard_tree = EB_ROOT;
+
+/* replays the spooled events at s3.spool_replay_rate events per second */
+static struct task *replay_task = NULL;
+static struct freq_ctr replay_rate;
+static struct s3gw_event replay_event;
+
+/* moves the events of the other processes from the shared ring, see s3gw_shm.c */
+static struct task *drain_task = NULL;
+
+/* events held during the coalescing window of their bucket */
+static struct eb_root pending_keys = EB_ROOT;
+static struct eb_root pending_exps = EB_ROOT;
+static unsigned int nb_pending = 0;
+static struct task *coalesce_task = NULL;
+static struct pool_head *pool2_s3pending = NULL;
+
+struct s3gw_counters s3gw_counters;
+
+/* the commands sent to the servers, see s3gw_cmd_done() */
+static struct pool_head *pool2_s3cmd = NULL;
+
+/* highest level accepted by the global log servers, S3_LOG() skips the
+ * others. Everything is logged until s3gw_connect() knows the servers.
+ */
+int s3gw_log_maxlevel = LOG_DEBUG;
+
+/* object keys and copy sources of the requests to be notified */
+struct pool_head *pool2_s3key = NULL;
+
+/* buckets enabled for notifications, indexed by name */
+static struct eb_root bucket_index = EB_ROOT_UNIQUE;
+static unsigned int next_bucket_id = 0;
+
+/* scratch area used to build the pipelined commands */
+static const char **flush_argv = NULL;
+static size_t *flush_argvlen = NULL;
+static char *flush_done = NULL;
+static unsigned long long *flush_stamps = NULL;
+static struct chunk flush_payload = { .str = NULL };
+
+/* accounts for an event accepted in a queue */
+static inline void s3gw_enqueued() {
+	s3gw_counters.enqueued++;
+	update_freq_ctr(&s3gw_counters.enqueued_rate, 1);
+}
+
+/* returns the position of bucket <name> of <len> chars on the ring */
+static inline unsigned int s3gw_bucket_hash(const char *name, int len) {
+	return full_hash(hash_djb2(name, len));
+}
+
+/* puts the nodes of <shard> on the ring */
+static void s3gw_shard_up(struct s3gw_shard *shard) {
+	int i;
+
+	if (shard->connected)
+		return;
+	for (i = 0; i < shard->nb_nodes; i++)
+		eb32_insert(&shard_tree, &shard->nodes[i].node);
+	shard->connected = 1;
+}
+
+/* removes the nodes of <shard> from the ring, its buckets move to the next
+ * servers.
+ */
+static void s3gw_shard_down(struct s3gw_shard *shard) {
+	int i;
+
+	if (!shard->connected)
+		return;
+	for (i = 0; i < shard->nb_nodes; i++)
+		eb32_delete(&shard->nodes[i].node);
+	shard->connected = 0;
+}
+
+/* Returns the server of the bucket at position <hash> on the ring. It is
+ * the closest connected server, or the first configured one if none is
+ * connected, in which case the events wait for it.
+ */
+static struct s3gw_shard *s3gw_shard_get(unsigned int hash) {
+	struct eb32_node *next, *prev;
+
+	next = eb32_lookup_ge(&shard_tree, hash);
+	if (!next)
+		next = eb32_first(&shard_tree);
+	if (!next)
+		return LIST_NEXT(&global.s3.servers, struct s3gw_shard *, list);
+
+	prev = eb32_prev(next);
+	if (!prev)
+		prev = eb32_last(&shard_tree);
+
+	/* pick the closest of the nodes around <hash> */
+	if (hash - prev->key <= next->key - hash)
+		next = prev;
+	return eb32_entry(next, struct s3gw_shard_node, node)->shard;
+}
+
+/* Moves the events queued on <shard>, which just failed, to the servers which
+ * now own their buckets. Events stay where they are if no other server is
+ * connected or if the new one has no room left.
+ */
+static void s3gw_shard_failover(struct s3gw_shard *shard) {
+	struct s3gw_event *ev;
+	struct s3gw_shard *dst;
+	int moved = 0;
+
+	while (s3gw_ring_count(&shard->ring)) {
+		ev = s3gw_ring_peek(&shard->ring, 0);
+		dst = s3gw_shard_get(s3gw_bucket_hash(ev->data, ev->bucket_len));
+		if (dst == shard || !dst->connected || s3gw_ring_full(&dst->ring))
+			break;
+		memcpy(s3gw_ring_tail(&dst->ring), ev, sizeof(*ev));
+		s3gw_ring_commit(&dst->ring);
+		s3gw_ring_skip(&shard->ring, 1);
+		task_wakeup(dst->flush_task, TASK_WOKEN_OTHER);
+		moved++;
+	}
+
+	if (moved)
+		S3_LOG(NULL, LOG_NOTICE, "%d notification(s) of %s %s moved to other servers",
+		       moved, shard->sink->name, shard->addr);
+}
+
+/* Schedules the next connection attempt to <shard> after a failure. The delay
+ * doubles with each consecutive failure from s3.redis_reconnect_min up to
+ * s3.redis_reconnect_max, and a random part of up to half of it is removed so
+ * that the processes do not all retry at once.
+ */
+void s3gw_shard_retry(struct s3gw_shard *shard) {
+	unsigned int delay = global.s3.redis_reconnect_min;
+	unsigned int i;
+
+	for (i = 0; i < shard->failures && delay < global.s3.redis_reconnect_max; i++)
+		delay <<= 1;
+	if (delay > global.s3.redis_reconnect_max)
+		delay = global.s3.redis_reconnect_max;
+	delay -= random() % (delay / 2 + 1);
+
+	shard->state = S3GW_SHARD_DOWN;
+	shard->failures++;
+	shard->retries++;
+	s3gw_counters.retries++;
+	S3_LOG(NULL, LOG_NOTICE, "retrying %s %s in %u ms", shard->sink->name, shard->addr, delay);
+	shard->conn_task->expire = tick_add(now_ms, delay);
+	task_queue(shard->conn_task);
+}
+
+/* Called by the sink once <shard> is connected and ready, its buckets are
+ * published to it from now on.
+ */
+void s3gw_shard_ready(struct s3gw_shard *shard) {
+	S3_LOG(NULL, LOG_INFO, "connected to %s %s", shard->sink->name, shard->addr);
+	shard->state = S3GW_SHARD_UP;
+	shard->failures = 0;
+	shard->conn_task->expire = TICK_ETERNITY;
+	s3gw_shard_up(shard);
+
+	/* publish what was queued during the outage */
+	if (s3gw_ring_count(&shard->ring))
+		task_wakeup(shard->flush_task, TASK_WOKEN_OTHER);
+	if (replay_task && s3gw_spool_pending())
+		task_wakeup(replay_task, TASK_WOKEN_OTHER);
+}
+
+/* Called by the sink when the connection of <shard> is gone. Its buckets move
+ * to the other servers until the next attempt succeeds.
+ */
+void s3gw_shard_lost(struct s3gw_shard *shard) {
+	s3gw_shard_down(shard);
+
+	if (!global.s3.enabled)
+		return;
+
+	s3gw_shard_failover(shard);
+	s3gw_shard_retry(shard);
+}
+
+/* accounts for <cmd> handed to the connection of <shard> */
+void s3gw_cmd_sent(struct s3gw_shard *shard, struct s3gw_cmd *cmd) {
+	shard->inflight += cmd->events;
+	s3gw_counters.flushed += cmd->events;
+}
+
+/* Completes <cmd>, which <shard> either accepted (<ok> non-zero) or lost, and
+ * releases it.
+ */
+void s3gw_cmd_done(struct s3gw_shard *shard, struct s3gw_cmd *cmd, int ok) {
+	struct s3gw_bucket *b = cmd->bucket;
+	unsigned int count = cmd->events;
+
+	shard->inflight -= count;
+
+	if (!ok) {
+		s3gw_dropped(count);
+		if (b)
+			b->counters.failed += count;
+		pool_free2(pool2_s3cmd, cmd);
+		return;
+	}
+
+	s3gw_counters.published += count;
+	update_freq_ctr(&s3gw_counters.published_rate, count);
+	if (b) {
+		b->counters.published += count;
+		update_freq_ctr(&b->counters.published_rate, count);
+	}
+	s3gw_stats_acked(cmd);
+	pool_free2(pool2_s3cmd, cmd);
+
+	/* events may have been held back by the in-flight limit */
+	if (s3gw_ring_count(&shard->ring))
+		task_wakeup(shard->flush_task, TASK_WOKEN_OTHER);
+}
+
+/* Returns a new command carrying the <events> events of <bucket> stamped with
+ * <stamps>, or NULL if memory is missing. More stamps may be appended up to
+ * global.s3.flush_max_events.
+ */
+struct s3gw_cmd *s3gw_cmd_new(struct s3gw_bucket *bucket, const unsigned long long *stamps, int events) {
+	struct s3gw_cmd *cmd;
 
-#define S3_LOG(proxy, level, format, ...) send_log(proxy, level, "[s3] " format "\n", ## __VA_ARGS__)
+	cmd = pool_alloc2(pool2_s3cmd);
+	if (!cmd)
+		return NULL;
+	cmd->bucket = bucket;
+	cmd->events = events;
+	cmd->end = 0;
+	cmd->sent = now;
+	if (events)
+		memcpy(cmd->stamps, stamps, events * sizeof(*stamps));
+	return cmd;
+}
+
+/* releases <cmd> which was never sent */
+void s3gw_cmd_free(struct s3gw_cmd *cmd) {
+	pool_free2(pool2_s3cmd, cmd);
+}
+
+/* Called with the reply to the PING sent once connected. Traffic only goes
+ * to the server once it answered.
+ */
+static void redis_probe_cb(struct redisAsyncContext *ac, void *r, void *privdata) {
+	struct s3gw_shard *shard = ac->data;
+	redisReply *reply = r;
+
+	/* connection lost, redis_disconnect_cb() takes care of it */
+	if (!reply)
+		return;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		S3_LOG(NULL, LOG_ERR, "Redis server %s not ready: %s", shard->addr, reply->str);
+		redisAsyncDisconnect(ac);
+		return;
+	}
+
+	s3gw_shard_ready(shard);
+}
+
+/* called by hiredis once the non-blocking connect() completed or failed */
+static void redis_connect_cb(const struct redisAsyncContext *ac, int status) {
+	struct s3gw_shard *shard = ac->data;
+
+	if (status != REDIS_OK) {
+		S3_LOG(NULL, LOG_ERR, "connect to Redis server %s failed: %s", shard->addr, ac->errstr);
+		/* hiredis frees the context right after this callback */
+		shard->ctx = NULL;
+		s3gw_shard_retry(shard);
+		return;
+	}
+
+	/* half-open until the server answers a PING */
+	shard->state = S3GW_SHARD_PROBING;
+	if (redisAsyncCommand(shard->ctx, redis_probe_cb, NULL, "PING") != REDIS_OK)
+		redisAsyncDisconnect(shard->ctx);
+}
+
+/* called by hiredis when the connection is closed, on error or on purpose */
+static void redis_disconnect_cb(const struct redisAsyncContext *ac, int status) {
+	struct s3gw_shard *shard = ac->data;
+
+	shard->ctx = NULL;
+	if (status != REDIS_OK && global.s3.enabled)
+		S3_LOG(NULL, LOG_ERR, "lost connection to Redis server %s: %s", shard->addr, ac->errstr);
+	s3gw_shard_lost(shard);
+}
+
+/* Starts a non-blocking connection to <shard>, which must complete within
+ * s3.redis_timeout. A failure schedules the next attempt.
+ */
+static void redis_connect(struct s3gw_shard *shard) {
+	shard->state = S3GW_SHARD_CONNECTING;
+	if (shard->unix_path)
+		shard->ctx = redisAsyncConnectUnix(shard->unix_path);
+	else
+		shard->ctx = redisAsyncConnect(shard->ip, shard->port);
+
+	if (!shard->ctx || shard->ctx->err || redisHaAttach(shard->ctx) != REDIS_OK) {
+		S3_LOG(NULL, LOG_ERR, "connect to Redis server %s failed: %s", shard->addr,
+		       shard->ctx && shard->ctx->err ? shard->ctx->errstr : "out of resources");
+		if (shard->ctx) {
+			redisAsyncFree(shard->ctx);
+			shard->ctx = NULL;
+		}
+		s3gw_shard_retry(shard);
+		return;
+	}
+
+	/* the connection is only usable once redis_probe_cb() reports it */
+	shard->ctx->data = shard;
+	redisAsyncSetConnectCallback(shard->ctx, redis_connect_cb);
+	redisAsyncSetDisconnectCallback(shard->ctx, redis_disconnect_cb);
+	shard->conn_task->expire = tick_add(now_ms, global.s3.redis_timeout);
+	task_queue(shard->conn_task);
+}
+
+/* Frees the context of <shard>. A connected one reports itself through
+ * redis_disconnect_cb(), and the pending commands are completed as lost.
+ */
+static void redis_close(struct s3gw_shard *shard) {
+	struct redisAsyncContext *ac = shard->ctx;
 
-static struct redisContext *ctx = NULL;
-static struct task *reconnect_task = NULL;
-static int redis_is_connected = 0;
+	shard->ctx = NULL;
+	if (ac)
+		redisAsyncFree(ac);
+}
+
+/* Timer of the connection to a server. It starts the next attempt once the
+ * backoff delay expired, and gives up on a connect or a probe which did not
+ * complete within s3.redis_timeout, such as with a blackholed server.
+ */
+static struct task *s3gw_shard_timer(struct task *t) {
+	struct s3gw_shard *shard = t->context;
+
+	t->expire = TICK_ETERNITY;
+
+	switch (shard->state) {
+	case S3GW_SHARD_DOWN:
+		shard->sink->connect(shard);
+		break;
 
-/* called by redis_reconnect task */
-static struct task *redis_reconnect(struct task *t) {
-	redis_is_connected = 0;
-	if (ctx) {
-		redisFree(ctx);
-		ctx = NULL;
+	case S3GW_SHARD_CONNECTING:
+	case S3GW_SHARD_PROBING:
+		S3_LOG(NULL, LOG_ERR, "%s %s: %s timeout", shard->sink->name, shard->addr,
+		       shard->state == S3GW_SHARD_CONNECTING ? "connect" : "probe");
+		/* a connection lost on close reports itself through s3gw_shard_lost() */
+		shard->sink->close(shard);
+		if (shard->state != S3GW_SHARD_DOWN)
+			s3gw_shard_retry(shard);
+		break;
 	}
+	return t;
+}
 
-	if (s3gw_connect(0)) {
-		S3_LOG(NULL, LOG_ERR, "reconnect to Redis failed. Retry in 1 second.");
-		t->expire = tick_add(now_ms, 10000);
+/* completion callback of every published notification. <r> is NULL when the
+ * command was discarded because the connection went away. <privdata> is the
+ * s3gw_cmd describing the command.
+ */
+static void redis_reply_cb(struct redisAsyncContext *ac, void *r, void *privdata) {
+	struct s3gw_shard *shard = ac->data;
+	struct s3gw_cmd *cmd = privdata;
+	redisReply *reply = r;
+
+	if (!reply)
+		S3_LOG(NULL, LOG_ERR, "%u notification(s) dropped, connection to Redis server %s lost",
+		       cmd->events, shard->addr);
+	else if (reply->type == REDIS_REPLY_ERROR)
+		S3_LOG(NULL, LOG_ERR, "Redis message failed: %s", reply->str);
+	s3gw_cmd_done(shard, cmd, reply && reply->type != REDIS_REPLY_ERROR);
+}
+
+/* sends to <shard> the command made of the <argc> first entries of
+ * flush_argv/flush_argvlen, which carries <events> events of <bucket> stamped
+ * with the first entries of flush_stamps. Returns the hiredis status.
+ */
+static int s3gw_send(struct s3gw_shard *shard, struct s3gw_bucket *bucket, int argc, int events) {
+	struct s3gw_cmd *cmd;
+	int ret;
+
+	cmd = s3gw_cmd_new(bucket, flush_stamps, events);
+	if (!cmd)
+		return REDIS_ERR;
+
+	ret = redisAsyncCommandArgv(shard->ctx, redis_reply_cb, cmd,
+				    argc, flush_argv, flush_argvlen);
+	if (ret == REDIS_OK)
+		s3gw_cmd_sent(shard, cmd);
+	else
+		s3gw_cmd_free(cmd);
+	return ret;
+}
+
+/* builds the Redis key of the bucket of <ev> into <key> */
+static void s3gw_redis_key(char *key, const struct s3gw_event *ev) {
+	snprintf(key, S3GW_KEY_LEN, "%s:%.*s", global.s3.bucket_prefix, ev->bucket_len, ev->data);
+}
+
+/* publishes the <count> oldest events of <shard> with one multi-value LPUSH
+ * per bucket.
+ */
+static void s3gw_flush_list(struct s3gw_shard *shard, int count) {
+	struct s3gw_event *ev, *cur;
+	struct s3gw_bucket *b;
+	char key[S3GW_KEY_LEN];
+	int i, j;
+	int argc;
+
+	memset(flush_done, 0, count);
+
+	for (i = 0; i < count; i++) {
+		if (flush_done[i])
+			continue;
+		ev = s3gw_ring_peek(&shard->ring, i);
+		b = s3gw_bucket_lookup(ev->data, ev->bucket_len);
+
+		s3gw_redis_key(key, ev);
+		flush_argv[0] = "LPUSH";
+		flush_argvlen[0] = 5;
+		flush_argv[1] = key;
+		flush_argvlen[1] = strlen(key);
+		argc = 2;
+		chunk_reset(&flush_payload);
+
+		/* pick all the events of the same bucket, preserving their order */
+		for (j = i; j < count; j++) {
+			int start = flush_payload.len;
+
+			cur = s3gw_ring_peek(&shard->ring, j);
+			if (flush_done[j] ||
+			    cur->bucket_len != ev->bucket_len ||
+			    memcmp(cur->data, ev->data, ev->bucket_len) != 0)
+				continue;
+
+			flush_done[j] = 1;
+			if (!s3gw_encode_event(&flush_payload, cur, b)) {
+				/* buffer full, send what we have and start over */
+				if (argc > 2 && s3gw_send(shard, b, argc, argc - 2) != REDIS_OK)
+					s3gw_dropped(argc - 2);
+				argc = 2;
+				chunk_reset(&flush_payload);
+				start = 0;
+				if (!s3gw_encode_event(&flush_payload, cur, b)) {
+					s3gw_dropped(1);
+					S3_LOG(NULL, LOG_ERR, "notification too large, dropped");
+					continue;
+				}
+			}
+
+			flush_argv[argc] = flush_payload.str + start;
+			flush_argvlen[argc] = flush_payload.len - start;
+			flush_stamps[argc - 2] = cur->stamp;
+			argc++;
+		}
+
+		if (argc > 2 && s3gw_send(shard, b, argc, argc - 2) != REDIS_OK) {
+			s3gw_dropped(argc - 2);
+			S3_LOG(NULL, LOG_ERR, "could not enqueue %d notification(s)", argc - 2);
+		}
+	}
+}
+
+/* Publishes the <count> oldest events of <shard> with one XADD each. Streams
+ * take a single entry per command, the commands are still pipelined in one
+ * write. The streams are trimmed to about s3.redis_stream_maxlen entries.
+ */
+static void s3gw_flush_stream(struct s3gw_shard *shard, int count) {
+	static char maxlen[21];
+	struct s3gw_event *ev;
+	struct s3gw_bucket *b;
+	char key[S3GW_KEY_LEN];
+	int i, argc;
+
+	if (!*maxlen)
+		snprintf(maxlen, sizeof(maxlen), "%u", global.s3.redis_stream_maxlen);
+
+	for (i = 0; i < count; i++) {
+		ev = s3gw_ring_peek(&shard->ring, i);
+		b = s3gw_bucket_lookup(ev->data, ev->bucket_len);
+		chunk_reset(&flush_payload);
+		if (!s3gw_encode_event(&flush_payload, ev, b)) {
+			s3gw_dropped(1);
+			S3_LOG(NULL, LOG_ERR, "notification too large, dropped");
+			continue;
+		}
+
+		s3gw_redis_key(key, ev);
+		argc = 0;
+		flush_argv[argc] = "XADD";    flush_argvlen[argc++] = 4;
+		flush_argv[argc] = key;       flush_argvlen[argc++] = strlen(key);
+		if (global.s3.redis_stream_maxlen) {
+			flush_argv[argc] = "MAXLEN";  flush_argvlen[argc++] = 6;
+			flush_argv[argc] = "~";       flush_argvlen[argc++] = 1;
+			flush_argv[argc] = maxlen;    flush_argvlen[argc++] = strlen(maxlen);
+		}
+		flush_argv[argc] = "*";       flush_argvlen[argc++] = 1;
+		flush_argv[argc] = "data";    flush_argvlen[argc++] = 4;
+		flush_argv[argc] = flush_payload.str;
+		flush_argvlen[argc++] = flush_payload.len;
+		flush_stamps[0] = ev->stamp;
+
+		if (s3gw_send(shard, b, argc, 1) != REDIS_OK) {
+			s3gw_dropped(1);
+			S3_LOG(NULL, LOG_ERR, "could not enqueue a notification");
+		}
+	}
+}
+
+/* Publishes the <count> oldest events of <shard> using the commands of the
+ * configured s3.redis_sink. All the commands end up in the output buffer of
+ * the async context, which the poller writes at once.
+ */
+static int redis_flush(struct s3gw_shard *shard, int count) {
+	if (!shard->ctx)
+		return 0;
+
+	if (global.s3.redis_sink == S3GW_SINK_STREAM)
+		s3gw_flush_stream(shard, count);
+	else
+		s3gw_flush_list(shard, count);
+	return count;
+}
+
+const struct s3gw_sink_ops s3gw_redis_sink = {
+	.name    = "Redis server",
+	.type    = "redis",
+	.connect = redis_connect,
+	.flush   = redis_flush,
+	.close   = redis_close,
+};
+
+/* Publishes up to global.s3.flush_max_events events queued for the server in
+ * t->context through its sink. The task requeues itself if events are left.
+ * Nothing is sent while the server is not connected, the events wait in the
+ * ring until s3gw_shard_ready() wakes us up again or they are moved to another
+ * server. A sink which takes nothing wakes us up once it may take more.
+ */
+static struct task *s3gw_flush(struct task *t) {
+	struct s3gw_shard *shard = t->context;
+	int count;
+
+	t->expire = TICK_ETERNITY;
+
+	if (!shard->connected)
+		return t;
+
+	count = s3gw_ring_count(&shard->ring);
+	if (count > global.s3.flush_max_events)
+		count = global.s3.flush_max_events;
+	if (count > global.s3.max_inflight - shard->inflight)
+		count = global.s3.max_inflight - shard->inflight;
+	if (count <= 0)
+		return t;
+
+	count = shard->sink->flush(shard, count);
+	s3gw_ring_skip(&shard->ring, count);
+
+	if (count && s3gw_ring_count(&shard->ring) && shard->inflight < global.s3.max_inflight)
+		task_wakeup(t, TASK_WOKEN_OTHER);
+
+	return t;
+}
+
+/* Moves spooled events back to the rings while Redis is connected. At most
+ * s3.spool_replay_rate events are replayed per second, and only the first
+ * half of each ring is used so that the live traffic is not starved. Since the
+ * destination of an event is only known once it is read, the budget is bound
+ * by the ring which has the least room left.
+ */
+static struct task *s3gw_replay(struct task *t) {
+	struct s3gw_shard *shard;
+	unsigned int budget, room, count = 0;
+
+	t->expire = TICK_ETERNITY;
+
+	if (eb_is_empty(&shard_tree) || !s3gw_spool_pending())
 		return t;
-	} else {
-		t->expire = 0;
+
+	budget = freq_ctr_remain(&replay_rate, global.s3.spool_replay_rate, 0);
+	list_for_each_entry(shard, &global.s3.servers, list) {
+		if (!shard->connected)
+			continue;
+		room = shard->ring.size / 2;
+		room = room > s3gw_ring_count(&shard->ring) ? room - s3gw_ring_count(&shard->ring) : 0;
+		if (budget > room)
+			budget = room;
+	}
+	if (budget > global.s3.flush_max_events)
+		budget = global.s3.flush_max_events;
+
+	while (count < budget && s3gw_spool_read(&replay_event)) {
+		shard = s3gw_shard_get(s3gw_bucket_hash(replay_event.data, replay_event.bucket_len));
+		memcpy(s3gw_ring_tail(&shard->ring), &replay_event, sizeof(replay_event));
+		s3gw_ring_commit(&shard->ring);
+		task_wakeup(shard->flush_task, TASK_WOKEN_OTHER);
+		count++;
 	}
 
+	if (count) {
+		update_freq_ctr(&replay_rate, count);
+		s3gw_counters.replayed += count;
+	}
+
+	if (s3gw_spool_pending()) {
+		unsigned int wait = next_event_delay(&replay_rate, global.s3.spool_replay_rate, 0);
+
+		/* retry soon if the rings had no room left */
+		t->expire = tick_add(now_ms, wait ? wait : 10);
+	}
 	return t;
 }
 
-static void schedule_redis_reconnect() {
-	if (reconnect_task == NULL) {
-		reconnect_task = task_new();
-		if (!reconnect_task) {
-			/* no memory */
+/* an event before it is copied into the ring or the spool */
+struct s3gw_event_src {
+	int type;
+	int schema;
+	unsigned int hash;              /* of the bucket, see s3gw_bucket_hash() */
+	long long size;
+	unsigned long long stamp;
+	unsigned long long sequencer;
+	unsigned int coalesce;          /* coalescing window of the bucket */
+	const char *bucket, *key, *source, *etag, *version, *request_id;
+	int bucket_len, key_len, source_len, etag_len, version_len, request_id_len;
+};
+
+/* fills <ev> with the event description */
+static void s3gw_fill_event(struct s3gw_event *ev, const struct s3gw_event_src *src) {
+	char *p = ev->data;
+
+	ev->type = src->type;
+	ev->schema = src->schema;
+	ev->size = src->size;
+	ev->stamp = src->stamp;
+	ev->sequencer = src->sequencer;
+	ev->count = 1;
+	ev->bucket_len = src->bucket_len;
+	ev->key_len = src->key_len;
+	ev->source_len = src->source_len;
+	ev->etag_len = src->etag_len;
+	ev->version_len = src->version_len;
+	ev->request_id_len = src->request_id_len;
+	memcpy(p, src->bucket, src->bucket_len);         p += src->bucket_len;
+	memcpy(p, src->key, src->key_len);               p += src->key_len;
+	memcpy(p, src->source, src->source_len);         p += src->source_len;
+	memcpy(p, src->etag, src->etag_len);             p += src->etag_len;
+	memcpy(p, src->version, src->version_len);       p += src->version_len;
+	memcpy(p, src->request_id, src->request_id_len);
+}
+
+/* Returns non-zero if <ev> was written to the spool because <shard> cannot
+ * take it right now, which only happens with the spill policy. The ring is
+ * then kept for the live traffic.
+ */
+static int s3gw_spill(struct s3gw_shard *shard, const struct s3gw_event *ev) {
+	if (s3gw_spool_write(ev) != 0)
+		return 0;
+
+	s3gw_counters.spooled++;
+	if (shard->connected && !tick_isset(replay_task->expire))
+		task_wakeup(replay_task, TASK_WOKEN_OTHER);
+	return 1;
+}
+
+/* returns non-zero if the events for <shard> must go to the spool */
+static inline int s3gw_must_spill(const struct s3gw_shard *shard) {
+	return global.s3.queue_overflow == S3GW_OVF_SPILL &&
+	       (!shard->connected || s3gw_ring_full(&shard->ring));
+}
+
+/* Returns the slot of the next event of <shard>. When the ring is full, the
+ * configured overflow policy decides which event is lost, NULL is returned if
+ * it is the new one.
+ */
+static struct s3gw_event *s3gw_queue_reserve(struct s3gw_shard *shard) {
+	if (s3gw_ring_full(&shard->ring)) {
+		s3gw_dropped(1);
+		if (global.s3.queue_overflow != S3GW_OVF_DROP_OLDEST)
+			return NULL;
+		s3gw_ring_skip(&shard->ring, 1);
+	}
+	return s3gw_ring_tail(&shard->ring);
+}
+
+/* queues the event filled in the reserved slot of <shard> and makes sure the
+ * flush task will run, either at the next loop iteration or after the
+ * configured flush delay.
+ */
+static void s3gw_queue_commit(struct s3gw_shard *shard) {
+	s3gw_ring_commit(&shard->ring);
+
+	if (s3gw_ring_count(&shard->ring) >= global.s3.flush_max_events || !global.s3.flush_delay)
+		task_wakeup(shard->flush_task, TASK_WOKEN_OTHER);
+	else if (!tick_isset(shard->flush_task->expire))
+		task_schedule(shard->flush_task, tick_add(now_ms, global.s3.flush_delay));
+}
+
+/* Queues <ev>, which is copied, the same way as s3gw_queue_event(). Returns 0
+ * if it was dropped.
+ */
+static int s3gw_queue_built(const struct s3gw_event *ev) {
+	struct s3gw_shard *shard;
+	struct s3gw_event *dst;
+	unsigned int pos;
+
+	if (s3gw_shm_producer()) {
+		dst = s3gw_shm_reserve(&pos);
+		if (!dst) {
+			s3gw_dropped(1);
+			S3_LOG(NULL, LOG_ERR, "shared queue full, notification dropped");
+			return 0;
+		}
+		memcpy(dst, ev, sizeof(*dst));
+		s3gw_shm_commit(pos);
+		return 1;
+	}
+
+	shard = s3gw_shard_get(s3gw_bucket_hash(ev->data, ev->bucket_len));
+	if (s3gw_must_spill(shard) && s3gw_spill(shard, ev))
+		return 1;
+
+	dst = s3gw_queue_reserve(shard);
+	if (!dst)
+		return 0;
+	memcpy(dst, ev, sizeof(*dst));
+	s3gw_queue_commit(shard);
+	return 1;
+}
+
+/* returns the pending event with the same bucket, key and type as <src>, whose
+ * key hash is <hash>, or NULL.
+ */
+static struct s3gw_pending *s3gw_pending_lookup(const struct s3gw_event_src *src, unsigned int hash) {
+	struct eb32_node *node;
+	struct s3gw_pending *p;
+
+	for (node = eb32_lookup(&pending_keys, hash); node; node = eb32_next_dup(node)) {
+		p = eb32_entry(node, struct s3gw_pending, node);
+		if (p->ev.type == src->type &&
+		    p->ev.bucket_len == src->bucket_len && p->ev.key_len == src->key_len &&
+		    memcmp(p->ev.data, src->bucket, src->bucket_len) == 0 &&
+		    memcmp(s3gw_ev_key(&p->ev), src->key, src->key_len) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+/* Holds the event described by <src> for the coalescing window of its bucket.
+ * An event already held for the same bucket, key and type takes its contents,
+ * so that the latest state is published, and counts it. Returns 0 if the event
+ * must be queued right away because too many events are held.
+ */
+static int s3gw_coalesce(const struct s3gw_event_src *src) {
+	unsigned int hash = full_hash(hash_djb2(src->key, src->key_len) + src->hash + src->type);
+	struct s3gw_pending *p;
+	unsigned int count;
+
+	p = s3gw_pending_lookup(src, hash);
+	if (p) {
+		count = p->ev.count;
+		s3gw_fill_event(&p->ev, src);
+		p->ev.count = count + 1;
+		s3gw_counters.coalesced++;
+		return 1;
+	}
+
+	if (nb_pending >= global.s3.coalesce_size)
+		return 0;
+	p = pool_alloc2(pool2_s3pending);
+	if (!p)
+		return 0;
+
+	s3gw_fill_event(&p->ev, src);
+	p->node.key = hash;
+	eb32_insert(&pending_keys, &p->node);
+	p->exp.key = tick_add(now_ms, src->coalesce);
+	eb32_insert(&pending_exps, &p->exp);
+	nb_pending++;
+	task_schedule(coalesce_task, p->exp.key);
+	return 1;
+}
+
+/* queues the held events whose coalescing window expired */
+static struct task *s3gw_coalesce_expire(struct task *t) {
+	struct s3gw_pending *p;
+	struct eb32_node *eb;
+	int looped = 0;
+
+	t->expire = TICK_ETERNITY;
+	eb = eb32_lookup_ge(&pending_exps, now_ms - TIMER_LOOK_BACK);
+
+	while (1) {
+		if (unlikely(!eb)) {
+			/* <now_ms> may be in the first half of the tree, loop back
+			 * to its beginning once.
+			 */
+			if (looped)
+				break;
+			looped = 1;
+			eb = eb32_first(&pending_exps);
+			if (likely(!eb))
+				break;
+		}
+
+		if (likely(tick_is_lt(now_ms, eb->key))) {
+			t->expire = eb->key;
+			break;
+		}
+
+		p = eb32_entry(eb, struct s3gw_pending, exp);
+		eb = eb32_next(eb);
+		eb32_delete(&p->exp);
+		eb32_delete(&p->node);
+		nb_pending--;
+		if (s3gw_queue_built(&p->ev))
+			s3gw_enqueued();
+		pool_free2(pool2_s3pending, p);
+	}
+	return t;
+}
+
+/* returns the number of events held in the coalescing windows */
+unsigned int s3gw_pending_count() {
+	return nb_pending;
+}
+
+/* Appends a new event to the ring of the Redis server of its bucket, or to
+ * the shared ring when another process publishes. Events of buckets with a
+ * coalescing window are held first. Nothing is allocated here otherwise.
+ */
+static void s3gw_queue_event(const struct s3gw_event_src *src) {
+	struct s3gw_shard *shard;
+	struct s3gw_event *ev;
+	unsigned int pos;
+
+	if (src->bucket_len + src->key_len + src->source_len + src->etag_len +
+	    src->version_len + src->request_id_len > sizeof(ev->data)) {
+		s3gw_dropped(1);
+		S3_LOG(NULL, LOG_ERR, "notification too large, dropped");
+		return;
+	}
+
+	if (src->coalesce && s3gw_coalesce(src))
+		return;
+
+	if (s3gw_shm_producer()) {
+		ev = s3gw_shm_reserve(&pos);
+		if (!ev) {
+			s3gw_dropped(1);
+			S3_LOG(NULL, LOG_ERR, "shared queue full, notification dropped");
 			return;
 		}
+		s3gw_fill_event(ev, src);
+		s3gw_shm_commit(pos);
+		s3gw_enqueued();
+		return;
+	}
 
-		reconnect_task->process = redis_reconnect;
-	} else if (tick_isset(reconnect_task->expire)) { /* check if alrady enqueued */
+	shard = s3gw_shard_get(src->hash);
+
+	if (s3gw_must_spill(shard)) {
+		struct s3gw_event spilled;
+
+		s3gw_fill_event(&spilled, src);
+		if (s3gw_spill(shard, &spilled)) {
+			s3gw_enqueued();
 			return;
+		}
+		/* spool full or failing, fall back to the ring */
+	}
+
+	ev = s3gw_queue_reserve(shard);
+	if (!ev)
+		return;
+	s3gw_fill_event(ev, src);
+	s3gw_queue_commit(shard);
+	s3gw_enqueued();
+}
+
+/* Moves the events written by the other processes to the shared ring into the
+ * rings of their Redis servers, at most s3.flush_max_events at once. The task
+ * sleeps once the shared ring is empty, until the doorbell wakes it up.
+ */
+static struct task *s3gw_drain(struct task *t) {
+	struct s3gw_event *ev;
+	int count = 0;
+
+	t->expire = TICK_ETERNITY;
+
+	while (count < global.s3.flush_max_events && (ev = s3gw_shm_peek())) {
+		s3gw_queue_built(ev);
+		s3gw_shm_release();
+		count++;
+	}
+
+	if (count == global.s3.flush_max_events || !s3gw_shm_idle())
+		task_wakeup(t, TASK_WOKEN_OTHER);
+	return t;
+}
+
+/* allocates the queue and the flush task of <shard>, and the nodes it puts on
+ * the ring once connected. The position of the nodes only depends on the
+ * address of the server, so that the buckets stay on the same servers when
+ * the configuration is reordered. Returns non-zero on failure.
+ */
+static int s3gw_shard_init(struct s3gw_shard *shard) {
+	unsigned int hash = hash_djb2(shard->addr, strlen(shard->addr));
+	int i;
+
+	shard->flush_task = task_new();
+	shard->conn_task = task_new();
+	shard->nb_nodes = shard->weight * S3GW_SHARD_POINTS;
+	shard->nodes = calloc(shard->nb_nodes, sizeof(*shard->nodes));
+	if (!shard->flush_task || !shard->conn_task || !shard->nodes ||
+	    s3gw_ring_init(&shard->ring, global.s3.queue_size))
+		return 1;
+
+	shard->conn_task->process = s3gw_shard_timer;
+	shard->conn_task->context = shard;
+	shard->conn_task->expire = TICK_ETERNITY;
+
+	shard->flush_task->process = s3gw_flush;
+	shard->flush_task->context = shard;
+	shard->flush_task->expire = TICK_ETERNITY;
+
+	for (i = 0; i < shard->nb_nodes; i++) {
+		shard->nodes[i].shard = shard;
+		shard->nodes[i].node.key = full_hash(hash + i);
+	}
+	return 0;
+}
+
+/* allocates what the coalescing windows need, once. Returns non-zero on
+ * failure.
+ */
+static int s3gw_coalesce_init() {
+	if (coalesce_task)
+		return 0;
+
+	pool2_s3pending = create_pool("s3pending", sizeof(struct s3gw_pending), MEM_F_SHARED);
+	coalesce_task = task_new();
+	if (!pool2_s3pending || !coalesce_task)
+		return 1;
+	coalesce_task->process = s3gw_coalesce_expire;
+	coalesce_task->expire = TICK_ETERNITY;
+	return 0;
+}
+
+/* allocates the queues and the flush tasks. Returns non-zero on failure. */
+static int s3gw_init_queue() {
+	struct s3gw_bucket *bucket;
+	struct s3gw_shard *shard;
+	int argc;
+
+	if (!global.s3.max_inflight)
+		global.s3.max_inflight = global.s3.queue_size;
+
+	pool2_s3key = create_pool("s3key", REQURI_LEN, MEM_F_SHARED);
+	pool2_s3cmd = create_pool("s3cmd", sizeof(struct s3gw_cmd) +
+	                          global.s3.flush_max_events * sizeof(*flush_stamps), MEM_F_SHARED);
+	if (!pool2_s3key || !pool2_s3cmd || s3gw_delete_init())
+		return 1;
+
+	list_for_each_entry(bucket, &global.s3.buckets, list) {
+		if (bucket->coalesce) {
+			if (s3gw_coalesce_init())
+				return 1;
+			break;
+		}
+	}
+
+	/* the other processes only fill the shared ring */
+	if (s3gw_shm_producer())
+		return s3gw_shm_attach(NULL);
+
+	/* LPUSH takes up to flush_max_events values, XADD 8 arguments */
+	argc = global.s3.flush_max_events + 2 > 8 ? global.s3.flush_max_events + 2 : 8;
+	flush_argv = calloc(argc, sizeof(*flush_argv));
+	flush_argvlen = calloc(argc, sizeof(*flush_argvlen));
+	flush_done = calloc(global.s3.flush_max_events, 1);
+	flush_stamps = calloc(global.s3.flush_max_events, sizeof(*flush_stamps));
+	flush_payload.str = malloc(global.tune.bufsize);
+
+	if (!flush_argv || !flush_argvlen || !flush_done || !flush_stamps || !flush_payload.str)
+		return 1;
+
+	list_for_each_entry(shard, &global.s3.servers, list) {
+		if (s3gw_shard_init(shard))
+			return 1;
+	}
+
+	if (global.s3.queue_overflow == S3GW_OVF_SPILL) {
+		if (s3gw_spool_init())
+			return 1;
+		replay_task = task_new();
+		if (!replay_task)
+			return 1;
+		replay_task->process = s3gw_replay;
+		replay_task->expire = TICK_ETERNITY;
+	}
+
+	if (s3gw_shm) {
+		drain_task = task_new();
+		if (!drain_task)
+			return 1;
+		drain_task->process = s3gw_drain;
+		drain_task->expire = TICK_ETERNITY;
+		if (s3gw_shm_attach(drain_task))
+			return 1;
+		/* collect what was queued before we were ready */
+		task_wakeup(drain_task, TASK_WOKEN_INIT);
 	}
 
-	task_schedule(reconnect_task, tick_add(now_ms, 1000)); /* try again in 1 second */
+	flush_payload.size = global.tune.bufsize;
+	flush_payload.len = 0;
+	return 0;
 }
 
-/* return 0 if everything ok or wrong configured.
- * retcode is used to define if a reconnect is required. */
+/* Declares the server at <addr> reached through <sink>, with weight <weight>.
+ * The address is either "<ip>:<port>" or the absolute path of a UNIX socket,
+ * the only kind a UNIX sink takes. Returns the server, or NULL if the address
+ * is invalid or memory is missing.
+ */
+struct s3gw_shard *s3gw_shard_add(const char *addr, int weight, const struct s3gw_sink_ops *sink) {
+	struct s3gw_shard *shard;
+	const char *colon;
+
+	if (sink == &s3gw_unix_sink && *addr != '/')
+		return NULL;
+
+	shard = calloc(1, sizeof(*shard));
+	if (!shard)
+		return NULL;
+
+	shard->sink = sink;
+	shard->addr = strdup(addr);
+	shard->weight = weight;
+	if (!shard->addr)
+		goto fail;
+
+	if (*addr == '/') {
+		shard->unix_path = strdup(addr);
+		if (!shard->unix_path)
+			goto fail;
+	}
+	else {
+		colon = strrchr(addr, ':');
+		if (!colon || colon == addr)
+			goto fail;
+		shard->port = atol(colon + 1);
+		if (shard->port < 1 || shard->port > 65535)
+			goto fail;
+		shard->ip = my_strndup(addr, colon - addr);
+		if (!shard->ip)
+			goto fail;
+	}
+
+	LIST_ADDQ(&global.s3.servers, &shard->list);
+	return shard;
+
+ fail:
+	free(shard->ip);
+	free(shard->unix_path);
+	free(shard->addr);
+	free(shard);
+	return NULL;
+}
+
+/* Initializes the notifications and starts connecting to the Redis servers.
+ * Notifications are disabled on configuration errors. Unreachable servers
+ * are retried by their own timer. Always returns 0.
+ */
 int s3gw_connect(int initial) {
+	struct logsrv *logsrv;
+	struct s3gw_shard *shard;
+	char addr[64];
+
+	if (initial) {
+		s3gw_log_maxlevel = -1;
+		list_for_each_entry(logsrv, &global.logsrvs, list) {
+			if (logsrv->level > s3gw_log_maxlevel)
+				s3gw_log_maxlevel = logsrv->level;
+		}
+	}
+
 	if (LIST_ISEMPTY(&global.s3.buckets)) {
 		send_log(NULL, LOG_ERR, "s3 notifications enabled but no buckets are defined. Disabling s3 notifications.");
 		global.s3.enabled = 0;
 		return 0;
 	}
 
-	if (global.s3.redis_ip && global.s3.redis_port) {
-		ctx = redisConnect(global.s3.redis_ip, global.s3.redis_port);
-	} else if (global.s3.redis_unix_path) {
-		ctx = redisConnectUnix(global.s3.redis_unix_path);
-	} else {
-		send_log(NULL, LOG_ERR, "s3 notifications enabled but no Redis server is configured.\n");
-		send_log(NULL, LOG_ERR, "configure a Redis server or a unix path\n");
-		send_log(NULL, LOG_ERR, "Disabling s3 notifications.\n");
+	if (initial)
+		s3gw_filter_build();
+
+	/* without any s3.redis_server, the single legacy server is used */
+	if (!s3gw_shm_producer() && LIST_ISEMPTY(&global.s3.servers)) {
+		if (global.s3.redis_ip && global.s3.redis_port) {
+			snprintf(addr, sizeof(addr), "%s:%d", global.s3.redis_ip, global.s3.redis_port);
+			shard = s3gw_shard_add(addr, 1, &s3gw_redis_sink);
+		} else if (global.s3.redis_unix_path) {
+			shard = s3gw_shard_add(global.s3.redis_unix_path, 1, &s3gw_redis_sink);
+		} else {
+			send_log(NULL, LOG_ERR, "s3 notifications enabled but no Redis server is configured.\n");
+			send_log(NULL, LOG_ERR, "configure a Redis server or a unix path\n");
+			send_log(NULL, LOG_ERR, "Disabling s3 notifications.\n");
+			global.s3.enabled = 0;
+			return 0;
+		}
+		if (!shard) {
+			send_log(NULL, LOG_ERR, "s3 notifications: invalid Redis server. Disabling s3 notifications.");
+			global.s3.enabled = 0;
+			return 0;
+		}
+	}
+
+	if (initial && s3gw_init_queue()) {
+		send_log(NULL, LOG_ERR, "s3 notifications: initialization failed. Disabling s3 notifications.");
 		global.s3.enabled = 0;
 		return 0;
 	}
 
-	if (!ctx || ctx->err) {
-		if (initial)
-			schedule_redis_reconnect();
-		return 1;
-	}
+	/* the publisher owns the Redis connections */
+	if (s3gw_shm_producer())
+		return 0;
 
-	redis_is_connected = 1;
+	list_for_each_entry(shard, &global.s3.servers, list) {
+		if (shard->state == S3GW_SHARD_DOWN && !tick_isset(shard->conn_task->expire))
+			shard->sink->connect(shard);
+	}
 
 	return 0;
 }
 
 void s3gw_deinit() {
+	struct s3gw_shard *shard, *back;
+	struct eb32_node *node;
+
 	global.s3.enabled = 0;
 
-	if (ctx) {
-		redisFree(ctx);
-		ctx = NULL;
+	list_for_each_entry_safe(shard, back, &global.s3.servers, list) {
+		shard->sink->close(shard);
+		if (shard->sink->release)
+			shard->sink->release(shard);
+		s3gw_shard_down(shard);
+
+		if (shard->conn_task) {
+			task_delete(shard->conn_task);
+			task_free(shard->conn_task);
+		}
+		if (shard->flush_task) {
+			task_delete(shard->flush_task);
+			task_free(shard->flush_task);
+		}
+		s3gw_ring_destroy(&shard->ring);
+		free(shard->nodes);
+		free(shard->ip);
+		free(shard->unix_path);
+		free(shard->addr);
+		LIST_DEL(&shard->list);
+		free(shard);
+	}
+
+	free(flush_argv); flush_argv = NULL;
+	free(flush_argvlen); flush_argvlen = NULL;
+	free(flush_done); flush_done = NULL;
+	free(flush_stamps); flush_stamps = NULL;
+	free(flush_payload.str); flush_payload.str = NULL;
+	pool2_s3key = pool_destroy2(pool2_s3key);
+	pool2_s3cmd = pool_destroy2(pool2_s3cmd);
+	s3gw_delete_deinit();
+
+	if (replay_task) {
+		task_delete(replay_task);
+		task_free(replay_task);
+		replay_task = NULL;
 	}
+	s3gw_spool_deinit();
+
+	/* events still held are lost */
+	while ((node = eb32_first(&pending_exps))) {
+		struct s3gw_pending *p = eb32_entry(node, struct s3gw_pending, exp);
 
-	if (reconnect_task) {
-		task_free(reconnect_task);
-		reconnect_task = NULL;
+		eb32_delete(&p->exp);
+		eb32_delete(&p->node);
+		pool_free2(pool2_s3pending, p);
 	}
+	nb_pending = 0;
+	pool2_s3pending = pool_destroy2(pool2_s3pending);
+	if (coalesce_task) {
+		task_delete(coalesce_task);
+		task_free(coalesce_task);
+		coalesce_task = NULL;
+	}
+
+	if (drain_task) {
+		task_delete(drain_task);
+		task_free(drain_task);
+		drain_task = NULL;
+	}
+	s3gw_shm_deinit();
 }
 
-/* using %b makes it possible to use pointer + len like copy_source is */
-/* WARNING: this must match the HTTP_METH */
-static const char *redis_commands[HTTP_METH_OTHER] = {
-	NULL, /* NONE */
-	NULL, /* OPTIONS */
-	NULL, /* GET */
-	NULL, /* HEAD */
-	"LPUSH %s:%b {\"event\":\"s3:ObjectCreated:Post\",\"objectKey\":\"%b\"}", /* POST */
-	"LPUSH %s:%b {\"event\":\"s3:ObjectCreated:Put\",\"objectKey\":\"%b\"}", /* PUT */
-	"LPUSH %s:%b {\"event\":\"s3:ObjectRemoved:Delete\",\"objectKey\":\"%b\"}", /* DELETE */
-};
+/* Returns the enabled bucket named after the <len> first chars of <name>, or
+ * NULL if it is not enabled. The lookup cost only depends on the length of
+ * the name, not on the number of buckets, and only an exact match is found.
+ */
+struct s3gw_bucket *s3gw_bucket_lookup(const char *name, int len) {
+	char key[S3GW_BUCKET_LEN + 1];
+	struct s3gw_bucket *bucket;
+	struct ebmb_node *node;
 
-static const char *redis_copy_command = "LPUSH %s:%b {\"event\":\"s3:ObjectCreated:Copy\",\"objectKey\":\"%b\",\"source\":\"%s\"}";
+	if (len > S3GW_BUCKET_LEN)
+		return NULL;
 
-/* split up the bucket and objectkey out of the uri */
-static int get_bucket_objectkey(
-		struct http_txn *txn,
-		const char **bucket,
-		int *bucket_len,
-		const char **objectkey,
-		int *object_len) {
+	/* the indexed names are zero-terminated, so is the key */
+	memcpy(key, name, len);
+	key[len] = 0;
+	node = ebst_lookup(&bucket_index, key);
+	if (!node)
+		return NULL;
+	bucket = ebmb_entry(node, struct s3gw_bucket, node);
+	return bucket->disabled ? NULL : bucket;
+}
 
-	/* e.g. uri = "POST /bar-fe80-eu/foobar HTTP 1.1"
-	 * bucket is bar-fe80-eu
-	 * key is foobar
-	 */
-	*bucket = NULL;
-	*objectkey = NULL;
+/* Enables notifications for bucket <name>. Returns the bucket, which may have
+ * already been enabled, or NULL if the name is invalid or memory is missing.
+ * A disabled bucket is returned as is, still disabled.
+ */
+struct s3gw_bucket *s3gw_bucket_add(const char *name) {
+	struct s3gw_bucket *bucket;
+	struct ebmb_node *node;
+	int len = strlen(name);
 
-	const char *ptr;
-	const char *start;
-	const char *end;
+	if (!len || len > S3GW_BUCKET_LEN)
+		return NULL;
 
-	int count_slashs = 0;
+	node = ebst_lookup(&bucket_index, name);
+	if (node)
+		return ebmb_entry(node, struct s3gw_bucket, node);
 
-	S3_LOG(NULL, LOG_INFO, "txn->uri: %s", txn->uri);
+	bucket = calloc(1, sizeof(*bucket) + len + 1);
+	if (!bucket)
+		return NULL;
 
-	if (!txn->s3gw.path)
-		return 1;
+	bucket->len = len;
+	bucket->hash = s3gw_bucket_hash(name, len);
+	bucket->id = next_bucket_id++;
+	memcpy(bucket->node.key, name, len + 1);
+	ebst_insert(&bucket_index, &bucket->node);
+	LIST_ADDQ(&global.s3.buckets, &bucket->list);
+	return bucket;
+}
+
+/* Parses the options of a bucket found in <args>, up to an empty one, into
+ * <opts>. Returns 0 and fills <err> on error.
+ */
+int s3gw_bucket_parse_opts(char **args, struct s3gw_bucket_opts *opts, char **err) {
+	const char *res;
 
-	start = ptr = txn->s3gw.path;
-	end = ptr + strlen(txn->s3gw.path);
-
-	while (ptr < end && *ptr != '?') {
-		if (*ptr == '/')
-			count_slashs++;
-		else if (!*bucket && count_slashs == 1) {
-			*bucket = ptr;
-		} else if (!*objectkey && count_slashs == 2) {
-			*bucket_len = ptr - start - 2; /* we are atm f of /foobar, so -2 would be the end */
-			*objectkey = ptr;
+	opts->schema = -1;
+	opts->encoding = -1;
+	opts->coalesce = -1;
+	opts->prefix = opts->suffix = NULL;
+
+	for (; **args; args += 2) {
+		if (!strcmp(args[0], "schema") &&
+		    (!strcmp(args[1], "v1") || !strcmp(args[1], "v2"))) {
+			opts->schema = strcmp(args[1], "v2") == 0 ? S3GW_SCHEMA_V2 : S3GW_SCHEMA_V1;
+		}
+		else if (!strcmp(args[0], "encoding") &&
+		         (!strcmp(args[1], "json") || !strcmp(args[1], "msgpack"))) {
+			opts->encoding = strcmp(args[1], "msgpack") == 0 ? S3GW_ENC_MSGPACK : S3GW_ENC_JSON;
+		}
+		else if (!strcmp(args[0], "coalesce") && *args[1]) {
+			res = parse_time_err(args[1], &opts->coalesce, TIME_UNIT_MS);
+			if (res) {
+				memprintf(err, "unexpected character '%c' in argument to <%s>", *res, args[0]);
+				return 0;
+			}
+		}
+		else if (!strcmp(args[0], "prefix") && *args[1])
+			opts->prefix = args[1];
+		else if (!strcmp(args[0], "suffix") && *args[1])
+			opts->suffix = args[1];
+		else {
+			memprintf(err, "unknown option '%s', expects [schema <v1|v2>] [encoding <json|msgpack>] [coalesce <time>] [prefix <str>] [suffix <str>]", args[0]);
+			return 0;
 		}
-		ptr++;
 	}
+	return 1;
+}
 
-	if (count_slashs < 2 || *objectkey == NULL || *bucket == NULL)
-		return 1;
+/* Applies <opts> to <bucket>. The options not set are kept, and a filter adds
+ * a rule to those of the bucket. Returns 0 and fills <err> on error, in which
+ * case the bucket is left unchanged.
+ */
+int s3gw_bucket_set_opts(struct s3gw_bucket *bucket, const struct s3gw_bucket_opts *opts, char **err) {
+	if ((opts->prefix || opts->suffix) &&
+	    !s3gw_filter_add(bucket, opts->prefix, opts->suffix, err))
+		return 0;
 
-	if(*ptr == '?')
-		*object_len = ptr - *objectkey;
-	else if (ptr == end)
-		*object_len = ptr - *objectkey;
+	if (opts->schema >= 0)
+		bucket->schema = opts->schema;
+	if (opts->encoding >= 0)
+		bucket->encoding = opts->encoding;
+	if (opts->coalesce != (unsigned int)-1)
+		bucket->coalesce = opts->coalesce;
+	return 1;
+}
 
-	/* start points to the first "/"
-	 * ptr points to last char before the query_string begins (/foobar/foo?go=foo, end will be o before '?')
-	 * end to the end of the url
-	 */
+/* Enables notifications for bucket <name> at runtime, with <opts> applied to
+ * it. A bucket disabled earlier gets its previous settings and counters back.
+ * Returns the bucket, or NULL with <err> filled on error, in which case
+ * nothing changed for the events.
+ */
+struct s3gw_bucket *s3gw_bucket_enable(const char *name, const struct s3gw_bucket_opts *opts, char **err) {
+	struct s3gw_bucket *bucket;
+	int created;
 
-	return 0;
+	if (!*name || strlen(name) > S3GW_BUCKET_LEN) {
+		memprintf(err, "invalid bucket name (max %d chars)", S3GW_BUCKET_LEN);
+		return NULL;
+	}
+
+	if (opts->coalesce && opts->coalesce != (unsigned int)-1 && s3gw_coalesce_init()) {
+		memprintf(err, "out of memory");
+		return NULL;
+	}
+
+	created = !ebst_lookup(&bucket_index, name);
+	bucket = s3gw_bucket_add(name);
+	if (!bucket) {
+		memprintf(err, "out of memory");
+		return NULL;
+	}
+
+	/* a new bucket stays invisible until it is complete */
+	if (created)
+		bucket->disabled = 1;
+
+	if (!s3gw_bucket_set_opts(bucket, opts, err)) {
+		if (created) {
+			/* nothing may reference it yet */
+			ebmb_delete(&bucket->node);
+			LIST_DEL(&bucket->list);
+			free(bucket);
+		}
+		return NULL;
+	}
+
+	if (opts->prefix || opts->suffix)
+		s3gw_filter_build();
+	bucket->disabled = 0;
+	return bucket;
+}
+
+/* Disables notifications for bucket <name>. The requests already captured
+ * are still notified. Returns 0 if the bucket is not enabled.
+ */
+int s3gw_bucket_disable(const char *name) {
+	struct s3gw_bucket *bucket;
+
+	bucket = s3gw_bucket_lookup(name, strlen(name));
+	if (!bucket)
+		return 0;
+	bucket->disabled = 1;
+	return 1;
 }
 
-static int check_bucket_valid_for_notification(const char *bucket, int bucket_len) {
-	struct s3gw_buckets *buckets;
+/* Removes the filter rules of bucket <name>, enabled or not, which then
+ * notifies about all its keys. Returns 0 if the bucket is unknown.
+ */
+int s3gw_bucket_clear_filters(const char *name) {
+	struct ebmb_node *node;
+
+	node = ebst_lookup(&bucket_index, name);
+	if (!node)
+		return 0;
+	s3gw_filter_clear(ebmb_entry(node, struct s3gw_bucket, node));
+	s3gw_filter_build();
+	return 1;
+}
+
+/* releases all the buckets */
+void s3gw_bucket_free_all() {
+	struct s3gw_bucket *bucket, *back;
+
+	list_for_each_entry_safe(bucket, back, &global.s3.buckets, list) {
+		ebmb_delete(&bucket->node);
+		LIST_DEL(&bucket->list);
+		free(bucket);
+	}
+	s3gw_filter_free_all();
+}
+
+
+/* query string parameters which identify a sub-resource. Their names are
+ * case sensitive.
+ */
+static const struct s3gw_subres {
+	const char *name;
+	int len;
+	unsigned int flag;
+	const char *fetch;              /* name of the sample fetch */
+} s3gw_subres[] = {
+	{ "acl",        3,  S3GW_Q_ACL,         "s3.acl"         },
+	{ "delete",     6,  S3GW_Q_DELETE,      "s3.delete"      },
+	{ "partNumber", 10, S3GW_Q_PART_NUMBER, "s3.part_number" },
+	{ "tagging",    7,  S3GW_Q_TAGGING,     "s3.tagging"     },
+	{ "uploadId",   8,  S3GW_Q_UPLOAD_ID,   "s3.upload_id"   },
+	{ "uploads",    7,  S3GW_Q_UPLOADS,     "s3.uploads"     },
+	{ "versionId",  9,  S3GW_Q_VERSION_ID,  "s3.version_id"  },
+	{ NULL,         0,  0,                  NULL             },
+};
+
+/* Returns the S3GW_Q_* flags of the request in <txn>. The query string is
+ * parsed once, in a single pass, the result is kept in the transaction. The
+ * request line must still be present in the buffer, which is no longer the
+ * case once the response is being parsed: 0 is returned if it was not
+ * classified before.
+ */
+unsigned int s3gw_query_flags(struct http_txn *txn) {
+	const char *p, *end, *name;
+	const struct s3gw_subres *sr;
+	unsigned int flags = S3GW_Q_DONE;
+
+	if (txn->s3gw.query & S3GW_Q_DONE)
+		return txn->s3gw.query;
+
+	if (txn->req.msg_state < HTTP_MSG_BODY || txn->rsp.msg_state != HTTP_MSG_RPBEFORE)
+		return 0;
 
-	list_for_each_entry(buckets, &global.s3.buckets, list) {
-		if (!strncmp(buckets->bucket, bucket, bucket_len))
+	p = txn->req.chn->buf->p + txn->req.sl.rq.u;
+	end = p + txn->req.sl.rq.u_l;
+	p = memchr(p, '?', end - p);
+	if (!p)
+		goto out;
+
+	while (p < end) {
+		name = ++p;
+		while (p < end && *p != '=' && *p != '&')
+			p++;
+		for (sr = s3gw_subres; sr->name; sr++) {
+			if (sr->len == p - name && memcmp(sr->name, name, sr->len) == 0) {
+				flags |= sr->flag;
+				break;
+			}
+		}
+		while (p < end && *p != '&')
+			p++;
+	}
+ out:
+	txn->s3gw.query = flags;
+	return flags;
+}
+
+/* boolean sample fetches telling whether the request addresses the sub-resource
+ * matching the keyword, e.g. "s3.uploads".
+ */
+static int
+smp_fetch_s3_subres(struct proxy *px, struct session *l4, void *l7, unsigned int opt,
+                    const struct arg *args, struct sample *smp, const char *kw)
+{
+	struct http_txn *txn = l7;
+	const struct s3gw_subres *sr;
+	unsigned int flags;
+	int ret;
+
+	ret = smp_prefetch_http(px, l4, l7, opt, args, smp, 1);
+	if (ret <= 0)
+		return ret;
+
+	flags = s3gw_query_flags(txn);
+	if (!flags)
+		return 0;
+
+	for (sr = s3gw_subres; sr->name; sr++) {
+		if (strcmp(sr->fetch, kw) == 0)
+			break;
+	}
+
+	smp->type = SMP_T_BOOL;
+	smp->data.uint = !!(flags & sr->flag);
+	smp->flags = SMP_F_VOL_1ST;
+	return 1;
+}
+
+/* Finds the bucket of a virtual-hosted-style request in <txn>, whose Host
+ * header is the bucket name followed by one of the s3.base_domain. Points
+ * <bucket> to the name in the header and sets <len>. Returns 0 if the request
+ * is path-style.
+ */
+static int s3gw_vhost_bucket(struct http_txn *txn, const char **bucket, int *len) {
+	struct http_msg *msg = &txn->req;
+	struct s3gw_domain *dom;
+	struct hdr_ctx ctx;
+	const char *host, *end, *p;
+
+	ctx.idx = 0;
+	if (!http_find_header2("Host", 4, msg->chn->buf->p, &txn->hdr_idx, &ctx))
+		return 0;
+
+	host = ctx.line + ctx.val;
+	end = host + ctx.vlen;
+
+	/* strip the port */
+	for (p = end - 1; p > host && isdigit((unsigned char)*p); p--)
+		;
+	if (p > host && *p == ':')
+		end = p;
+
+	list_for_each_entry(dom, &global.s3.base_domains, list) {
+		/* at least one char of bucket name, then a dot */
+		if (end - host < dom->len + 2)
+			continue;
+		p = end - dom->len;
+		if (p[-1] == '.' && strncasecmp(p, dom->name, dom->len) == 0) {
+			*bucket = host;
+			*len = p - 1 - host;
 			return 1;
+		}
 	}
+	return 0;
+}
+
+/* returns non-zero if the request in <txn> asks not to be notified */
+static int s3gw_notifications_off(struct http_txn *txn) {
+	struct hdr_ctx ctx;
 
+	/* TODO: not use the first appearance, use the latest one */
+	ctx.idx = 0;
+	if (http_find_header2("X-Notifications", 15, txn->req.chn->buf->p, &txn->hdr_idx, &ctx)) {
+		if (ctx.vlen == 5 && strncasecmp(ctx.line + ctx.val, "False", 5))
+			return 1;
+	}
 	return 0;
 }
 
-static void check_redis_state(redisReply *reply) {
-	if (!reply) {
+/* Prepares the parsing of the body of the multi-object delete in <txn> on
+ * the bucket of <len> chars at <name>, whose keys are only known once the
+ * body was forwarded.
+ */
+static void s3gw_capture_delete(struct http_txn *txn, const char *name, int len) {
+	struct s3gw_bucket *b;
+
+	b = s3gw_bucket_lookup(name, len);
+	if (!b) {
+		S3_LOG(NULL, LOG_INFO, "bucket '%.*s' not enabled for notifications", len, name);
 		return;
 	}
-	if (reply->type == REDIS_REPLY_ERROR) {
-		S3_LOG(NULL, LOG_ERR, "Redis message failed: %s", reply->str);
-		schedule_redis_reconnect();
-	}
+
+	if (s3gw_notifications_off(txn))
+		return;
+
+	txn->s3gw.del = s3gw_delete_new(b);
+	if (!txn->s3gw.del)
+		return;
+
+	txn->s3gw.bucket = b;
+	txn->s3gw.type = S3GW_EV_DELETE;
+	txn->s3gw.key_len = 0;
+	txn->s3gw.source_len = 0;
+	txn->s3gw.size = -1;
 }
 
-/* enqueue the message */
-void s3gw_enqueue(struct http_txn *txn) {
-	int ret = 0;
-	redisReply *reply = NULL;
-	const char *bucket = "";
-	int bucket_len = 0;
-	const char *objectkey = "";
-	int objectkey_len = 0;
+/* Captures what is needed to notify about the request in <txn> once its
+ * response is known. The URI is split into bucket and object key here, once,
+ * and the bucket is resolved. Nothing is allocated for requests which will
+ * not be notified. Otherwise a single pool object receives the object key
+ * and the copy source, the only parts which do not survive the request. They
+ * are percent-decoded on the way, and the key filters apply to the result.
+ */
+void s3gw_capture(struct http_txn *txn) {
+	struct http_msg *msg = &txn->req;
+	const char *uri = msg->chn->buf->p + msg->sl.rq.u;
+	const char *end = uri + msg->sl.rq.u_l;
+	const char *query, *bucket, *key, *source = NULL;
+	struct s3gw_bucket *b;
+	struct hdr_ctx ctx;
+	unsigned int flags;
+	int bucket_len, key_len, source_len = 0, type;
 
-	assert(txn);
+	if (likely(txn->meth != HTTP_METH_DELETE &&
+		   txn->meth != HTTP_METH_POST &&
+		   txn->meth != HTTP_METH_PUT))
+		return;
 
-	/* check if properly connected */
-	if (!redis_is_connected || !ctx || ctx->err) {
-		/* only log at the moment */
+	/* e.g. uri = "/bar-fe80-eu/foobar?acl"
+	 * bucket is bar-fe80-eu
+	 * key is foobar
+	 * or, with "Host: bar-fe80-eu.<base_domain>", uri = "/foobar?acl"
+	 */
+	if (uri == end || *uri != '/')
 		return;
-	}
 
-	if (txn->status < 200 || txn->status > 300) {
+	query = memchr(uri, '?', end - uri);
+	if (query)
+		end = query;
+	flags = s3gw_query_flags(txn);
+
+	if (!LIST_ISEMPTY(&global.s3.base_domains) && s3gw_vhost_bucket(txn, &bucket, &bucket_len)) {
+		key = uri + 1;
+	}
+	else {
+		bucket = uri + 1;
+		key = memchr(bucket, '/', end - bucket);
+		if (!key)
+			key = end;
+		bucket_len = key - bucket;
+		if (!bucket_len)
+			return;
+		if (key < end)
+			key++;
+	}
+	if (key == end) {
+		if (txn->meth == HTTP_METH_POST && (flags & S3GW_Q_DELETE))
+			s3gw_capture_delete(txn, bucket, bucket_len);
 		return;
 	}
 
 	switch (txn->meth) {
 		case HTTP_METH_DELETE:
-			if (strstr(txn->uri, "uploadId=") != NULL) {
+			if (flags & S3GW_Q_UPLOAD_ID) {
 				S3_LOG(NULL, LOG_INFO, "skip notification for multipart ABORT");
 				return;
 			}
+			type = S3GW_EV_DELETE;
+			break;
 		case HTTP_METH_POST:
-			if (strstr(txn->uri, "?uploads") != NULL) {
+			if (flags & S3GW_Q_UPLOADS) {
 				S3_LOG(NULL, LOG_INFO, "skip notification for multipart INITIATE");
 				return;
 			}
 			// allow multipart COMPLETE (uri contains "uploadId=")
-
-			if (get_bucket_objectkey(txn, &bucket, &bucket_len, &objectkey, &objectkey_len)) {
+			type = S3GW_EV_POST;
+			break;
+		default:
+			if (flags & S3GW_Q_UPLOAD_ID) {
+				S3_LOG(NULL, LOG_INFO, "skip notification for multipart UPLOAD PART");
 				return;
 			}
-			S3_LOG(NULL, LOG_INFO, "object key: '%s', len: %d", objectkey, objectkey_len);
+			type = S3GW_EV_PUT;
+			break;
+	}
 
-			if (!check_bucket_valid_for_notification(bucket, bucket_len)) {
-				S3_LOG(NULL, LOG_INFO, "bucket '%s' not enabled for notifications", bucket);
-				return;
-			}
+	b = s3gw_bucket_lookup(bucket, bucket_len);
+	if (!b) {
+		S3_LOG(NULL, LOG_INFO, "bucket '%.*s' not enabled for notifications",
+		       bucket_len, bucket);
+		return;
+	}
 
-			S3_LOG(NULL, LOG_INFO, "publish notification");
+	if (s3gw_notifications_off(txn))
+		return;
 
-			reply = redisCommand(ctx, redis_commands[txn->meth],
-						global.s3.bucket_prefix,
-						bucket, bucket_len,
-						objectkey, objectkey_len);
-			check_redis_state(reply);
-			break;
-		case HTTP_METH_PUT:
-			if (strstr(txn->uri, "uploadId=") != NULL) {
-				S3_LOG(NULL, LOG_INFO, "skip notification for multipart UPLOAD PART");
-				return;
-			}
-			if (get_bucket_objectkey(txn, &bucket, &bucket_len, &objectkey, &objectkey_len)) {
-				return;
-			}
-			S3_LOG(NULL, LOG_INFO, "object key: '%s', len: %d", objectkey, objectkey_len);
+	txn->s3gw.size = -1;
+	if (type == S3GW_EV_PUT) {
+		ctx.idx = 0;
+		if (unlikely(http_find_header2("x-amz-copy-source", 17, msg->chn->buf->p, &txn->hdr_idx, &ctx))) {
+			type = S3GW_EV_COPY;
+			source = ctx.line + ctx.val;
+			source_len = ctx.vlen;
+		}
+		else if (b->schema == S3GW_SCHEMA_V2) {
+			/* with aws-chunked uploads, the body also holds the
+			 * chunk signatures.
+			 */
+			ctx.idx = 0;
+			if (http_find_header2("x-amz-decoded-content-length", 28, msg->chn->buf->p, &txn->hdr_idx, &ctx) &&
+			    strl2llrc(ctx.line + ctx.val, ctx.vlen, &txn->s3gw.size) != 0)
+				txn->s3gw.size = -1;
+		}
+	}
 
-			if (!check_bucket_valid_for_notification(bucket, bucket_len)) {
-				S3_LOG(NULL, LOG_INFO, "bucket '%s' not enabled for notifications", bucket);
-				return;
-			}
+	txn->s3gw.key = pool_alloc2(pool2_s3key);
+	if (!txn->s3gw.key)
+		return;
 
-			if (txn->s3gw.copy_source) {
-				S3_LOG(NULL, LOG_INFO, "publish notification (with copy source)");
+	/* only the decoded key and source need to fit, whatever their
+	 * encoded length.
+	 */
+	key_len = s3gw_url_decode(txn->s3gw.key, REQURI_LEN, key, end - key);
+	if (key_len >= 0 && source_len)
+		source_len = s3gw_url_decode(txn->s3gw.key + key_len, REQURI_LEN - key_len, source, source_len);
+	if (unlikely(key_len < 0 || source_len < 0)) {
+		S3_LOG(NULL, LOG_ERR, "object key or x-amz-copy-source is too long. Url: %.*s",
+		       (int)msg->sl.rq.u_l, uri);
+		goto drop;
+	}
+	/* each one is checked alone so that the source cannot complete a
+	 * sequence truncated at the end of the key.
+	 */
+	if (unlikely(!s3gw_utf8_valid(txn->s3gw.key, key_len) ||
+	             !s3gw_utf8_valid(txn->s3gw.key + key_len, source_len))) {
+		S3_LOG(NULL, LOG_ERR, "object key or x-amz-copy-source is not valid UTF-8. Url: %.*s",
+		       (int)msg->sl.rq.u_l, uri);
+		goto drop;
+	}
 
-				reply = redisCommand(ctx, redis_copy_command,
-							global.s3.bucket_prefix,
-							bucket, bucket_len,
-							objectkey, objectkey_len,
-							txn->s3gw.copy_source);
-				check_redis_state(reply);
+	if (!s3gw_filter_match(b, txn->s3gw.key, key_len)) {
+		s3gw_bucket_filtered(b);
+		goto drop;
+	}
 
-			} else {
-				S3_LOG(NULL, LOG_INFO, "publish notification");
+	txn->s3gw.bucket = b;
+	txn->s3gw.type = type;
+	txn->s3gw.key_len = key_len;
+	txn->s3gw.source_len = source_len;
+	return;
 
-				reply = redisCommand(ctx, redis_commands[txn->meth],
-							global.s3.bucket_prefix,
-							bucket, bucket_len,
-							objectkey, objectkey_len);
-				check_redis_state(reply);
-			}
-			break;
-		default:
-			S3_LOG(NULL, LOG_INFO, "ignore HTTP method %d", txn->meth);
-			return;
-			break;
+ drop:
+	pool_free2(pool2_s3key, txn->s3gw.key);
+	txn->s3gw.key = NULL;
+}
+
+/* Looks for response header <name> of <len> chars in <txn>. Returns its value
+ * and sets <vlen>, or returns NULL if it is missing or longer than
+ * S3GW_META_LEN. Surrounding double quotes are removed.
+ */
+static const char *s3gw_rsp_header(struct http_txn *txn, const char *name, int len, int *vlen) {
+	struct hdr_ctx ctx;
+	const char *val;
+	int l;
+
+	ctx.idx = 0;
+	if (!http_find_header2(name, len, txn->rsp.chn->buf->p, &txn->hdr_idx, &ctx))
+		return NULL;
+
+	val = ctx.line + ctx.val;
+	l = ctx.vlen;
+	if (l >= 2 && val[0] == '"' && val[l - 1] == '"') {
+		val++;
+		l -= 2;
 	}
+	if (l > S3GW_META_LEN)
+		return NULL;
+	*vlen = l;
+	return val;
+}
+
+/* returns the schema v2 sequencer of the next event: microseconds, made
+ * unique within the process, followed by the process number so that processes
+ * do not collide either.
+ */
+static unsigned long long s3gw_next_sequencer() {
+	static unsigned long long last_sequencer = 0;
+	unsigned long long sequencer;
 
-	if (ret != REDIS_OK) {
-		S3_LOG(NULL, LOG_ERR, "could not enqueue notification");
+	sequencer = (unsigned long long)date.tv_sec * 1000000 + date.tv_usec;
+	if (sequencer <= last_sequencer)
+		sequencer = last_sequencer + 1;
+	last_sequencer = sequencer;
+	return (sequencer << 8) | (relative_pid & 0xff);
+}
+
+/* accounts for <n> events of successful requests on bucket <b> */
+static inline void s3gw_bucket_events(struct s3gw_bucket *b, unsigned int n) {
+	b->counters.events += n;
+	update_freq_ctr(&b->counters.events_rate, n);
+}
+
+/* queues one deletion per key of the multi-object delete <del>, described by
+ * <src> otherwise.
+ */
+static void s3gw_enqueue_delete(struct s3gw_delete *del, struct s3gw_event_src *src) {
+	const struct s3gw_delete_blk *blk = NULL;
+	int ofs;
+
+	S3_LOG(NULL, LOG_INFO, "publish %u notifications for a multi-object delete", del->nb_keys);
+	s3gw_bucket_events(del->bucket, del->nb_keys);
+	while ((src->key_len = s3gw_delete_next_key(del, &blk, &ofs, &src->key)) >= 0) {
+		if (src->schema == S3GW_SCHEMA_V2)
+			src->sequencer = s3gw_next_sequencer();
+		s3gw_queue_event(src);
+	}
+}
+
+/* enqueue the message. The event is only queued here, s3gw_flush() publishes
+ * it together with the other events collected during the same loop iteration,
+ * or once Redis is reachable again. This is called while the response headers
+ * are indexed, which is when the schema v2 fields are collected.
+ */
+void s3gw_enqueue(struct http_txn *txn) {
+	struct s3gateway *s3 = &txn->s3gw;
+	struct s3gw_event_src src;
+
+	assert(txn);
+
+	if (txn->status < 200 || txn->status > 300) {
+		return;
 	}
+
+	if (!s3->bucket)
+		return;
+
+	memset(&src, 0, sizeof(src));
+	src.type = s3->type;
+	src.schema = s3->bucket->schema;
+	src.hash = s3->bucket->hash;
+	src.coalesce = s3->bucket->coalesce;
+	src.bucket = (const char *)s3->bucket->node.key;
+	src.bucket_len = s3->bucket->len;
+	src.key = s3->key;
+	src.key_len = s3->key_len;
+	src.source = s3->key + s3->key_len;
+	src.source_len = s3->source_len;
+	src.size = -1;
+	src.stamp = (unsigned long long)date.tv_sec * 1000000 + date.tv_usec;
+
+	if (src.schema == S3GW_SCHEMA_V2) {
+		src.sequencer = s3gw_next_sequencer();
+
+		if (s3->type == S3GW_EV_PUT)
+			src.size = s3->size >= 0 ? s3->size : txn->req.body_len;
+
+		if (s3->type != S3GW_EV_DELETE)
+			src.etag = s3gw_rsp_header(txn, "ETag", 4, &src.etag_len);
+		/* the versions of a multi-object delete are in the response body */
+		if (!s3->del)
+			src.version = s3gw_rsp_header(txn, "x-amz-version-id", 16, &src.version_len);
+		src.request_id = s3gw_rsp_header(txn, "x-amz-request-id", 16, &src.request_id_len);
+	}
+
+	if (s3->del) {
+		s3gw_enqueue_delete(s3->del, &src);
+		return;
+	}
+
+	S3_LOG(NULL, LOG_INFO, "publish notification");
+	s3gw_bucket_events(s3->bucket, 1);
+	s3gw_queue_event(&src);
+}
+
+static struct sample_fetch_kw_list s3gw_fetch_keywords = {ILH, {
+	{ "s3.acl",         smp_fetch_s3_subres, 0, NULL, SMP_T_BOOL, SMP_USE_HRQHV },
+	{ "s3.delete",      smp_fetch_s3_subres, 0, NULL, SMP_T_BOOL, SMP_USE_HRQHV },
+	{ "s3.part_number", smp_fetch_s3_subres, 0, NULL, SMP_T_BOOL, SMP_USE_HRQHV },
+	{ "s3.tagging",     smp_fetch_s3_subres, 0, NULL, SMP_T_BOOL, SMP_USE_HRQHV },
+	{ "s3.upload_id",   smp_fetch_s3_subres, 0, NULL, SMP_T_BOOL, SMP_USE_HRQHV },
+	{ "s3.uploads",     smp_fetch_s3_subres, 0, NULL, SMP_T_BOOL, SMP_USE_HRQHV },
+	{ "s3.version_id",  smp_fetch_s3_subres, 0, NULL, SMP_T_BOOL, SMP_USE_HRQHV },
+	{ /* END */ },
+}};
+
+__attribute__((constructor))
+static void __s3gw_init(void)
+{
+	sample_register_fetches(&s3gw_fetch_keywords);
 }
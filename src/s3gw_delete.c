@@ -0,0 +1,410 @@
+/*
+ * Multi-object delete notifications.
+ *
+ * A "POST /<bucket>?delete" removes the objects listed in its XML body:
+ *
+ *   <Delete><Object><Key>a</Key></Object><Object><Key>b</Key>...</Delete>
+ *
+ * The body is parsed while it is forwarded, a few bytes at a time as they
+ * arrive, so it is never buffered. Only the keys are kept, and one event per
+ * key is queued if the response is a success. The parser only knows the
+ * elements leading to the keys and the predefined and numeric character
+ * references, which is what S3 clients send.
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include <common/buffer.h>
+#include <common/memory.h>
+#include <common/standard.h>
+
+#include <proto/log.h>
+#include <proto/s3gw.h>
+#include <proto/s3gw_delete.h>
+#include <proto/s3gw_filter.h>
+#include <proto/s3gw_key.h>
+
+static struct pool_head *pool2_s3delete = NULL;
+static struct pool_head *pool2_s3delblk = NULL;
+
+/* the elements leading to a key, by depth */
+static const struct {
+	const char *name;
+	int len;
+} s3gw_delete_path[S3GW_DEL_IN_KEY] = {
+	{ "Delete", 6 },
+	{ "Object", 6 },
+	{ "Key",    3 },
+};
+
+/* Returns a new parser for a multi-object delete on <bucket>, or NULL if
+ * memory is missing.
+ */
+struct s3gw_delete *s3gw_delete_new(struct s3gw_bucket *bucket)
+{
+	struct s3gw_delete *del;
+
+	del = pool_alloc2(pool2_s3delete);
+	if (!del)
+		return NULL;
+
+	del->bucket = bucket;
+	del->head = del->tail = NULL;
+	del->nb_keys = 0;
+	del->state = S3GW_DEL_TEXT;
+	del->depth = del->match = 0;
+	del->key_len = -1;
+	return del;
+}
+
+void s3gw_delete_free(struct s3gw_delete *del)
+{
+	struct s3gw_delete_blk *blk;
+
+	if (!del)
+		return;
+
+	while ((blk = del->head)) {
+		del->head = blk->next;
+		pool_free2(pool2_s3delblk, blk);
+	}
+	pool_free2(pool2_s3delete, del);
+}
+
+/* appends <len> bytes of <str> to the current key, which becomes invalid if
+ * it gets too long.
+ */
+static void s3gw_delete_key_add(struct s3gw_delete *del, const char *str, int len)
+{
+	if (del->key_len < 0)
+		return;
+
+	if (del->key_len + len > REQURI_LEN) {
+		S3_LOG(NULL, LOG_ERR, "object key of a multi-object delete is too long");
+		del->key_len = -1;
+		return;
+	}
+	memcpy(del->key + del->key_len, str, len);
+	del->key_len += len;
+}
+
+/* keeps the current key if it is to be notified */
+static void s3gw_delete_key_end(struct s3gw_delete *del)
+{
+	struct s3gw_delete_blk *blk;
+	unsigned short len;
+
+	if (del->key_len <= 0)
+		return;
+
+	if (!s3gw_utf8_valid(del->key, del->key_len)) {
+		S3_LOG(NULL, LOG_ERR, "object key of a multi-object delete is not valid UTF-8");
+		return;
+	}
+
+	if (!s3gw_filter_match(del->bucket, del->key, del->key_len)) {
+		s3gw_bucket_filtered(del->bucket);
+		return;
+	}
+
+	if (del->nb_keys == S3GW_DELETE_MAX_KEYS) {
+		S3_LOG(NULL, LOG_ERR, "more than %d keys in a multi-object delete", S3GW_DELETE_MAX_KEYS);
+		del->state = S3GW_DEL_DONE;
+		return;
+	}
+
+	blk = del->tail;
+	if (!blk || blk->len + sizeof(len) + del->key_len > S3GW_DELETE_BLK_LEN) {
+		blk = pool_alloc2(pool2_s3delblk);
+		if (!blk) {
+			del->state = S3GW_DEL_DONE;
+			return;
+		}
+		blk->next = NULL;
+		blk->len = 0;
+		if (del->tail)
+			del->tail->next = blk;
+		else
+			del->head = blk;
+		del->tail = blk;
+	}
+
+	len = del->key_len;
+	memcpy(blk->data + blk->len, &len, sizeof(len));
+	memcpy(blk->data + blk->len + sizeof(len), del->key, len);
+	blk->len += sizeof(len) + len;
+	del->nb_keys++;
+}
+
+/* decodes the character reference just read into the current key */
+static void s3gw_delete_entity(struct s3gw_delete *del)
+{
+	static const struct {
+		const char *name;
+		int len;
+		char c;
+	} names[] = {
+		{ "amp", 3, '&' }, { "lt", 2, '<' }, { "gt", 2, '>' },
+		{ "quot", 4, '"' }, { "apos", 4, '\'' },
+	};
+	const char *ent = del->ent;
+	int len = del->ent_len;
+	unsigned int cp = 0;
+	char utf8[4];
+	int i, d, hex;
+
+	if (len > 1 && ent[0] == '#') {
+		hex = ent[1] == 'x';
+		i = hex + 1;
+		if (i == len)
+			goto invalid;
+		for (; i < len; i++) {
+			d = hex ? hex2i(ent[i]) : isdigit((unsigned char)ent[i]) ? ent[i] - '0' : -1;
+			if (d < 0 || cp > 0x10ffff)
+				goto invalid;
+			cp = cp * (hex ? 16 : 10) + d;
+		}
+		if (!cp || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+			goto invalid;
+
+		if (cp < 0x80) {
+			utf8[0] = cp;
+			len = 1;
+		}
+		else if (cp < 0x800) {
+			utf8[0] = 0xc0 | (cp >> 6);
+			utf8[1] = 0x80 | (cp & 0x3f);
+			len = 2;
+		}
+		else if (cp < 0x10000) {
+			utf8[0] = 0xe0 | (cp >> 12);
+			utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+			utf8[2] = 0x80 | (cp & 0x3f);
+			len = 3;
+		}
+		else {
+			utf8[0] = 0xf0 | (cp >> 18);
+			utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+			utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+			utf8[3] = 0x80 | (cp & 0x3f);
+			len = 4;
+		}
+		s3gw_delete_key_add(del, utf8, len);
+		return;
+	}
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (names[i].len == len && memcmp(names[i].name, ent, len) == 0) {
+			s3gw_delete_key_add(del, &names[i].c, 1);
+			return;
+		}
+	}
+
+ invalid:
+	del->key_len = -1;
+}
+
+/* handles the tag just read, which opens or closes an element */
+static void s3gw_delete_tag(struct s3gw_delete *del)
+{
+	const char *name = del->name;
+	const char *end = name + del->name_len;
+	const char *p;
+	int closing = 0;
+
+	/* declarations, comments and processing instructions */
+	if (name == end || *name == '?' || *name == '!')
+		return;
+
+	if (*name == '/') {
+		closing = 1;
+		name++;
+	}
+	for (p = name; p < end && !isspace((unsigned char)*p) && *p != '/'; p++)
+		;
+	end = p;
+
+	/* namespace prefixes are ignored */
+	p = memchr(name, ':', end - name);
+	if (p)
+		name = p + 1;
+
+	if (closing) {
+		if (!del->depth) {
+			del->state = S3GW_DEL_DONE;
+			return;
+		}
+		if (del->match == del->depth) {
+			if (del->match == S3GW_DEL_IN_KEY)
+				s3gw_delete_key_end(del);
+			if (!--del->match) {
+				del->state = S3GW_DEL_DONE;
+				return;
+			}
+		}
+		del->depth--;
+		return;
+	}
+
+	/* an empty element, such as <Key/> */
+	if (del->last == '/')
+		return;
+
+	if (del->match == del->depth && del->match < S3GW_DEL_IN_KEY &&
+	    end - name == s3gw_delete_path[del->match].len &&
+	    memcmp(name, s3gw_delete_path[del->match].name, end - name) == 0) {
+		del->match++;
+		if (del->match == S3GW_DEL_IN_KEY)
+			del->key_len = 0;
+	}
+
+	if (++del->depth == 255)
+		del->state = S3GW_DEL_DONE;
+}
+
+/* parses the next <len> bytes of <data> of the body of <del> */
+static void s3gw_delete_parse(struct s3gw_delete *del, const char *data, int len)
+{
+	const char *end = data + len;
+	const char *p;
+	char c;
+
+	while (data < end && del->state != S3GW_DEL_DONE) {
+		switch (del->state) {
+		case S3GW_DEL_TEXT:
+			if (del->match != S3GW_DEL_IN_KEY) {
+				/* nothing to keep up to the next tag */
+				p = memchr(data, '<', end - data);
+				if (!p)
+					return;
+			}
+			else {
+				for (p = data; p < end && *p != '<' && *p != '&'; p++)
+					;
+				s3gw_delete_key_add(del, data, p - data);
+				if (p == end)
+					return;
+			}
+			data = p + 1;
+			if (*p == '&') {
+				del->ent_len = 0;
+				del->state = S3GW_DEL_ENTITY;
+			}
+			else {
+				del->name_len = 0;
+				del->last = 0;
+				del->state = S3GW_DEL_TAG;
+			}
+			break;
+
+		case S3GW_DEL_TAG:
+			/* the first chars tell comments, which may hold '>' */
+			if (del->name_len < 3) {
+				c = *data++;
+				if (c != '>') {
+					del->name[del->name_len++] = c;
+					del->last = c;
+					if (del->name_len == 3 && memcmp(del->name, "!--", 3) == 0) {
+						del->dashes = 0;
+						del->state = S3GW_DEL_COMMENT;
+					}
+					break;
+				}
+			}
+			else {
+				p = memchr(data, '>', end - data);
+				if (!p)
+					p = end;
+				len = MIN(p - data, S3GW_DELETE_NAME_LEN - del->name_len);
+				memcpy(del->name + del->name_len, data, len);
+				del->name_len += len;
+				if (p > data)
+					del->last = p[-1];
+				data = p;
+				if (data == end)
+					return;
+				data++;
+			}
+			del->state = S3GW_DEL_TEXT;
+			s3gw_delete_tag(del);
+			break;
+
+		case S3GW_DEL_COMMENT:
+			c = *data++;
+			if (c == '>' && del->dashes >= 2)
+				del->state = S3GW_DEL_TEXT;
+			else if (c == '-')
+				del->dashes += del->dashes < 2;
+			else
+				del->dashes = 0;
+			break;
+
+		case S3GW_DEL_ENTITY:
+			c = *data++;
+			if (c == ';') {
+				del->state = S3GW_DEL_TEXT;
+				s3gw_delete_entity(del);
+			}
+			else if (del->ent_len < S3GW_DELETE_ENT_LEN)
+				del->ent[del->ent_len++] = c;
+			else {
+				del->key_len = -1;
+				del->state = S3GW_DEL_TEXT;
+			}
+			break;
+		}
+	}
+}
+
+/* Parses the <len> bytes found at <ofs> from the input of <buf>, which may
+ * wrap, as the next part of the body of <del>.
+ */
+void s3gw_delete_parse_buf(struct s3gw_delete *del, const struct buffer *buf, int ofs, int len)
+{
+	const char *p = b_ptr(buf, ofs);
+	int n = MIN(len, buf->data + buf->size - p);
+
+	s3gw_delete_parse(del, p, n);
+	if (len > n)
+		s3gw_delete_parse(del, buf->data, len - n);
+}
+
+/* Returns the length of the key following the one found at <*ofs> of <*blk>
+ * in <del>, and points <key> to it. <*blk> must be NULL for the first key.
+ * Returns -1 after the last key.
+ */
+int s3gw_delete_next_key(const struct s3gw_delete *del, const struct s3gw_delete_blk **blk, int *ofs, const char **key)
+{
+	unsigned short len;
+
+	if (!*blk) {
+		*blk = del->head;
+		*ofs = 0;
+	}
+	else if (*ofs == (*blk)->len) {
+		*blk = (*blk)->next;
+		*ofs = 0;
+	}
+	if (!*blk || *ofs == (*blk)->len)
+		return -1;
+
+	memcpy(&len, (*blk)->data + *ofs, sizeof(len));
+	*key = (*blk)->data + *ofs + sizeof(len);
+	*ofs += sizeof(len) + len;
+	return len;
+}
+
+/* creates the pools. Returns non-zero on failure. */
+int s3gw_delete_init()
+{
+	pool2_s3delete = create_pool("s3delete", sizeof(struct s3gw_delete), MEM_F_SHARED);
+	pool2_s3delblk = create_pool("s3delblk", sizeof(struct s3gw_delete_blk), MEM_F_SHARED);
+	return !pool2_s3delete || !pool2_s3delblk;
+}
+
+void s3gw_delete_deinit()
+{
+	pool2_s3delete = pool_destroy2(pool2_s3delete);
+	pool2_s3delblk = pool_destroy2(pool2_s3delblk);
+}
@@ -0,0 +1,222 @@
+/*
+ * Object key filters of the notification buckets.
+ *
+ * A bucket may declare rules made of a key prefix, a key suffix or both, and
+ * only notifies about keys matched by at least one of them. The prefixes of
+ * all the buckets are indexed in one prefix tree, and the reversed suffixes in
+ * another one, each key starting with the id of its bucket. Each entry knows
+ * the rules of its shorter entries too, so that a single longest match per
+ * tree finds all the matching rules, whatever the number of filters.
+ */
+
+#include <string.h>
+
+#include <common/memory.h>
+#include <common/mini-clist.h>
+#include <common/standard.h>
+
+#include <ebmbtree.h>
+
+#include <proto/s3gw_filter.h>
+
+/* length of the bucket id which starts the keys */
+#define ID_LEN sizeof(unsigned int)
+
+static struct eb_root prefix_tree = EB_ROOT_UNIQUE;
+static struct eb_root suffix_tree = EB_ROOT_UNIQUE;
+static struct list prefixes = LIST_HEAD_INIT(prefixes);
+static struct list suffixes = LIST_HEAD_INIT(suffixes);
+
+/* Indexes rule <rule> of <bucket> on the <len> bytes of <affix> in <tree>,
+ * reversed if <rev> is set. Returns the entry, or NULL if memory is missing.
+ */
+static struct s3gw_filter *s3gw_filter_index(struct eb_root *tree, struct list *all, const struct s3gw_bucket *bucket,
+			     int rule, const char *affix, int len, int rev) {
+	struct s3gw_filter *f;
+	struct ebmb_node *node;
+	int i;
+
+	f = calloc(1, sizeof(*f) + ID_LEN + len + 1);
+	if (!f)
+		return NULL;
+
+	memcpy(f->node.key, &bucket->id, ID_LEN);
+	for (i = 0; i < len; i++)
+		f->node.key[ID_LEN + i] = rev ? affix[len - 1 - i] : affix[i];
+	f->len = ID_LEN + len;
+	f->node.node.pfx = f->len * 8;
+
+	node = ebmb_insert_prefix(tree, &f->node, f->len);
+	if (node != &f->node) {
+		/* already used by another rule */
+		free(f);
+		f = ebmb_entry(node, struct s3gw_filter, node);
+	}
+	else
+		LIST_ADDQ(all, &f->list);
+
+	f->own |= 1ULL << rule;
+	return f;
+}
+
+/* removes <rules> from entry <f>, which is freed once no rule uses it */
+static void s3gw_filter_unindex(struct s3gw_filter *f, unsigned long long rules) {
+	f->own &= ~rules;
+	if (f->own)
+		return;
+	ebmb_delete(&f->node);
+	LIST_DEL(&f->list);
+	free(f);
+}
+
+/* Adds a rule to <bucket> matching keys which start with <prefix> and end
+ * with <suffix>, either being NULL or empty if not needed. Returns 0 and
+ * fills <err> on error.
+ */
+int s3gw_filter_add(struct s3gw_bucket *bucket, const char *prefix, const char *suffix, char **err) {
+	struct s3gw_filter *pf = NULL;
+	int rule = bucket->nb_rules;
+	int plen = prefix ? strlen(prefix) : 0;
+	int slen = suffix ? strlen(suffix) : 0;
+
+	if (rule >= S3GW_FILTER_MAX) {
+		memprintf(err, "too many filter rules (max %d)", S3GW_FILTER_MAX);
+		return 0;
+	}
+	if (plen > S3GW_FILTER_LEN || slen > S3GW_FILTER_LEN) {
+		memprintf(err, "filter too long (max %d chars)", S3GW_FILTER_LEN);
+		return 0;
+	}
+
+	if (plen) {
+		pf = s3gw_filter_index(&prefix_tree, &prefixes, bucket, rule, prefix, plen, 0);
+		if (!pf)
+			goto oom;
+	}
+	else
+		bucket->no_prefix |= 1ULL << rule;
+
+	if (slen) {
+		if (!s3gw_filter_index(&suffix_tree, &suffixes, bucket, rule, suffix, slen, 1))
+			goto oom;
+	}
+	else
+		bucket->no_suffix |= 1ULL << rule;
+
+	bucket->nb_rules++;
+	return 1;
+
+ oom:
+	/* the rule number is reused by the next rule, which must not inherit
+	 * the parts indexed so far.
+	 */
+	if (pf)
+		s3gw_filter_unindex(pf, 1ULL << rule);
+	bucket->no_prefix &= ~(1ULL << rule);
+	bucket->no_suffix &= ~(1ULL << rule);
+	memprintf(err, "out of memory");
+	return 0;
+}
+
+/* Removes all the rules of <bucket>, which then notifies about all its keys.
+ * s3gw_filter_build() must be called afterwards.
+ */
+void s3gw_filter_clear(struct s3gw_bucket *bucket) {
+	struct s3gw_filter *f, *back;
+
+	list_for_each_entry_safe(f, back, &prefixes, list) {
+		if (memcmp(f->node.key, &bucket->id, ID_LEN) == 0)
+			s3gw_filter_unindex(f, ~0ULL);
+	}
+	list_for_each_entry_safe(f, back, &suffixes, list) {
+		if (memcmp(f->node.key, &bucket->id, ID_LEN) == 0)
+			s3gw_filter_unindex(f, ~0ULL);
+	}
+	bucket->nb_rules = 0;
+	bucket->no_prefix = bucket->no_suffix = 0;
+}
+
+/* gives each entry of <all> in <tree> the rules of its shorter entries */
+static void s3gw_filter_build_tree(struct eb_root *tree, struct list *all) {
+	struct s3gw_filter *f, *shorter;
+	struct ebmb_node *node;
+	int len;
+
+	list_for_each_entry(f, all, list) {
+		f->rules = f->own;
+		for (len = ID_LEN + 1; len < f->len; len++) {
+			node = ebmb_lookup_prefix(tree, f->node.key, len * 8);
+			if (!node)
+				continue;
+			shorter = ebmb_entry(node, struct s3gw_filter, node);
+			f->rules |= shorter->own;
+		}
+	}
+}
+
+/* must be called once all the rules are declared */
+void s3gw_filter_build() {
+	s3gw_filter_build_tree(&prefix_tree, &prefixes);
+	s3gw_filter_build_tree(&suffix_tree, &suffixes);
+}
+
+/* returns the rules of <tree> matched by <key>, which is zero-terminated */
+static inline unsigned long long s3gw_filter_lookup(struct eb_root *tree, const unsigned char *key) {
+	struct ebmb_node *node;
+
+	if (eb_is_empty(tree))
+		return 0;
+	node = ebmb_lookup_longest(tree, key);
+	return node ? ebmb_entry(node, struct s3gw_filter, node)->rules : 0;
+}
+
+/* Returns non-zero if events for the object <key> of <len> bytes in <bucket>
+ * must be notified. The cost only depends on the length of the key.
+ */
+int s3gw_filter_match(const struct s3gw_bucket *bucket, const char *key, int len) {
+	unsigned char buf[ID_LEN + S3GW_FILTER_LEN + 1];
+	unsigned char *p = buf + ID_LEN;
+	unsigned long long all, pfx, sfx;
+	int i, n;
+
+	if (!bucket->nb_rules)
+		return 1;
+
+	all = bucket->nb_rules < 64 ? (1ULL << bucket->nb_rules) - 1 : ~0ULL;
+	/* no filter is longer than S3GW_FILTER_LEN */
+	n = len < S3GW_FILTER_LEN ? len : S3GW_FILTER_LEN;
+	memcpy(buf, &bucket->id, ID_LEN);
+
+	sfx = bucket->no_suffix;
+	if (sfx != all) {
+		for (i = 0; i < n; i++)
+			p[i] = key[len - 1 - i];
+		p[n] = 0;
+		sfx |= s3gw_filter_lookup(&suffix_tree, buf);
+	}
+	if (!sfx)
+		return 0;
+
+	pfx = bucket->no_prefix;
+	if ((sfx & pfx) != sfx) {
+		memcpy(p, key, n);
+		p[n] = 0;
+		pfx |= s3gw_filter_lookup(&prefix_tree, buf);
+	}
+	return (pfx & sfx) != 0;
+}
+
+void s3gw_filter_free_all() {
+	struct s3gw_filter *f, *back;
+
+	list_for_each_entry_safe(f, back, &prefixes, list) {
+		ebmb_delete(&f->node);
+		LIST_DEL(&f->list);
+		free(f);
+	}
+	list_for_each_entry_safe(f, back, &suffixes, list) {
+		ebmb_delete(&f->node);
+		LIST_DEL(&f->list);
+		free(f);
+	}
+}
@@ -0,0 +1,305 @@
+/*
+ * JSON encoding of S3 notifications.
+ *
+ * Each event type has a precomputed prefix holding everything up to the
+ * object key, so that only the key and the copy source have to be written
+ * per event. Schema v2 records are built the same way from static parts.
+ * Those are escaped eight bytes at a time: words which contain no
+ * byte to escape are copied as is, which is the common case.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <common/compiler.h>
+#include <common/standard.h>
+
+#include <proto/s3gw_json.h>
+
+#include <types/global.h>
+
+#define S3GW_JSON_PREFIX(name) "{\"event\":\"" name "\",\"objectKey\":\""
+#define S3GW_JSON_SOURCE       "\",\"source\":\""
+#define S3GW_JSON_TIME         "\",\"eventTime\":\""
+#define S3GW_JSON_COUNT        "\",\"count\":"
+#define S3GW_JSON_END          "\"}"
+
+/* start of the notification, indexed by S3GW_EV_* */
+static const struct {
+	const char *str;
+	int len;
+} s3gw_json_prefix[S3GW_EV_MAX] = {
+#define PREFIX(name) { S3GW_JSON_PREFIX(name), sizeof(S3GW_JSON_PREFIX(name)) - 1 }
+	[S3GW_EV_POST]   = PREFIX("s3:ObjectCreated:Post"),
+	[S3GW_EV_PUT]    = PREFIX("s3:ObjectCreated:Put"),
+	[S3GW_EV_COPY]   = PREFIX("s3:ObjectCreated:Copy"),
+	[S3GW_EV_DELETE] = PREFIX("s3:ObjectRemoved:Delete"),
+#undef PREFIX
+};
+
+/* schema v2, see s3gw_json_encode_v2() */
+#define S3GW_V2_HEAD    "{\"Records\":[{\"eventVersion\":\"2.1\",\"eventSource\":\"ceph:s3\",\"eventTime\":\""
+#define S3GW_V2_NAME(name) "\",\"eventName\":\"" name "\""
+#define S3GW_V2_SOURCE  ",\"requestParameters\":{\"x-amz-copy-source\":\""
+#define S3GW_V2_REQID   ",\"responseElements\":{\"x-amz-request-id\":\""
+#define S3GW_V2_BUCKET  ",\"s3\":{\"s3SchemaVersion\":\"1.0\",\"bucket\":{\"name\":\""
+#define S3GW_V2_KEY     "\"},\"object\":{\"key\":\""
+#define S3GW_V2_SIZE    "\",\"size\":"
+#define S3GW_V2_ETAG    ",\"eTag\":\""
+#define S3GW_V2_VERSION ",\"versionId\":\""
+#define S3GW_V2_SEQ     ",\"sequencer\":\""
+#define S3GW_V2_COUNT   ",\"count\":"
+#define S3GW_V2_END     "}}}]}"
+
+/* event name of schema v2, indexed by S3GW_EV_* */
+static const struct {
+	const char *str;
+	int len;
+} s3gw_json_v2_name[S3GW_EV_MAX] = {
+#define NAME(name) { S3GW_V2_NAME(name), sizeof(S3GW_V2_NAME(name)) - 1 }
+	[S3GW_EV_POST]   = NAME("ObjectCreated:Post"),
+	[S3GW_EV_PUT]    = NAME("ObjectCreated:Put"),
+	[S3GW_EV_COPY]   = NAME("ObjectCreated:Copy"),
+	[S3GW_EV_DELETE] = NAME("ObjectRemoved:Delete"),
+#undef NAME
+};
+
+/* two-character escapes, 'u' means \u00XX */
+static const char s3gw_json_esc[32] = {
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+};
+
+static const char s3gw_json_hex[16] = "0123456789abcdef";
+
+#define ONES  (~0UL / 0xff)             /* 0x0101...01 */
+#define HIGHS (ONES * 0x80)             /* 0x8080...80 */
+
+/* returns non-zero if word <w> contains a byte lower than 0x20, a double
+ * quote or a backslash.
+ */
+static inline unsigned long s3gw_json_special(unsigned long w)
+{
+	unsigned long q = w ^ (ONES * '"');
+	unsigned long b = w ^ (ONES * '\\');
+
+	return (((w - ONES * 0x20) & ~w) | ((q - ONES) & ~q) | ((b - ONES) & ~b)) & HIGHS;
+}
+
+/* Appends <len> bytes of <str> to <out>, escaped for a JSON string. Returns 0
+ * if <out> is too small, in which case its length is unchanged.
+ */
+int s3gw_json_escape(struct chunk *out, const char *str, int len)
+{
+	const char *end = str + len;
+	char *dst = out->str + out->len;
+	char *lim = out->str + out->size;
+	unsigned long w;
+	unsigned char c;
+
+	while (str < end) {
+		if (end - str >= sizeof(w)) {
+			memcpy(&w, str, sizeof(w));
+			if (!s3gw_json_special(w)) {
+				if (lim - dst < sizeof(w))
+					return 0;
+				memcpy(dst, &w, sizeof(w));
+				dst += sizeof(w);
+				str += sizeof(w);
+				continue;
+			}
+		}
+
+		/* slow path, one byte at a time until the next clean word */
+		c = *str++;
+		if (likely(c >= 0x20 && c != '"' && c != '\\')) {
+			if (dst == lim)
+				return 0;
+			*dst++ = c;
+		}
+		else if (c >= 0x20 || s3gw_json_esc[c] != 'u') {
+			if (lim - dst < 2)
+				return 0;
+			*dst++ = '\\';
+			*dst++ = c >= 0x20 ? c : s3gw_json_esc[c];
+		}
+		else {
+			if (lim - dst < 6)
+				return 0;
+			memcpy(dst, "\\u00", 4);
+			dst[4] = s3gw_json_hex[c >> 4];
+			dst[5] = s3gw_json_hex[c & 0xf];
+			dst += 6;
+		}
+	}
+
+	out->len = dst - out->str;
+	return 1;
+}
+
+/* appends <len> bytes of <str> to <out> as is. Returns 0 if it does not fit. */
+static inline int s3gw_json_raw(struct chunk *out, const char *str, int len)
+{
+	if (out->size - out->len < len)
+		return 0;
+	memcpy(out->str + out->len, str, len);
+	out->len += len;
+	return 1;
+}
+
+#define RAW(out, str) s3gw_json_raw(out, str, sizeof(str) - 1)
+
+/* Appends <ms> milliseconds since the epoch as an ISO 8601 UTC date. The date
+ * is rebuilt once per second only.
+ */
+int s3gw_json_time(struct chunk *out, unsigned long long ms)
+{
+	static time_t last_sec = -1;
+	static char last_str[sizeof("YYYY-MM-DDTHH:MM:SS")];
+	time_t sec = ms / 1000;
+	struct tm tm;
+	char *p;
+
+	if (sec != last_sec) {
+		gmtime_r(&sec, &tm);
+		strftime(last_str, sizeof(last_str), "%Y-%m-%dT%H:%M:%S", &tm);
+		last_sec = sec;
+	}
+
+	if (out->size - out->len < sizeof(last_str) + 4)
+		return 0;
+	p = out->str + out->len;
+	memcpy(p, last_str, sizeof(last_str) - 1);
+	p += sizeof(last_str) - 1;
+	*p++ = '.';
+	*p++ = '0' + (ms / 100) % 10;
+	*p++ = '0' + (ms / 10) % 10;
+	*p++ = '0' + ms % 10;
+	*p++ = 'Z';
+	out->len = p - out->str;
+	return 1;
+}
+
+/* appends <n> in decimal */
+static int s3gw_json_ull(struct chunk *out, unsigned long long n)
+{
+	char *p = ulltoa(n, out->str + out->len, out->size - out->len);
+
+	if (!p)
+		return 0;
+	out->len = p - out->str;
+	return 1;
+}
+
+/* appends <n> as 16 upper case hex digits */
+int s3gw_json_hex16(struct chunk *out, unsigned long long n)
+{
+	char *p;
+	int i;
+
+	if (out->size - out->len < 16)
+		return 0;
+	p = out->str + out->len;
+	for (i = 15; i >= 0; i--, n >>= 4)
+		p[i] = "0123456789ABCDEF"[n & 0xf];
+	out->len += 16;
+	return 1;
+}
+
+/* appends the schema v2 record of <ev> to <out>. Returns 0 if it does not fit. */
+static int s3gw_json_encode_v2(struct chunk *out, const struct s3gw_event *ev)
+{
+	if (!RAW(out, S3GW_V2_HEAD) ||
+	    !s3gw_json_time(out, ev->stamp / 1000) ||
+	    !s3gw_json_raw(out, s3gw_json_v2_name[ev->type].str, s3gw_json_v2_name[ev->type].len))
+		return 0;
+
+	if (ev->source_len &&
+	    (!RAW(out, S3GW_V2_SOURCE) ||
+	     !s3gw_json_escape(out, s3gw_ev_source(ev), ev->source_len) ||
+	     !RAW(out, "\"}")))
+		return 0;
+
+	if (ev->request_id_len &&
+	    (!RAW(out, S3GW_V2_REQID) ||
+	     !s3gw_json_escape(out, s3gw_ev_request_id(ev), ev->request_id_len) ||
+	     !RAW(out, "\"}")))
+		return 0;
+
+	if (!RAW(out, S3GW_V2_BUCKET) ||
+	    !s3gw_json_escape(out, ev->data, ev->bucket_len) ||
+	    !RAW(out, S3GW_V2_KEY) ||
+	    !s3gw_json_escape(out, s3gw_ev_key(ev), ev->key_len))
+		return 0;
+
+	if (ev->size >= 0) {
+		if (!RAW(out, S3GW_V2_SIZE) || !s3gw_json_ull(out, ev->size))
+			return 0;
+	}
+	else if (!RAW(out, "\""))
+		return 0;
+
+	if (ev->etag_len &&
+	    (!RAW(out, S3GW_V2_ETAG) ||
+	     !s3gw_json_escape(out, s3gw_ev_etag(ev), ev->etag_len) ||
+	     !RAW(out, "\"")))
+		return 0;
+
+	if (ev->version_len &&
+	    (!RAW(out, S3GW_V2_VERSION) ||
+	     !s3gw_json_escape(out, s3gw_ev_version(ev), ev->version_len) ||
+	     !RAW(out, "\"")))
+		return 0;
+
+	if (!RAW(out, S3GW_V2_SEQ) ||
+	    !s3gw_json_hex16(out, ev->sequencer) ||
+	    !RAW(out, "\""))
+		return 0;
+
+	/* coalesced events */
+	if (ev->count > 1 && (!RAW(out, S3GW_V2_COUNT) || !s3gw_json_ull(out, ev->count)))
+		return 0;
+
+	return RAW(out, S3GW_V2_END);
+}
+
+/* Appends the JSON notification of <ev> to <out>. Returns 0 if the payload
+ * does not fit, in which case the length of <out> is unchanged.
+ */
+int s3gw_json_encode_event(struct chunk *out, const struct s3gw_event *ev)
+{
+	int orig = out->len;
+	const char *key = s3gw_ev_key(ev);
+
+	if (ev->schema == S3GW_SCHEMA_V2) {
+		if (!s3gw_json_encode_v2(out, ev))
+			goto full;
+		return 1;
+	}
+
+	if (!s3gw_json_raw(out, s3gw_json_prefix[ev->type].str, s3gw_json_prefix[ev->type].len) ||
+	    !s3gw_json_escape(out, key, ev->key_len))
+		goto full;
+
+	if (ev->type == S3GW_EV_COPY &&
+	    (!s3gw_json_raw(out, S3GW_JSON_SOURCE, sizeof(S3GW_JSON_SOURCE) - 1) ||
+	     !s3gw_json_escape(out, key + ev->key_len, ev->source_len)))
+		goto full;
+
+	/* s3.event_time, events of old spools have no date */
+	if (global.s3.event_time && ev->stamp &&
+	    (!RAW(out, S3GW_JSON_TIME) || !s3gw_json_time(out, ev->stamp / 1000)))
+		goto full;
+
+	if (ev->count > 1) {
+		if (!RAW(out, S3GW_JSON_COUNT) || !s3gw_json_ull(out, ev->count) || !RAW(out, "}"))
+			goto full;
+	}
+	else if (!RAW(out, S3GW_JSON_END))
+		goto full;
+	return 1;
+
+ full:
+	out->len = orig;
+	return 0;
+}
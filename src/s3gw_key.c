@@ -0,0 +1,117 @@
+/*
+ * Object key decoding for the notifications.
+ *
+ * Keys and copy sources are percent-encoded in the requests, and are
+ * published decoded. They are decoded once, when the request is captured,
+ * straight from the request buffer into the object which keeps them. The
+ * decoded key must then be valid UTF-8 since it ends up in JSON strings.
+ */
+
+#include <string.h>
+
+#include <common/compiler.h>
+
+#include <proto/s3gw_key.h>
+
+#define ONES  (~0UL / 0xff)             /* 0x0101...01 */
+#define HIGHS (ONES * 0x80)             /* 0x8080...80 */
+
+/* value of each hex digit, 0x100 for other chars so that any invalid digit
+ * makes a decoded byte larger than 0xff.
+ */
+static const unsigned short s3gw_unhex[256] = {
+	[0 ... 255] = 0x100,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+/* length of the UTF-8 sequences by their first byte, 0 if it cannot start
+ * one (continuation bytes, overlong 2-byte forms and code points above
+ * U+10FFFF).
+ */
+static const unsigned char s3gw_utf8_len[256] = {
+	[0x00 ... 0x7f] = 1,
+	[0xc2 ... 0xdf] = 2,
+	[0xe0 ... 0xef] = 3,
+	[0xf0 ... 0xf4] = 4,
+};
+
+/* Decodes the <len> bytes of percent-encoded <src> into <dst> of <size>
+ * bytes. <dst> may be <src> itself, the decoded string is never longer. A '%'
+ * not followed by two hex digits is kept as is, and '+' is not a space in a
+ * path. Returns the decoded length, or -1 if it does not fit in <size>.
+ */
+int s3gw_url_decode(char *dst, int size, const char *src, int len)
+{
+	const char *end = src + len;
+	const char *pct;
+	char *out = dst;
+	char *lim = dst + size;
+	unsigned int c, ok;
+
+	while (src < end) {
+		pct = memchr(src, '%', end - src);
+		if (!pct)
+			pct = end;
+		if (lim - out < pct - src)
+			return -1;
+		memmove(out, src, pct - src);
+		out += pct - src;
+		src = pct;
+		if (src == end)
+			break;
+
+		if (out == lim)
+			return -1;
+		if (unlikely(end - src < 3)) {
+			*out++ = *src++;
+			continue;
+		}
+		c = (s3gw_unhex[(unsigned char)src[1]] << 4) | s3gw_unhex[(unsigned char)src[2]];
+		ok = c < 0x100;
+		*out++ = ok ? c : '%';
+		src += ok ? 3 : 1;
+	}
+	return out - dst;
+}
+
+/* Returns non-zero if the <len> bytes of <str> are valid UTF-8, which also
+ * excludes overlong forms, surrogates and code points above U+10FFFF.
+ */
+int s3gw_utf8_valid(const char *str, int len)
+{
+	const unsigned char *p = (const unsigned char *)str;
+	const unsigned char *end = p + len;
+	unsigned long w;
+	unsigned int c, n, lo, hi;
+
+	while (p < end) {
+		/* fast path, whole words of ASCII */
+		if (end - p >= sizeof(w)) {
+			memcpy(&w, p, sizeof(w));
+			if (!(w & HIGHS)) {
+				p += sizeof(w);
+				continue;
+			}
+		}
+
+		c = *p;
+		n = s3gw_utf8_len[c];
+		if (!n || end - p < n)
+			return 0;
+
+		/* the range of the second byte depends on the first one */
+		lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+		hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+		if (n > 1 && (p[1] < lo || p[1] > hi))
+			return 0;
+		if (n > 2 && (p[2] & 0xc0) != 0x80)
+			return 0;
+		if (n > 3 && (p[3] & 0xc0) != 0x80)
+			return 0;
+		p += n;
+	}
+	return 1;
+}
@@ -0,0 +1,320 @@
+/*
+ * MessagePack encoding of S3 notifications.
+ *
+ * A notification encoded as MessagePack unpacks to the same object as its
+ * JSON form: the same maps, keys and values, dates and sequencers being kept
+ * as strings. Both schemas are described by tables of fields, each one with
+ * the condition under which it is present and how its value is read from the
+ * event, so that a map header, which holds the number of entries, is written
+ * by counting the fields present first. Strings are copied as is, nothing is
+ * escaped.
+ */
+
+#include <string.h>
+
+#include <common/standard.h>
+
+#include <proto/s3gw_json.h>
+#include <proto/s3gw_msgpack.h>
+
+#include <types/global.h>
+
+/* length of an ISO 8601 date written by s3gw_json_time() */
+#define S3GW_MP_TIME_LEN 24
+
+/* kinds of values of the fields */
+enum {
+	S3GW_MP_CONST = 0,              /* constant string <cst> */
+	S3GW_MP_STR,                    /* string returned by <str> */
+	S3GW_MP_UINT,                   /* integer returned by <num> */
+	S3GW_MP_TIME,                   /* date of the event */
+	S3GW_MP_HEX,                    /* integer returned by <num>, as 16 hex digits */
+	S3GW_MP_MAP,                    /* map of the fields of <sub> */
+	S3GW_MP_LIST,                   /* array holding the map of the fields of <sub> */
+};
+
+/* A field of a map. Tables of fields end with a NULL name. */
+struct s3gw_mp_field {
+	const char *name;
+	int kind;                                       /* S3GW_MP_* */
+	int (*cond)(const struct s3gw_event *ev);       /* present if true, NULL = always */
+	const char *cst;
+	const char *(*str)(const struct s3gw_event *ev, int *len);
+	unsigned long long (*num)(const struct s3gw_event *ev);
+	const struct s3gw_mp_field *sub;
+};
+
+static const char *s3gw_mp_name_v1[S3GW_EV_MAX] = {
+	[S3GW_EV_POST]   = "s3:ObjectCreated:Post",
+	[S3GW_EV_PUT]    = "s3:ObjectCreated:Put",
+	[S3GW_EV_COPY]   = "s3:ObjectCreated:Copy",
+	[S3GW_EV_DELETE] = "s3:ObjectRemoved:Delete",
+};
+
+/* accessors and conditions used by the tables below */
+
+static const char *mp_name_v1(const struct s3gw_event *ev, int *len)
+{
+	*len = strlen(s3gw_mp_name_v1[ev->type]);
+	return s3gw_mp_name_v1[ev->type];
+}
+
+/* schema v2 names drop the "s3:" */
+static const char *mp_name_v2(const struct s3gw_event *ev, int *len)
+{
+	*len = strlen(s3gw_mp_name_v1[ev->type]) - 3;
+	return s3gw_mp_name_v1[ev->type] + 3;
+}
+
+static const char *mp_bucket(const struct s3gw_event *ev, int *len)
+{
+	*len = ev->bucket_len;
+	return ev->data;
+}
+
+static const char *mp_key(const struct s3gw_event *ev, int *len)
+{
+	*len = ev->key_len;
+	return s3gw_ev_key(ev);
+}
+
+static const char *mp_source(const struct s3gw_event *ev, int *len)
+{
+	*len = ev->source_len;
+	return s3gw_ev_source(ev);
+}
+
+static const char *mp_etag(const struct s3gw_event *ev, int *len)
+{
+	*len = ev->etag_len;
+	return s3gw_ev_etag(ev);
+}
+
+static const char *mp_version(const struct s3gw_event *ev, int *len)
+{
+	*len = ev->version_len;
+	return s3gw_ev_version(ev);
+}
+
+static const char *mp_request_id(const struct s3gw_event *ev, int *len)
+{
+	*len = ev->request_id_len;
+	return s3gw_ev_request_id(ev);
+}
+
+static unsigned long long mp_size(const struct s3gw_event *ev)      { return ev->size; }
+static unsigned long long mp_count(const struct s3gw_event *ev)     { return ev->count; }
+static unsigned long long mp_sequencer(const struct s3gw_event *ev) { return ev->sequencer; }
+
+static int mp_is_copy(const struct s3gw_event *ev)     { return ev->type == S3GW_EV_COPY; }
+static int mp_has_source(const struct s3gw_event *ev)  { return ev->source_len; }
+static int mp_has_reqid(const struct s3gw_event *ev)   { return ev->request_id_len; }
+static int mp_has_size(const struct s3gw_event *ev)    { return ev->size >= 0; }
+static int mp_has_etag(const struct s3gw_event *ev)    { return ev->etag_len; }
+static int mp_has_version(const struct s3gw_event *ev) { return ev->version_len; }
+static int mp_coalesced(const struct s3gw_event *ev)   { return ev->count > 1; }
+
+/* s3.event_time, events of old spools have no date */
+static int mp_has_time(const struct s3gw_event *ev)
+{
+	return global.s3.event_time && ev->stamp;
+}
+
+/* schema v1, see s3gw_json_encode_event() */
+static const struct s3gw_mp_field s3gw_mp_v1[] = {
+	{ "event",     S3GW_MP_STR,  NULL,         .str = mp_name_v1 },
+	{ "objectKey", S3GW_MP_STR,  NULL,         .str = mp_key },
+	{ "source",    S3GW_MP_STR,  mp_is_copy,   .str = mp_source },
+	{ "eventTime", S3GW_MP_TIME, mp_has_time },
+	{ "count",     S3GW_MP_UINT, mp_coalesced, .num = mp_count },
+	{ NULL }
+};
+
+/* schema v2, see s3gw_json_encode_v2() */
+static const struct s3gw_mp_field s3gw_mp_v2_params[] = {
+	{ "x-amz-copy-source", S3GW_MP_STR, NULL, .str = mp_source },
+	{ NULL }
+};
+
+static const struct s3gw_mp_field s3gw_mp_v2_response[] = {
+	{ "x-amz-request-id", S3GW_MP_STR, NULL, .str = mp_request_id },
+	{ NULL }
+};
+
+static const struct s3gw_mp_field s3gw_mp_v2_bucket[] = {
+	{ "name", S3GW_MP_STR, NULL, .str = mp_bucket },
+	{ NULL }
+};
+
+static const struct s3gw_mp_field s3gw_mp_v2_object[] = {
+	{ "key",       S3GW_MP_STR,  NULL,           .str = mp_key },
+	{ "size",      S3GW_MP_UINT, mp_has_size,    .num = mp_size },
+	{ "eTag",      S3GW_MP_STR,  mp_has_etag,    .str = mp_etag },
+	{ "versionId", S3GW_MP_STR,  mp_has_version, .str = mp_version },
+	{ "sequencer", S3GW_MP_HEX,  NULL,           .num = mp_sequencer },
+	{ "count",     S3GW_MP_UINT, mp_coalesced,   .num = mp_count },
+	{ NULL }
+};
+
+static const struct s3gw_mp_field s3gw_mp_v2_s3[] = {
+	{ "s3SchemaVersion", S3GW_MP_CONST, NULL, .cst = "1.0" },
+	{ "bucket",          S3GW_MP_MAP,   NULL, .sub = s3gw_mp_v2_bucket },
+	{ "object",          S3GW_MP_MAP,   NULL, .sub = s3gw_mp_v2_object },
+	{ NULL }
+};
+
+static const struct s3gw_mp_field s3gw_mp_v2_record[] = {
+	{ "eventVersion",      S3GW_MP_CONST, NULL,          .cst = "2.1" },
+	{ "eventSource",       S3GW_MP_CONST, NULL,          .cst = "ceph:s3" },
+	{ "eventTime",         S3GW_MP_TIME,  NULL },
+	{ "eventName",         S3GW_MP_STR,   NULL,          .str = mp_name_v2 },
+	{ "requestParameters", S3GW_MP_MAP,   mp_has_source, .sub = s3gw_mp_v2_params },
+	{ "responseElements",  S3GW_MP_MAP,   mp_has_reqid,  .sub = s3gw_mp_v2_response },
+	{ "s3",                S3GW_MP_MAP,   NULL,          .sub = s3gw_mp_v2_s3 },
+	{ NULL }
+};
+
+static const struct s3gw_mp_field s3gw_mp_v2[] = {
+	{ "Records", S3GW_MP_LIST, NULL, .sub = s3gw_mp_v2_record },
+	{ NULL }
+};
+
+/* Returns where to write <len> bytes at the end of <out>, which are accounted
+ * for, or NULL if they do not fit.
+ */
+static inline char *s3gw_mp_room(struct chunk *out, int len)
+{
+	char *p = out->str + out->len;
+
+	if (out->size - out->len < len)
+		return NULL;
+	out->len += len;
+	return p;
+}
+
+/* appends <len> as the <size> bytes following <type> */
+static int s3gw_mp_head(struct chunk *out, unsigned char type, unsigned long long len, int size)
+{
+	char *p = s3gw_mp_room(out, 1 + size);
+
+	if (!p)
+		return 0;
+	*p++ = type;
+	while (size--)
+		*p++ = len >> (8 * size);
+	return 1;
+}
+
+/* appends the header of a string of <len> bytes */
+static int s3gw_mp_str_head(struct chunk *out, unsigned int len)
+{
+	if (len < 32)
+		return s3gw_mp_head(out, 0xa0 | len, 0, 0);
+	if (len < 0x100)
+		return s3gw_mp_head(out, 0xd9, len, 1);
+	if (len < 0x10000)
+		return s3gw_mp_head(out, 0xda, len, 2);
+	return s3gw_mp_head(out, 0xdb, len, 4);
+}
+
+/* appends the string of <len> bytes at <str> */
+static int s3gw_mp_str(struct chunk *out, const char *str, int len)
+{
+	char *p;
+
+	if (!s3gw_mp_str_head(out, len) || !(p = s3gw_mp_room(out, len)))
+		return 0;
+	memcpy(p, str, len);
+	return 1;
+}
+
+/* appends <n> in the smallest unsigned integer format */
+static int s3gw_mp_uint(struct chunk *out, unsigned long long n)
+{
+	if (n < 0x80)
+		return s3gw_mp_head(out, n, 0, 0);
+	if (n < 0x100)
+		return s3gw_mp_head(out, 0xcc, n, 1);
+	if (n < 0x10000)
+		return s3gw_mp_head(out, 0xcd, n, 2);
+	if (n < 0x100000000ULL)
+		return s3gw_mp_head(out, 0xce, n, 4);
+	return s3gw_mp_head(out, 0xcf, n, 8);
+}
+
+/* appends the header of a map of <n> entries */
+static int s3gw_mp_map_head(struct chunk *out, unsigned int n)
+{
+	if (n < 16)
+		return s3gw_mp_head(out, 0x80 | n, 0, 0);
+	return s3gw_mp_head(out, 0xde, n, 2);
+}
+
+/* appends the map of the fields of <fields> present for <ev> */
+static int s3gw_mp_map(struct chunk *out, const struct s3gw_mp_field *fields, const struct s3gw_event *ev)
+{
+	const struct s3gw_mp_field *f;
+	const char *str;
+	unsigned int n = 0;
+	int len;
+
+	for (f = fields; f->name; f++)
+		n += !f->cond || f->cond(ev);
+	if (!s3gw_mp_map_head(out, n))
+		return 0;
+
+	for (f = fields; f->name; f++) {
+		if (f->cond && !f->cond(ev))
+			continue;
+		if (!s3gw_mp_str(out, f->name, strlen(f->name)))
+			return 0;
+
+		switch (f->kind) {
+		case S3GW_MP_CONST:
+			if (!s3gw_mp_str(out, f->cst, strlen(f->cst)))
+				return 0;
+			break;
+		case S3GW_MP_STR:
+			str = f->str(ev, &len);
+			if (!s3gw_mp_str(out, str, len))
+				return 0;
+			break;
+		case S3GW_MP_UINT:
+			if (!s3gw_mp_uint(out, f->num(ev)))
+				return 0;
+			break;
+		case S3GW_MP_TIME:
+			if (!s3gw_mp_str_head(out, S3GW_MP_TIME_LEN) ||
+			    !s3gw_json_time(out, ev->stamp / 1000))
+				return 0;
+			break;
+		case S3GW_MP_HEX:
+			if (!s3gw_mp_str_head(out, 16) || !s3gw_json_hex16(out, f->num(ev)))
+				return 0;
+			break;
+		case S3GW_MP_LIST:
+			if (!s3gw_mp_head(out, 0x91, 0, 0))
+				return 0;
+			/* fall through */
+		case S3GW_MP_MAP:
+			if (!s3gw_mp_map(out, f->sub, ev))
+				return 0;
+			break;
+		}
+	}
+	return 1;
+}
+
+/* Appends the MessagePack notification of <ev> to <out>. Returns 0 if the
+ * payload does not fit, in which case the length of <out> is unchanged.
+ */
+int s3gw_msgpack_encode_event(struct chunk *out, const struct s3gw_event *ev)
+{
+	int orig = out->len;
+
+	if (!s3gw_mp_map(out, ev->schema == S3GW_SCHEMA_V2 ? s3gw_mp_v2 : s3gw_mp_v1, ev)) {
+		out->len = orig;
+		return 0;
+	}
+	return 1;
+}
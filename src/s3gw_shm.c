@@ -0,0 +1,188 @@
+/*
+ * Shared notification queue for nbproc > 1.
+ *
+ * Without it, each process has its own Redis connections. With
+ * s3.shared_queue_size set, the events of all the processes are written to a
+ * ring mapped in shared memory before the fork, and only the publisher process
+ * drains it to Redis. The ring is a bounded MPSC queue where each slot carries
+ * a sequence number, so producers only contend on the tail with a single
+ * compare-and-swap and never wait for each other. The publisher sleeps while
+ * the ring is empty, producers ring a doorbell pipe to wake it up.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <common/compat.h>
+#include <common/standard.h>
+
+#include <proto/fd.h>
+#include <proto/log.h>
+#include <proto/s3gw.h>
+#include <proto/s3gw_shm.h>
+#include <proto/task.h>
+
+#include <types/global.h>
+
+struct s3gw_shm *s3gw_shm = NULL;
+static size_t shm_size = 0;
+static int doorbell[2] = { -1, -1 };
+static struct task *drain_task = NULL;
+
+/* reserves the next free slot. Returns NULL if the ring is full, otherwise
+ * the event to fill, and its position in <pos> for s3gw_shm_commit().
+ */
+struct s3gw_event *s3gw_shm_reserve(unsigned int *pos) {
+	struct s3gw_shm_slot *slot;
+	unsigned int p = *(volatile unsigned int *)&s3gw_shm->tail;
+	int dif;
+
+	while (1) {
+		slot = &s3gw_shm->slots[p & s3gw_shm->mask];
+		dif = (int)(*(volatile unsigned int *)&slot->seq - p);
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&s3gw_shm->tail, p, p + 1))
+				break;
+		}
+		else if (dif < 0)
+			return NULL;
+		p = *(volatile unsigned int *)&s3gw_shm->tail;
+	}
+
+	*pos = p;
+	return &slot->ev;
+}
+
+/* hands the event reserved at <pos> over to the publisher, and wakes it up if
+ * it is waiting.
+ */
+void s3gw_shm_commit(unsigned int pos) {
+	struct s3gw_shm_slot *slot = &s3gw_shm->slots[pos & s3gw_shm->mask];
+
+	__sync_synchronize();
+	slot->seq = pos + 1;
+	__sync_synchronize();
+
+	if (s3gw_shm->sleeping && __sync_lock_test_and_set(&s3gw_shm->sleeping, 0))
+		shut_your_big_mouth_gcc(write(doorbell[1], "", 1));
+}
+
+/* returns the oldest event ready to be consumed, or NULL. Publisher only. */
+struct s3gw_event *s3gw_shm_peek() {
+	struct s3gw_shm_slot *slot = &s3gw_shm->slots[s3gw_shm->head & s3gw_shm->mask];
+
+	if (*(volatile unsigned int *)&slot->seq != s3gw_shm->head + 1)
+		return NULL;
+	__sync_synchronize();
+	return &slot->ev;
+}
+
+/* gives the slot returned by s3gw_shm_peek() back to the producers */
+void s3gw_shm_release() {
+	struct s3gw_shm_slot *slot = &s3gw_shm->slots[s3gw_shm->head & s3gw_shm->mask];
+
+	__sync_synchronize();
+	slot->seq = s3gw_shm->head + s3gw_shm->size;
+	s3gw_shm->head++;
+}
+
+/* Tells the producers to ring the doorbell for the next event. Returns 0 if
+ * an event arrived meanwhile, in which case the publisher must not sleep.
+ */
+int s3gw_shm_idle() {
+	s3gw_shm->sleeping = 1;
+	__sync_synchronize();
+	if (!s3gw_shm_peek())
+		return 1;
+	s3gw_shm->sleeping = 0;
+	return 0;
+}
+
+/* I/O handler of the doorbell, wakes the drain task up */
+static int s3gw_shm_doorbell(int fd) {
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	fd_cant_recv(fd);
+	task_wakeup(drain_task, TASK_WOKEN_IO);
+	return 0;
+}
+
+/* Maps the shared ring and creates the doorbell. Must be called before the
+ * processes are forked. Does nothing unless s3.shared_queue_size is set and
+ * several processes are started. Returns non-zero on failure.
+ */
+int s3gw_shm_init() {
+	unsigned int size = 1, i;
+
+	if (!global.s3.shared_queue_size || global.nbproc < 2)
+		return 0;
+
+	while (size < global.s3.shared_queue_size)
+		size <<= 1;
+
+	shm_size = sizeof(*s3gw_shm) + size * sizeof(struct s3gw_shm_slot);
+	s3gw_shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s3gw_shm == MAP_FAILED) {
+		s3gw_shm = NULL;
+		return 1;
+	}
+
+	s3gw_shm->size = size;
+	s3gw_shm->mask = size - 1;
+	for (i = 0; i < size; i++)
+		s3gw_shm->slots[i].seq = i;
+
+	if (pipe(doorbell) < 0 ||
+	    fcntl(doorbell[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(doorbell[1], F_SETFL, O_NONBLOCK) < 0) {
+		s3gw_shm_deinit();
+		return 1;
+	}
+	return 0;
+}
+
+/* Called in the publisher once forked. <t> is woken up whenever events are
+ * committed while the publisher sleeps. The other processes only keep the
+ * writing side of the doorbell. Returns non-zero on failure.
+ */
+int s3gw_shm_attach(struct task *t) {
+	if (relative_pid != S3GW_SHM_PUBLISHER) {
+		close(doorbell[0]);
+		doorbell[0] = -1;
+		return 0;
+	}
+
+	close(doorbell[1]);
+	doorbell[1] = -1;
+	if (doorbell[0] >= global.maxsock)
+		return 1;
+
+	drain_task = t;
+	fdtab[doorbell[0]].owner = s3gw_shm;
+	fdtab[doorbell[0]].iocb = s3gw_shm_doorbell;
+	fd_insert(doorbell[0]);
+	fd_want_recv(doorbell[0]);
+	return 0;
+}
+
+void s3gw_shm_deinit() {
+	if (doorbell[0] >= 0) {
+		if (drain_task)
+			fd_delete(doorbell[0]);
+		else
+			close(doorbell[0]);
+	}
+	if (doorbell[1] >= 0)
+		close(doorbell[1]);
+	doorbell[0] = doorbell[1] = -1;
+	drain_task = NULL;
+
+	if (s3gw_shm)
+		munmap(s3gw_shm, shm_size);
+	s3gw_shm = NULL;
+}
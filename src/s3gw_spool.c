@@ -0,0 +1,450 @@
+/*
+ * Durable spool for S3 notifications.
+ *
+ * Events which cannot be kept in memory are appended to segment files in
+ * s3.spool_dir. Segments are mapped in memory, records are appended with a
+ * small header and a CRC, and the new records are flushed to disk in batches
+ * every s3.spool_fsync ms. The flushes are only started, the event loop never
+ * waits for the disk. Fully replayed segments are removed. Each process uses
+ * its own files, named after its relative pid.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <common/compat.h>
+#include <common/hash.h>
+#include <common/ticks.h>
+#include <common/time.h>
+
+#include <proto/log.h>
+#include <proto/s3gw.h>
+#include <proto/s3gw_sink.h>
+#include <proto/s3gw_spool.h>
+#include <proto/task.h>
+
+#include <types/global.h>
+
+#define S3GW_SPOOL_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+/* segments ordered by sequence number, the last one may be the writer */
+static struct list segments = LIST_HEAD_INIT(segments);
+static unsigned int nb_segments = 0;
+static unsigned long long next_seq = 0;
+static unsigned int pending_records = 0;
+static struct task *sync_task = NULL;
+
+static void spool_seg_path(char *path, size_t size, unsigned long long seq) {
+	snprintf(path, size, "%s/s3gw-%d-%016llx.spool", global.s3.spool_dir, relative_pid, seq);
+}
+
+/* starts writing bytes <from> to <to> of <seg> to disk, without waiting */
+static void spool_flush(struct s3gw_spool_seg *seg, size_t from, size_t to) {
+	int ret;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+	ret = sync_file_range(seg->fd, from, to - from, SYNC_FILE_RANGE_WRITE);
+#else
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	from &= ~(page - 1);
+	ret = msync(seg->area + from, to - from, MS_ASYNC);
+#endif
+	if (ret < 0)
+		S3_LOG(NULL, LOG_ERR, "spool: cannot flush segment: %s", strerror(errno));
+}
+
+/* flushes the records of <seg> written since the last call, and saves its
+ * replay position if <rpos> is set.
+ */
+static void spool_sync_seg(struct s3gw_spool_seg *seg, int rpos) {
+	struct s3gw_spool_hdr *hdr = (struct s3gw_spool_hdr *)seg->area;
+
+	if (seg->spos < seg->wpos) {
+		spool_flush(seg, seg->spos, seg->wpos);
+		seg->spos = seg->wpos;
+	}
+
+	if (rpos && seg->rpos_dirty) {
+		hdr->rpos = seg->rpos;
+		spool_flush(seg, 0, sizeof(*hdr));
+		seg->rpos_dirty = 0;
+	}
+}
+
+/* unmaps <seg> and removes it from the list. The file is deleted if <remove>
+ * is set.
+ */
+static void spool_release_seg(struct s3gw_spool_seg *seg, int remove) {
+	char path[MAXPATHLEN];
+
+	if (remove) {
+		spool_seg_path(path, sizeof(path), seg->seq);
+		unlink(path);
+	}
+	pending_records -= seg->records;
+	munmap(seg->area, seg->size);
+	close(seg->fd);
+	LIST_DEL(&seg->list);
+	nb_segments--;
+	free(seg);
+}
+
+/* maps segment <seq>. A new empty segment is created if <create> is set,
+ * otherwise the existing file is mapped as is. The blocks of a new segment
+ * are allocated upfront: a store into a hole of the mapping on a full disk
+ * would raise SIGBUS. Returns NULL on failure, including a full disk.
+ */
+static struct s3gw_spool_seg *spool_map_seg(unsigned long long seq, int create) {
+	char path[MAXPATHLEN];
+	struct s3gw_spool_seg *seg;
+	struct s3gw_spool_hdr *hdr;
+	struct stat st;
+	int ret;
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return NULL;
+
+	spool_seg_path(path, sizeof(path), seq);
+	seg->seq = seq;
+	seg->fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600);
+	if (seg->fd < 0)
+		goto fail;
+
+	if (create) {
+		ret = posix_fallocate(seg->fd, 0, global.s3.spool_segment_size);
+		if (ret) {
+			errno = ret;
+			goto fail_close;
+		}
+		seg->size = global.s3.spool_segment_size;
+	}
+	else {
+		if (fstat(seg->fd, &st) < 0 || st.st_size < sizeof(*hdr))
+			goto fail_close;
+		seg->size = st.st_size;
+	}
+
+	seg->area = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if (seg->area == MAP_FAILED)
+		goto fail_close;
+
+	hdr = (struct s3gw_spool_hdr *)seg->area;
+	if (create) {
+		hdr->magic = S3GW_SPOOL_SEG_MAGIC;
+		hdr->version = S3GW_SPOOL_VERSION;
+		hdr->rpos = sizeof(*hdr);
+	}
+	seg->rpos = seg->wpos = sizeof(*hdr);
+	/* the header of a new segment is flushed with its first records */
+	seg->spos = create ? 0 : seg->wpos;
+
+	LIST_ADDQ(&segments, &seg->list);
+	nb_segments++;
+	return seg;
+
+ fail_close:
+	close(seg->fd);
+	if (create)
+		unlink(path);
+ fail:
+	S3_LOG(NULL, LOG_ERR, "spool: cannot map '%s': %s", path, strerror(errno));
+	free(seg);
+	return NULL;
+}
+
+/* checks the record at offset <pos> of <seg>. Returns its aligned size, or 0
+ * if no valid record is found there.
+ */
+static size_t spool_check_rec(const struct s3gw_spool_seg *seg, size_t pos) {
+	const struct s3gw_spool_rec *rec;
+
+	if (pos + sizeof(*rec) > seg->size)
+		return 0;
+
+	rec = (const struct s3gw_spool_rec *)(seg->area + pos);
+	if (rec->magic != S3GW_SPOOL_REC_MAGIC ||
+	    rec->len < sizeof(struct s3gw_spool_event) ||
+	    rec->len > seg->size - pos - sizeof(*rec) ||
+	    hash_crc32((const char *)(rec + 1), rec->len) != rec->crc)
+		return 0;
+
+	return S3GW_SPOOL_ALIGN(sizeof(*rec) + rec->len);
+}
+
+/* Rebuilds the state of a segment left by a previous run. Records are valid
+ * up to the first one with a bad header or CRC, which is where the previous
+ * process stopped writing. Returns the number of records left to replay.
+ */
+static unsigned int spool_recover_seg(struct s3gw_spool_seg *seg) {
+	const struct s3gw_spool_hdr *hdr = (const struct s3gw_spool_hdr *)seg->area;
+	size_t pos = sizeof(*hdr);
+	size_t len;
+
+	if (hdr->magic != S3GW_SPOOL_SEG_MAGIC ||
+	    hdr->version != S3GW_SPOOL_VERSION)
+		return 0;
+
+	while ((len = spool_check_rec(seg, pos))) {
+		if (pos >= hdr->rpos)
+			seg->records++;
+		pos += len;
+	}
+
+	seg->wpos = seg->spos = pos;
+	seg->rpos = hdr->rpos < pos ? hdr->rpos : pos;
+	seg->sealed = 1;
+	pending_records += seg->records;
+	return seg->records;
+}
+
+/* Sync task: flushes the new records of all the segments, and saves their
+ * replay positions once the timer expires.
+ */
+static struct task *spool_sync(struct task *t) {
+	struct s3gw_spool_seg *seg;
+	int expired = tick_is_expired(t->expire, now_ms);
+
+	list_for_each_entry(seg, &segments, list)
+		spool_sync_seg(seg, expired);
+
+	if (expired)
+		t->expire = TICK_ETERNITY;
+	return t;
+}
+
+/* runs the sync task in <delay> ms, or right away if <delay> is 0 */
+static void spool_schedule_sync(unsigned int delay) {
+	if (!delay)
+		task_wakeup(sync_task, TASK_WOKEN_OTHER);
+	else if (!tick_isset(sync_task->expire))
+		task_schedule(sync_task, tick_add(now_ms, delay));
+}
+
+/* Appends <ev> to the spool. Returns 0 on success, or non-zero if the spool
+ * is disabled, full or failing.
+ */
+int s3gw_spool_write(const struct s3gw_event *ev) {
+	struct s3gw_spool_seg *seg = NULL;
+	struct s3gw_spool_rec *rec;
+	struct s3gw_spool_event *sev;
+	size_t data_len = ev->bucket_len + ev->key_len + ev->source_len +
+	                  ev->etag_len + ev->version_len + ev->request_id_len;
+	size_t len = sizeof(*sev) + data_len;
+	size_t need = S3GW_SPOOL_ALIGN(sizeof(*rec) + len);
+
+	if (!sync_task)
+		return 1;
+
+	if (!LIST_ISEMPTY(&segments)) {
+		seg = LIST_PREV(&segments, struct s3gw_spool_seg *, list);
+		if (seg->sealed || seg->wpos + need > seg->size) {
+			seg->sealed = 1;
+			seg = NULL;
+		}
+	}
+
+	if (!seg) {
+		if (need > global.s3.spool_segment_size - sizeof(struct s3gw_spool_hdr))
+			return 1;
+		if (nb_segments >= global.s3.spool_max_segments)
+			return 1;
+		seg = spool_map_seg(next_seq, 1);
+		if (!seg)
+			return 1;
+		next_seq++;
+	}
+
+	/* the record header is written last so that a crash in the middle
+	 * leaves an invalid record behind.
+	 */
+	rec = (struct s3gw_spool_rec *)(seg->area + seg->wpos);
+	sev = (struct s3gw_spool_event *)(rec + 1);
+	sev->type = ev->type;
+	sev->bucket_len = ev->bucket_len;
+	sev->key_len = ev->key_len;
+	sev->source_len = ev->source_len;
+	sev->schema = ev->schema;
+	sev->etag_len = ev->etag_len;
+	sev->version_len = ev->version_len;
+	sev->request_id_len = ev->request_id_len;
+	sev->count = ev->count;
+	sev->size = ev->size;
+	sev->time = ev->stamp / 1000;
+	sev->sequencer = ev->sequencer;
+	memcpy(sev + 1, ev->data, data_len);
+
+	rec->len = len;
+	rec->crc = hash_crc32((const char *)sev, len);
+	rec->reserved = 0;
+	rec->magic = S3GW_SPOOL_REC_MAGIC;
+
+	seg->wpos += need;
+	seg->records++;
+	pending_records++;
+
+	spool_schedule_sync(global.s3.spool_fsync);
+	return 0;
+}
+
+/* Reads the oldest record not replayed yet into <ev>. Returns 1 if an event
+ * was read, otherwise 0. Segments are deleted once fully replayed. The CRC
+ * does not tell whether the lengths of a record fit, for example in a segment
+ * written by a build with longer URIs: such records are skipped and dropped.
+ */
+int s3gw_spool_read(struct s3gw_event *ev) {
+	struct s3gw_spool_seg *seg, *back;
+	struct s3gw_spool_rec *rec;
+	struct s3gw_spool_event *sev;
+	size_t data_len;
+	int valid;
+
+ again:
+	list_for_each_entry_safe(seg, back, &segments, list) {
+		if (seg->rpos >= seg->wpos) {
+			/* fully replayed. The writer is sealed so that the
+			 * next event opens a new segment.
+			 */
+			spool_release_seg(seg, 1);
+			continue;
+		}
+
+		rec = (struct s3gw_spool_rec *)(seg->area + seg->rpos);
+		sev = (struct s3gw_spool_event *)(rec + 1);
+		ev->type = sev->type;
+		ev->bucket_len = sev->bucket_len;
+		ev->key_len = sev->key_len;
+		ev->source_len = sev->source_len;
+		ev->schema = sev->schema;
+		ev->etag_len = sev->etag_len;
+		ev->version_len = sev->version_len;
+		ev->request_id_len = sev->request_id_len;
+		ev->size = sev->size;
+		ev->stamp = sev->time * 1000;
+		ev->sequencer = sev->sequencer;
+		ev->count = sev->count;
+
+		data_len = ev->bucket_len + ev->key_len + ev->source_len +
+		           ev->etag_len + ev->version_len + ev->request_id_len;
+		valid = ev->type < S3GW_EV_MAX && ev->schema <= S3GW_SCHEMA_V2 &&
+		        data_len <= rec->len - sizeof(*sev) && data_len <= sizeof(ev->data);
+		if (valid)
+			memcpy(ev->data, sev + 1, data_len);
+		else {
+			S3_LOG(NULL, LOG_ERR, "spool: invalid record of %u bytes skipped, notification dropped",
+			       rec->len);
+			s3gw_dropped(1);
+		}
+
+		seg->rpos += S3GW_SPOOL_ALIGN(sizeof(*rec) + rec->len);
+		seg->records--;
+		seg->rpos_dirty = 1;
+		pending_records--;
+
+		/* the replay position is never saved after each event */
+		if (seg->rpos >= seg->wpos)
+			spool_release_seg(seg, 1);
+		else
+			spool_schedule_sync(global.s3.spool_fsync ? global.s3.spool_fsync : S3GW_DEF_SPOOL_FSYNC);
+
+		if (!valid)
+			goto again;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* returns the number of records waiting to be replayed */
+unsigned int s3gw_spool_pending() {
+	return pending_records;
+}
+
+/* Maps the segments left by a previous run and prepares the spool. Returns
+ * non-zero on failure. Does nothing if no spool directory is configured.
+ */
+int s3gw_spool_init() {
+	struct s3gw_spool_seg *seg, *cur;
+	struct dirent *de;
+	DIR *dir;
+	unsigned long long seq;
+	int pid;
+	char c;
+
+	if (!global.s3.spool_dir)
+		return 0;
+
+	dir = opendir(global.s3.spool_dir);
+	if (!dir) {
+		S3_LOG(NULL, LOG_ERR, "spool: cannot open '%s': %s", global.s3.spool_dir, strerror(errno));
+		return 1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (sscanf(de->d_name, "s3gw-%d-%llx.spoo%c", &pid, &seq, &c) != 3 ||
+		    pid != relative_pid)
+			continue;
+
+		seg = spool_map_seg(seq, 0);
+		if (!seg)
+			continue;
+
+		if (!spool_recover_seg(seg)) {
+			spool_release_seg(seg, 1);
+			continue;
+		}
+
+		/* keep the list ordered by sequence number */
+		LIST_DEL(&seg->list);
+		list_for_each_entry(cur, &segments, list) {
+			if (cur->seq > seq)
+				break;
+		}
+		LIST_ADDQ(&cur->list, &seg->list);
+
+		if (seq >= next_seq)
+			next_seq = seq + 1;
+	}
+	closedir(dir);
+
+	sync_task = task_new();
+	if (!sync_task)
+		return 1;
+	sync_task->process = spool_sync;
+	sync_task->expire = TICK_ETERNITY;
+
+	if (pending_records)
+		S3_LOG(NULL, LOG_NOTICE, "spool: %u notification(s) recovered from %u segment(s)",
+		       pending_records, nb_segments);
+	return 0;
+}
+
+/* Writes all segments to disk, waiting for it as the process is stopping, and
+ * unmaps them. They are kept on disk for the next run.
+ */
+void s3gw_spool_deinit() {
+	struct s3gw_spool_seg *seg, *back;
+	struct s3gw_spool_hdr *hdr;
+
+	list_for_each_entry_safe(seg, back, &segments, list) {
+		hdr = (struct s3gw_spool_hdr *)seg->area;
+		hdr->rpos = seg->rpos;
+		if (fsync(seg->fd) < 0)
+			S3_LOG(NULL, LOG_ERR, "spool: fsync() failed: %s", strerror(errno));
+		spool_release_seg(seg, seg->rpos >= seg->wpos);
+	}
+
+	if (sync_task) {
+		task_delete(sync_task);
+		task_free(sync_task);
+		sync_task = NULL;
+	}
+}
@@ -0,0 +1,261 @@
+/*
+ * Notification statistics, reported by "show s3" and the stats page.
+ *
+ * The counters themselves are updated where the events go through, in
+ * s3gw.c. All of them are per process: with nbproc, the process which
+ * publishes is the one knowing about Redis.
+ */
+
+#include <common/chunk.h>
+#include <common/mini-clist.h>
+#include <common/time.h>
+
+#include <proto/freq_ctr.h>
+#include <proto/s3gw.h>
+#include <proto/s3gw_shm.h>
+#include <proto/s3gw_spool.h>
+#include <proto/s3gw_stats.h>
+
+#include <types/global.h>
+
+static const char *s3gw_shard_states[] = {
+	[S3GW_SHARD_DOWN]       = "down",
+	[S3GW_SHARD_CONNECTING] = "connecting",
+	[S3GW_SHARD_PROBING]    = "probing",
+	[S3GW_SHARD_UP]         = "up",
+};
+
+static const char *s3gw_encodings[] = {
+	[S3GW_ENC_JSON]    = "json",
+	[S3GW_ENC_MSGPACK] = "msgpack",
+};
+
+/* accounts for a duration of <us> microseconds in <hist> */
+static void s3gw_hist_add(struct s3gw_hist *hist, unsigned long long us)
+{
+	int slot;
+
+	for (slot = 0; slot < S3GW_LAT_SLOTS - 1 && (us >> (S3GW_LAT_SHIFT + slot)); slot++)
+		;
+
+	hist->slots[slot]++;
+	hist->count++;
+	hist->sum += us;
+	if (us > hist->max)
+		hist->max = us;
+}
+
+/* Accounts for the reply to <cmd>: the round-trip since it was sent, and for
+ * each of its events the time since the response it notifies. The response
+ * date is the wall clock one, which <date> follows. Events replayed from a
+ * spool written before the responses were stamped are not accounted for.
+ */
+void s3gw_stats_acked(const struct s3gw_cmd *cmd)
+{
+	unsigned long long cur = (unsigned long long)date.tv_sec * 1000000 + date.tv_usec;
+	long long us;
+	unsigned int i;
+
+	us = (now.tv_sec - cmd->sent.tv_sec) * 1000000LL + now.tv_usec - cmd->sent.tv_usec;
+	s3gw_hist_add(&s3gw_counters.rtt, us > 0 ? us : 0);
+
+	for (i = 0; i < cmd->events; i++) {
+		if (!cmd->stamps[i])
+			continue;
+		s3gw_hist_add(&s3gw_counters.delivery,
+		              cur > cmd->stamps[i] ? cur - cmd->stamps[i] : 0);
+	}
+}
+
+/* appends the lines of <hist> named after <name> to <out> */
+static void s3gw_hist_dump(struct chunk *out, const char *name, const struct s3gw_hist *hist)
+{
+	int slot;
+
+	chunk_appendf(out, "%s_count: %llu\n%s_avg_us: %llu\n%s_max_us: %llu\n",
+	              name, hist->count,
+	              name, hist->count ? hist->sum / hist->count : 0,
+	              name, hist->max);
+
+	for (slot = 0; slot < S3GW_LAT_SLOTS - 1; slot++)
+		chunk_appendf(out, "%s_lt_%luus: %llu\n",
+		              name, 1UL << (S3GW_LAT_SHIFT + slot), hist->slots[slot]);
+	chunk_appendf(out, "%s_ge_%luus: %llu\n",
+	              name, 1UL << (S3GW_LAT_SHIFT + slot - 1), hist->slots[slot]);
+}
+
+/* returns the number of events in the rings of the Redis servers, and adds
+ * their events in flight to <inflight>.
+ */
+static unsigned int s3gw_stats_queued(unsigned int *inflight)
+{
+	struct s3gw_shard *shard;
+	unsigned int queued = 0;
+
+	*inflight = 0;
+	list_for_each_entry(shard, &global.s3.servers, list) {
+		queued += s3gw_ring_count(&shard->ring);
+		*inflight += shard->inflight;
+	}
+	return queued;
+}
+
+/* Appends the global counters, the latency histogram and the Redis servers
+ * to <out>, one "name: value" per line like "show info", then one line per
+ * server.
+ */
+void s3gw_stats_dump_info(struct chunk *out)
+{
+	struct s3gw_counters *c = &s3gw_counters;
+	struct s3gw_shard *shard;
+	unsigned int queued, inflight;
+
+	queued = s3gw_stats_queued(&inflight);
+
+	chunk_appendf(out,
+	              "Enqueued: %llu\n"
+	              "Enqueue_rate: %u\n"
+	              "Published: %llu\n"
+	              "Publish_rate: %u\n"
+	              "Dropped: %llu\n"
+	              "Drop_rate: %u\n"
+	              "Filtered: %llu\n"
+	              "Coalesced: %llu\n"
+	              "Spooled: %llu\n"
+	              "Replayed: %llu\n"
+	              "Flushed: %llu\n"
+	              "Queued: %u\n"
+	              "Shared_queued: %u\n"
+	              "Held: %u\n"
+	              "Spool_pending: %u\n"
+	              "Inflight: %u\n"
+	              "Redis_retries: %llu\n",
+	              c->enqueued, read_freq_ctr(&c->enqueued_rate),
+	              c->published, read_freq_ctr(&c->published_rate),
+	              c->dropped, read_freq_ctr(&c->dropped_rate),
+	              c->filtered, c->coalesced, c->spooled, c->replayed, c->flushed,
+	              queued,
+	              s3gw_shm ? s3gw_shm->tail - s3gw_shm->head : 0,
+	              s3gw_pending_count(),
+	              s3gw_spool_pending(),
+	              inflight,
+	              c->retries);
+
+	s3gw_hist_dump(out, "Latency", &c->rtt);
+	s3gw_hist_dump(out, "Delivery", &c->delivery);
+
+	list_for_each_entry(shard, &global.s3.servers, list) {
+		chunk_appendf(out, "server %s type=%s state=%s weight=%d queued=%u inflight=%d failures=%u retries=%u\n",
+		              shard->addr, shard->sink->type, s3gw_shard_states[shard->state], shard->weight,
+		              s3gw_ring_count(&shard->ring), shard->inflight,
+		              shard->failures, shard->retries);
+	}
+}
+
+/* appends one line with the counters of bucket <b> to <out> */
+void s3gw_stats_dump_bucket(struct chunk *out, struct s3gw_bucket *b)
+{
+	chunk_appendf(out, "bucket %s schema=v%d encoding=%s events=%llu events_rate=%u published=%llu publish_rate=%u failed=%llu filtered=%llu\n",
+	              (const char *)b->node.key, b->schema + 1, s3gw_encodings[b->encoding],
+	              b->counters.events, read_freq_ctr(&b->counters.events_rate),
+	              b->counters.published, read_freq_ctr(&b->counters.published_rate),
+	              b->counters.failed, b->counters.filtered);
+}
+
+/* appends <str> to <out>, HTML-encoded */
+static void s3gw_stats_html_str(struct chunk *out, char *str)
+{
+	struct chunk src;
+
+	chunk_initstr(&src, str);
+	chunk_htmlencode(out, &src);
+}
+
+/* Appends the HTML section of the stats page to <out>. The buckets stop being
+ * listed once half of <out> is used, "show s3" has them all.
+ */
+void s3gw_stats_dump_html(struct chunk *out)
+{
+	struct s3gw_counters *c = &s3gw_counters;
+	struct s3gw_shard *shard;
+	struct s3gw_bucket *b;
+	unsigned int queued, inflight;
+
+	queued = s3gw_stats_queued(&inflight);
+
+	chunk_appendf(out,
+	              "<h3>&gt; S3 notifications</h3>\n"
+	              "<table class=\"tbl\" width=\"100%%\">\n"
+	              "<tr class=\"titre\">"
+	              "<th colspan=2>Enqueued</th><th colspan=2>Published</th>"
+	              "<th colspan=2>Dropped</th><th rowspan=2>Filtered</th>"
+	              "<th rowspan=2>Coalesced</th><th rowspan=2>Spooled</th>"
+	              "<th rowspan=2>Queued</th><th rowspan=2>Inflight</th>"
+	              "<th rowspan=2>Retries</th><th rowspan=2>Latency</th><th colspan=2>Delivery</th>"
+	              "</tr>\n"
+	              "<tr class=\"titre\">"
+	              "<th>Total</th><th>Rate</th><th>Total</th><th>Rate</th>"
+	              "<th>Total</th><th>Rate</th><th>Avg</th><th>Max</th>"
+	              "</tr>\n"
+	              "<tr class=\"frontend\">"
+	              "<td>%llu</td><td>%u</td><td>%llu</td><td>%u</td>"
+	              "<td>%llu</td><td>%u</td><td>%llu</td><td>%llu</td><td>%llu</td>"
+	              "<td>%u</td><td>%u</td><td>%llu</td><td>%llu us</td><td>%llu us</td><td>%llu us</td>"
+	              "</tr>\n"
+	              "</table>\n",
+	              c->enqueued, read_freq_ctr(&c->enqueued_rate),
+	              c->published, read_freq_ctr(&c->published_rate),
+	              c->dropped, read_freq_ctr(&c->dropped_rate),
+	              c->filtered, c->coalesced, c->spooled,
+	              queued + (s3gw_shm ? s3gw_shm->tail - s3gw_shm->head : 0) + s3gw_pending_count(),
+	              inflight, c->retries,
+	              c->rtt.count ? c->rtt.sum / c->rtt.count : 0,
+	              c->delivery.count ? c->delivery.sum / c->delivery.count : 0,
+	              c->delivery.max);
+
+	chunk_appendf(out,
+	              "<table class=\"tbl\" width=\"100%%\">\n"
+	              "<tr class=\"titre\">"
+	              "<th class=\"pxname\">Server</th><th>Type</th><th>Status</th><th>Wght</th>"
+	              "<th>Queued</th><th>Inflight</th><th>Failures</th><th>Retries</th>"
+	              "</tr>\n");
+	list_for_each_entry(shard, &global.s3.servers, list) {
+		chunk_appendf(out, "<tr class=\"%s\"><td class=ac>",
+		              shard->state == S3GW_SHARD_UP ? "active4" : "active0");
+		s3gw_stats_html_str(out, shard->addr);
+		chunk_appendf(out,
+		              "</td><td>%s</td><td>%s</td><td>%d</td><td>%u</td><td>%d</td><td>%u</td><td>%u</td></tr>\n",
+		              shard->sink->type, s3gw_shard_states[shard->state], shard->weight,
+		              s3gw_ring_count(&shard->ring), shard->inflight,
+		              shard->failures, shard->retries);
+	}
+	chunk_appendf(out, "</table>\n");
+
+	chunk_appendf(out,
+	              "<table class=\"tbl\" width=\"100%%\">\n"
+	              "<tr class=\"titre\">"
+	              "<th class=\"pxname\" rowspan=2>Bucket</th><th rowspan=2>Schema</th><th rowspan=2>Encoding</th>"
+	              "<th colspan=2>Events</th><th colspan=2>Published</th>"
+	              "<th rowspan=2>Failed</th><th rowspan=2>Filtered</th>"
+	              "</tr>\n"
+	              "<tr class=\"titre\">"
+	              "<th>Total</th><th>Rate</th><th>Total</th><th>Rate</th>"
+	              "</tr>\n");
+	list_for_each_entry(b, &global.s3.buckets, list) {
+		if (b->disabled)
+			continue;
+		if (out->len > out->size / 2) {
+			chunk_appendf(out, "<tr class=\"frontend\"><td colspan=9>more buckets on \"show s3\"</td></tr>\n");
+			break;
+		}
+		chunk_appendf(out, "<tr class=\"frontend\"><td class=ac>");
+		s3gw_stats_html_str(out, (char *)b->node.key);
+		chunk_appendf(out,
+		              "</td><td>v%d</td><td>%s</td><td>%llu</td><td>%u</td><td>%llu</td><td>%u</td><td>%llu</td><td>%llu</td></tr>\n",
+		              b->schema + 1, s3gw_encodings[b->encoding],
+		              b->counters.events, read_freq_ctr(&b->counters.events_rate),
+		              b->counters.published, read_freq_ctr(&b->counters.published_rate),
+		              b->counters.failed, b->counters.filtered);
+	}
+	chunk_appendf(out, "</table>\n");
+}
@@ -0,0 +1,275 @@
+/*
+ * UNIX sink for S3 notifications.
+ *
+ * Events are written as records to a local UNIX stream socket, from which a
+ * sidecar forwards them wherever it wants. Each record starts with its length
+ * on 4 bytes in network byte order, not counting these 4 bytes, followed by the
+ * length of the bucket name on one byte, the bucket name and the notification,
+ * in the encoding of the bucket. A flush encodes a batch of records in the
+ * output buffer of the connection, which the poller writes at once. The next
+ * batch is only taken once the buffer is fully written, the events wait in the
+ * ring in the mean time. The sidecar acknowledges nothing, events are published
+ * once the kernel took them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <common/chunk.h>
+#include <common/compat.h>
+
+#include <types/fd.h>
+#include <types/global.h>
+
+#include <proto/fd.h>
+#include <proto/log.h>
+#include <proto/s3gw.h>
+#include <proto/s3gw_sink.h>
+#include <proto/task.h>
+
+/* length and bucket name length before the bucket name of each record */
+#define S3GW_UNIX_HDR_LEN 5
+
+struct s3gw_usock {
+	int fd;
+	struct chunk out;               /* records of the current batch */
+	int sent;                       /* bytes of <out> already written */
+	struct list cmds;               /* batches in <out>, oldest first */
+};
+
+/* closes the connection of <shard>, the records not fully written are lost */
+static void unix_close(struct s3gw_shard *shard) {
+	struct s3gw_usock *us = shard->usock;
+	struct s3gw_cmd *cmd, *back;
+
+	if (!us)
+		return;
+	shard->usock = NULL;
+
+	list_for_each_entry_safe(cmd, back, &us->cmds, list) {
+		LIST_DEL(&cmd->list);
+		s3gw_cmd_done(shard, cmd, 0);
+	}
+	fd_stop_both(us->fd);
+	fd_delete(us->fd);
+	free(us->out.str);
+	free(us);
+}
+
+/* closes the connection of <shard> after an error, its buckets move to the
+ * other servers until it is reconnected.
+ */
+static void unix_lost(struct s3gw_shard *shard, const char *reason) {
+	if (global.s3.enabled)
+		S3_LOG(NULL, LOG_ERR, "lost connection to UNIX sink %s: %s", shard->addr, reason);
+	unix_close(shard);
+	s3gw_shard_lost(shard);
+}
+
+/* Writes what is left of the output of <shard> and publishes the batches
+ * fully written. Returns non-zero if the connection was lost.
+ */
+static int unix_send(struct s3gw_shard *shard) {
+	struct s3gw_usock *us = shard->usock;
+	struct s3gw_cmd *cmd;
+	int ret;
+
+	while (us->sent < us->out.len) {
+		ret = send(us->fd, us->out.str + us->sent, us->out.len - us->sent,
+		           MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret > 0) {
+			us->sent += ret;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN) {
+			fd_cant_send(us->fd);
+			break;
+		}
+		unix_lost(shard, ret < 0 ? strerror(errno) : "short write");
+		return 1;
+	}
+
+	while (!LIST_ISEMPTY(&us->cmds)) {
+		cmd = LIST_NEXT(&us->cmds, struct s3gw_cmd *, list);
+		if (cmd->end > us->sent)
+			break;
+		LIST_DEL(&cmd->list);
+		s3gw_cmd_done(shard, cmd, 1);
+	}
+
+	/* the buffer is free for the next batch */
+	if (us->sent == us->out.len) {
+		us->out.len = us->sent = 0;
+		fd_stop_send(us->fd);
+		if (s3gw_ring_count(&shard->ring))
+			task_wakeup(shard->flush_task, TASK_WOKEN_IO);
+	}
+	return 0;
+}
+
+/* I/O handler of the connection of a UNIX sink. The sidecar is not expected
+ * to send anything, reading only detects that it went away.
+ */
+static int unix_fd_handler(int fd) {
+	struct s3gw_shard *shard = fdtab[fd].owner;
+	char buf[256];
+	int ret;
+
+	if (fd_recv_active(fd) && fd_recv_ready(fd)) {
+		ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+			unix_lost(shard, ret < 0 ? strerror(errno) : "closed by peer");
+			return 0;
+		}
+		if (ret < 0)
+			fd_cant_recv(fd);
+	}
+
+	if (fd_send_active(fd) && fd_send_ready(fd))
+		unix_send(shard);
+	return 0;
+}
+
+/* Connects to the UNIX sink of <shard>. A local connect() completes at once,
+ * so the shard is either ready or retried when we return.
+ */
+static void unix_connect(struct s3gw_shard *shard) {
+	struct sockaddr_un sun;
+	struct s3gw_usock *us = NULL;
+	const char *err = "out of resources";
+	int fd;
+
+	shard->state = S3GW_SHARD_CONNECTING;
+
+	if (strlen(shard->unix_path) >= sizeof(sun.sun_path)) {
+		err = "path too long";
+		goto fail;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		err = strerror(errno);
+		goto fail;
+	}
+	if (fd >= global.maxsock || fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		goto fail_close;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, shard->unix_path);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		/* EAGAIN means that the backlog of the sidecar is full */
+		err = strerror(errno);
+		goto fail_close;
+	}
+
+	us = calloc(1, sizeof(*us));
+	if (!us || !(us->out.str = malloc(global.tune.bufsize)))
+		goto fail_close;
+	us->fd = fd;
+	us->out.size = global.tune.bufsize;
+	LIST_INIT(&us->cmds);
+	shard->usock = us;
+
+	fdtab[fd].owner = shard;
+	fdtab[fd].iocb = unix_fd_handler;
+	fd_insert(fd);
+	fd_want_recv(fd);
+	fd_may_send(fd);
+
+	s3gw_shard_ready(shard);
+	return;
+
+ fail_close:
+	if (us)
+		free(us);
+	close(fd);
+ fail:
+	S3_LOG(NULL, LOG_ERR, "connect to UNIX sink %s failed: %s", shard->addr, err);
+	s3gw_shard_retry(shard);
+}
+
+/* Encodes up to <count> of the oldest events of <shard> as one batch of
+ * records, one command per run of events of the same bucket, and has the
+ * poller write them. Returns the number of events taken, which is 0 while the
+ * previous batch is being written.
+ */
+static int unix_flush(struct s3gw_shard *shard, int count) {
+	struct s3gw_usock *us = shard->usock;
+	struct s3gw_event *ev, *prev = NULL;
+	struct s3gw_bucket *b = NULL;
+	struct s3gw_cmd *cmd = NULL;
+	unsigned int len;
+	int i, start, same;
+
+	if (!us || us->out.len)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		ev = s3gw_ring_peek(&shard->ring, i);
+		start = us->out.len;
+		same = prev && ev->bucket_len == prev->bucket_len &&
+		       memcmp(ev->data, prev->data, ev->bucket_len) == 0;
+		if (!same)
+			b = s3gw_bucket_lookup(ev->data, ev->bucket_len);
+
+		if (us->out.size - start > S3GW_UNIX_HDR_LEN + ev->bucket_len) {
+			us->out.len += S3GW_UNIX_HDR_LEN;
+			memcpy(us->out.str + us->out.len, ev->data, ev->bucket_len);
+			us->out.len += ev->bucket_len;
+		}
+		if (us->out.len == start || !s3gw_encode_event(&us->out, ev, b)) {
+			us->out.len = start;
+			if (start)
+				break;
+			s3gw_dropped(1);
+			S3_LOG(NULL, LOG_ERR, "notification too large, dropped");
+			continue;
+		}
+
+		len = htonl(us->out.len - start - 4);
+		memcpy(us->out.str + start, &len, 4);
+		us->out.str[start + 4] = ev->bucket_len;
+
+		if (!cmd || !same) {
+			if (cmd) {
+				cmd->end = start;
+				LIST_ADDQ(&us->cmds, &cmd->list);
+				s3gw_cmd_sent(shard, cmd);
+			}
+			cmd = s3gw_cmd_new(b, NULL, 0);
+			if (!cmd) {
+				us->out.len = start;
+				break;
+			}
+		}
+		cmd->stamps[cmd->events++] = ev->stamp;
+		prev = ev;
+	}
+
+	if (cmd) {
+		cmd->end = us->out.len;
+		LIST_ADDQ(&us->cmds, &cmd->list);
+		s3gw_cmd_sent(shard, cmd);
+	}
+
+	/* written from the fd cache right after the tasks */
+	if (us->out.len)
+		fd_want_send(us->fd);
+	return i;
+}
+
+const struct s3gw_sink_ops s3gw_unix_sink = {
+	.name    = "UNIX sink",
+	.type    = "unix",
+	.connect = unix_connect,
+	.flush   = unix_flush,
+	.close   = unix_close,
+};
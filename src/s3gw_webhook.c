@@ -0,0 +1,866 @@
+/*
+ * Webhook sink for S3 notifications.
+ *
+ * Events are POSTed to an HTTP endpoint as JSON arrays, or MessagePack ones for
+ * the buckets using this encoding, one request per batch of events of the same
+ * bucket, which is named in an X-S3-Bucket header. Each endpoint has a small
+ * pool of keep-alive connections, each carrying one request at a time, so that
+ * the number of batches in flight is bounded by the size of the pool. The
+ * connections are driven the same way as the health checks: the data layer
+ * callbacks only report what happened, and the task of the connection
+ * completes, retries or drops the batch. A batch is retried s3.webhook_retries
+ * times on connection errors, timeouts, 429 and 5xx responses. Once the retries
+ * of a batch are exhausted because the endpoint is unreachable, its buckets
+ * move to the other servers until it accepts a connection again.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <common/buffer.h>
+#include <common/chunk.h>
+#include <common/compat.h>
+#include <common/config.h>
+#include <common/standard.h>
+#include <common/ticks.h>
+#include <common/time.h>
+
+#include <types/connection.h>
+#include <types/global.h>
+#include <types/proxy.h>
+
+#include <proto/connection.h>
+#include <proto/log.h>
+#include <proto/protocol.h>
+#include <proto/proxy.h>
+#include <proto/raw_sock.h>
+#include <proto/s3gw.h>
+#include <proto/s3gw_sink.h>
+#include <proto/s3gw_webhook.h>
+#include <proto/task.h>
+
+#define S3GW_WEBHOOK_REQ "POST %s HTTP/1.1\r\n"              \
+	"Host: %s\r\n"                                        \
+	"Content-Type: %s\r\n"                                \
+	"Content-Length: %u\r\n"                              \
+	"X-S3-Bucket: %.*s\r\n"                               \
+	"\r\n"
+
+/* state of a connection of the pool */
+enum {
+	S3GW_HC_CLOSED = 0,             /* no connection */
+	S3GW_HC_CONNECTING,             /* probe connection in progress */
+	S3GW_HC_IDLE,                   /* connected, no request */
+	S3GW_HC_BUSY,                   /* request in progress */
+	S3GW_HC_WAIT,                   /* waiting before retrying its batch */
+};
+
+/* outcome of a request or a connection, reported by the callbacks */
+enum {
+	S3GW_HC_RES_NONE = 0,
+	S3GW_HC_RES_OK,                 /* complete 2xx response */
+	S3GW_HC_RES_HTTP,               /* complete response, other status */
+	S3GW_HC_RES_CONN,               /* connection failed or lost */
+	S3GW_HC_RES_CLOSED,             /* idle connection closed by the server */
+};
+
+/* where the response parser is */
+enum {
+	S3GW_RSP_HDR = 0,               /* status line and headers */
+	S3GW_RSP_BODY,                  /* <left> bytes of body */
+	S3GW_RSP_CHUNK_SIZE,            /* size line of the next chunk */
+	S3GW_RSP_CHUNK_DATA,            /* <left> bytes of chunk and CRLF */
+	S3GW_RSP_TRAILERS,              /* after the last chunk */
+	S3GW_RSP_UNTIL_CLOSE,           /* body ending with the connection */
+	S3GW_RSP_DONE,
+};
+
+/* a connection of the pool of an endpoint */
+struct s3gw_hconn {
+	struct s3gw_webhook *wh;
+	struct connection conn;         /* reinitialized for each connection */
+	struct buffer *bo;              /* the request, kept for the retries */
+	struct buffer *bi;              /* the response being parsed */
+	struct s3gw_cmd *cmd;           /* the batch, NULL if none */
+	unsigned int req_len;           /* bytes of the request ... */
+	unsigned int req_end;           /* ... ending at this offset of bo->data */
+	unsigned int tries;             /* failed attempts of the batch */
+	int state;                      /* S3GW_HC_* */
+	int result;                     /* S3GW_HC_RES_* */
+	const char *reason;             /* of a failure, for the logs */
+	int probing;                    /* the connection probes the endpoint */
+	int rsp_state;                  /* S3GW_RSP_* */
+	int status;                     /* of the response */
+	int must_close;                 /* the server closes after the response */
+	unsigned long long left;        /* bytes of body or chunk to skip */
+	struct task *task;              /* timeouts, retries, completions */
+};
+
+/* an endpoint */
+struct s3gw_webhook {
+	struct s3gw_shard *shard;
+	struct sockaddr_storage addr;
+	struct protocol *proto;
+	char *path;
+	char *host;
+	int nb_conns;
+	struct s3gw_hconn *conns;       /* <nb_conns> connections once started */
+};
+
+/* the backend the connections are attached to, needed by the TCP layer */
+static struct proxy webhook_px;
+
+/* Records <result> for the connection of <hc>, and wakes its task up to deal
+ * with it outside of the I/O handler.
+ */
+static void hconn_report(struct s3gw_hconn *hc, int result, const char *reason) {
+	if (hc->result == S3GW_HC_RES_NONE) {
+		hc->result = result;
+		hc->reason = reason;
+	}
+	__conn_data_stop_both(&hc->conn);
+	task_wakeup(hc->task, TASK_WOKEN_IO);
+}
+
+/* closes the connection of <hc>, if any, and resets the response parser */
+static void hconn_close(struct s3gw_hconn *hc) {
+	if (conn_xprt_ready(&hc->conn) || conn_ctrl_ready(&hc->conn)) {
+		conn_drain(&hc->conn);
+		conn_force_close(&hc->conn);
+	}
+	hc->state = S3GW_HC_CLOSED;
+	hc->result = S3GW_HC_RES_NONE;
+	hc->probing = 0;
+	hc->bi->p = hc->bi->data;
+	hc->bi->i = 0;
+}
+
+/* removes the <n> first bytes of the response buffer of <hc> */
+static void hconn_skip(struct s3gw_hconn *hc, unsigned int n) {
+	hc->bi->i -= n;
+	memmove(hc->bi->data, hc->bi->data + n, hc->bi->i);
+}
+
+/* returns the value of header <name> of <len> chars if it is in the <hlen>
+ * bytes of headers at <hdrs>, or NULL. The value ends with a CR.
+ */
+static const char *hconn_header(const char *hdrs, int hlen, const char *name, int len) {
+	const char *p = hdrs, *end = hdrs + hlen;
+
+	while (p < end) {
+		if (end - p > len && p[len] == ':' && strncasecmp(p, name, len) == 0) {
+			p += len + 1;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return p;
+		}
+		p = memchr(p, '\n', end - p);
+		if (!p)
+			break;
+		p++;
+	}
+	return NULL;
+}
+
+/* Parses what is in the response buffer of <hc>, <eof> being set once the
+ * server closed. Returns 1 once the response is complete, 0 if more is
+ * needed, -1 if it is invalid.
+ */
+static int hconn_parse(struct s3gw_hconn *hc, int eof) {
+	struct buffer *bi = hc->bi;
+	const char *eoh, *eol, *v;
+	unsigned int n;
+
+	while (1) {
+		switch (hc->rsp_state) {
+		case S3GW_RSP_HDR:
+			eoh = bi->i ? my_memmem(bi->data, bi->i, "\r\n\r\n", 4) : NULL;
+			if (!eoh)
+				return bi->i == bi->size ? -1 : 0;
+			if (bi->i < 12 || memcmp(bi->data, "HTTP/1.", 7) != 0 ||
+			    !isdigit((unsigned char)bi->data[9]) || !isdigit((unsigned char)bi->data[10]) ||
+			    !isdigit((unsigned char)bi->data[11]))
+				return -1;
+			hc->status = str2uic(bi->data + 9);
+			n = eoh + 4 - bi->data;
+
+			/* interim responses are skipped */
+			if (hc->status < 200) {
+				hconn_skip(hc, n);
+				break;
+			}
+
+			hc->must_close = bi->data[7] == '0';
+			v = hconn_header(bi->data, n, "Connection", 10);
+			if (v && strncasecmp(v, "close", 5) == 0)
+				hc->must_close = 1;
+
+			if (hc->status == 204 || hc->status == 304) {
+				hc->rsp_state = S3GW_RSP_DONE;
+			}
+			else if ((v = hconn_header(bi->data, n, "Transfer-Encoding", 17)) &&
+			         strncasecmp(v, "chunked", 7) == 0) {
+				hc->rsp_state = S3GW_RSP_CHUNK_SIZE;
+			}
+			else if ((v = hconn_header(bi->data, n, "Content-Length", 14))) {
+				hc->left = strtoull(v, NULL, 10);
+				hc->rsp_state = S3GW_RSP_BODY;
+			}
+			else {
+				hc->must_close = 1;
+				hc->rsp_state = S3GW_RSP_UNTIL_CLOSE;
+			}
+			hconn_skip(hc, n);
+			break;
+
+		case S3GW_RSP_BODY:
+		case S3GW_RSP_CHUNK_DATA:
+			n = hc->left < bi->i ? hc->left : bi->i;
+			hconn_skip(hc, n);
+			hc->left -= n;
+			if (hc->left)
+				return eof ? -1 : 0;
+			hc->rsp_state = hc->rsp_state == S3GW_RSP_BODY ? S3GW_RSP_DONE : S3GW_RSP_CHUNK_SIZE;
+			break;
+
+		case S3GW_RSP_CHUNK_SIZE:
+		case S3GW_RSP_TRAILERS:
+			eol = bi->i ? memchr(bi->data, '\n', bi->i) : NULL;
+			if (!eol)
+				return (eof || bi->i == bi->size) ? -1 : 0;
+			n = eol + 1 - bi->data;
+			if (hc->rsp_state == S3GW_RSP_TRAILERS) {
+				/* an empty line ends the trailers */
+				if (n <= 2)
+					hc->rsp_state = S3GW_RSP_DONE;
+			}
+			else if (!isxdigit((unsigned char)*bi->data))
+				return -1;
+			else {
+				hc->left = strtoull(bi->data, NULL, 16);
+				if (hc->left)
+					hc->left += 2;
+				hc->rsp_state = hc->left ? S3GW_RSP_CHUNK_DATA : S3GW_RSP_TRAILERS;
+			}
+			hconn_skip(hc, n);
+			break;
+
+		case S3GW_RSP_UNTIL_CLOSE:
+			hconn_skip(hc, bi->i);
+			if (!eof)
+				return 0;
+			hc->rsp_state = S3GW_RSP_DONE;
+			break;
+
+		case S3GW_RSP_DONE:
+			return 1;
+		}
+	}
+}
+
+/* data layer receive callback, reads and parses the response */
+static void hconn_recv_cb(struct connection *conn) {
+	struct s3gw_hconn *hc = conn->owner;
+	int eof, ret;
+
+	if (conn->flags & CO_FL_HANDSHAKE)
+		return;
+
+	conn->xprt->rcv_buf(conn, hc->bi, hc->bi->size - hc->bi->i);
+	eof = !!(conn->flags & (CO_FL_ERROR | CO_FL_SOCK_RD_SH | CO_FL_DATA_RD_SH));
+
+	/* an idle connection only expects to be closed */
+	if (hc->state != S3GW_HC_BUSY) {
+		if (eof || hc->bi->i)
+			hconn_report(hc, S3GW_HC_RES_CLOSED, NULL);
+		return;
+	}
+
+	ret = hconn_parse(hc, eof);
+	if (ret > 0)
+		hconn_report(hc, hc->status >= 200 && hc->status < 300 ? S3GW_HC_RES_OK : S3GW_HC_RES_HTTP, NULL);
+	else if (ret < 0)
+		hconn_report(hc, S3GW_HC_RES_CONN, eof ? "connection closed" : "invalid response");
+	else if (eof)
+		hconn_report(hc, S3GW_HC_RES_CONN, "connection closed");
+	else
+		__conn_data_want_recv(conn);
+}
+
+/* data layer send callback, writes the request */
+static void hconn_send_cb(struct connection *conn) {
+	struct s3gw_hconn *hc = conn->owner;
+
+	if (conn->flags & CO_FL_HANDSHAKE)
+		return;
+
+	if (hc->bo->o) {
+		conn->xprt->snd_buf(conn, hc->bo, 0);
+		if (conn->flags & CO_FL_ERROR) {
+			hconn_report(hc, S3GW_HC_RES_CONN, "write error");
+			return;
+		}
+		if (hc->bo->o)
+			return;
+	}
+	__conn_data_stop_send(conn);
+	__conn_data_want_recv(conn);
+}
+
+/* data layer wake callback, reports errors and the completion of a probe */
+static int hconn_wake_cb(struct connection *conn) {
+	struct s3gw_hconn *hc = conn->owner;
+	struct s3gw_shard *shard = hc->wh->shard;
+
+	if (conn->flags & CO_FL_ERROR) {
+		hconn_report(hc, hc->state == S3GW_HC_IDLE ? S3GW_HC_RES_CLOSED : S3GW_HC_RES_CONN,
+		             conn_err_code_str(conn) ? conn_err_code_str(conn) : "connection error");
+	}
+	else if (hc->state == S3GW_HC_CONNECTING &&
+	         !(conn->flags & (CO_FL_WAIT_L4_CONN | CO_FL_WAIT_L6_CONN))) {
+		/* probe connection established, kept for the first batch */
+		hc->state = S3GW_HC_IDLE;
+		hc->probing = 0;
+		__conn_data_want_recv(conn);
+		if (shard->state == S3GW_SHARD_CONNECTING)
+			s3gw_shard_ready(shard);
+	}
+	return 0;
+}
+
+static struct data_cb webhook_conn_cb = {
+	.recv = hconn_recv_cb,
+	.send = hconn_send_cb,
+	.wake = hconn_wake_cb,
+};
+
+/* Opens a new connection for <hc>, which sends its request once connected if
+ * <data> is set. Returns non-zero on a synchronous failure.
+ */
+static int hconn_connect(struct s3gw_hconn *hc, int data) {
+	struct connection *conn = &hc->conn;
+	int ret;
+
+	conn_init(conn);
+	conn_prepare(conn, hc->wh->proto, &raw_sock);
+	conn_attach(conn, hc, &webhook_conn_cb);
+	conn->target = &webhook_px.obj_type;
+	clear_addr(&conn->addr.from);
+	conn->addr.to = hc->wh->addr;
+
+	hc->bi->p = hc->bi->data;
+	hc->bi->i = 0;
+
+	ret = hc->wh->proto->connect(conn, data, 0);
+	conn->flags |= CO_FL_WAKE_DATA;
+	if (ret != SN_ERR_NONE) {
+		conn_force_close(conn);
+		return 1;
+	}
+	return 0;
+}
+
+/* Drops the batch of <hc> after <reason>, which is reported */
+static void hconn_drop(struct s3gw_hconn *hc, const char *reason) {
+	struct s3gw_shard *shard = hc->wh->shard;
+	struct s3gw_cmd *cmd = hc->cmd;
+
+	S3_LOG(NULL, LOG_ERR, "%u notification(s) dropped, webhook %s: %s",
+	       cmd->events, shard->addr, reason);
+	hc->cmd = NULL;
+	hc->tries = 0;
+	s3gw_cmd_done(shard, cmd, 0);
+
+	/* the connection is free for the next batch */
+	if (s3gw_ring_count(&shard->ring))
+		task_wakeup(shard->flush_task, TASK_WOKEN_OTHER);
+}
+
+/* Gives up on the connection of <hc> after a failure. Its batch is retried
+ * after s3.webhook_retry_delay as long as it has attempts left, then dropped.
+ * A probe failure schedules the next one.
+ */
+static void hconn_failed(struct s3gw_hconn *hc, int conn_error, const char *reason) {
+	struct s3gw_shard *shard = hc->wh->shard;
+
+	if (hc->probing) {
+		hconn_close(hc);
+		S3_LOG(NULL, LOG_ERR, "connect to webhook %s failed: %s", shard->addr, reason);
+		if (shard->state == S3GW_SHARD_CONNECTING)
+			s3gw_shard_retry(shard);
+		return;
+	}
+
+	hconn_close(hc);
+	if (!hc->cmd)
+		return;
+
+	if (hc->tries++ < global.s3.webhook_retries && global.s3.enabled) {
+		S3_LOG(NULL, LOG_NOTICE, "webhook %s: %s, retrying %u notification(s)",
+		       shard->addr, reason, hc->cmd->events);
+		shard->retries++;
+		s3gw_counters.retries++;
+		hc->state = S3GW_HC_WAIT;
+		hc->task->expire = tick_add(now_ms, global.s3.webhook_retry_delay);
+		task_queue(hc->task);
+		return;
+	}
+
+	hconn_drop(hc, reason);
+
+	/* unreachable, its buckets go elsewhere until it is back */
+	if (conn_error && shard->state == S3GW_SHARD_UP)
+		s3gw_shard_lost(shard);
+}
+
+/* (Re)sends the request of <hc>, on its idle connection or a new one */
+static void hconn_send(struct s3gw_hconn *hc) {
+	hc->bo->p = hc->bo->data + hc->req_end;
+	hc->bo->o = hc->req_len;
+	hc->rsp_state = S3GW_RSP_HDR;
+	hc->result = S3GW_HC_RES_NONE;
+	hc->task->expire = tick_add(now_ms, global.s3.webhook_timeout);
+	task_queue(hc->task);
+
+	if (hc->state == S3GW_HC_IDLE) {
+		hc->state = S3GW_HC_BUSY;
+		conn_data_want_send(&hc->conn);
+		return;
+	}
+
+	/* the failure is handled by the task, not while the ring is flushed */
+	hc->state = S3GW_HC_BUSY;
+	if (hconn_connect(hc, 1)) {
+		hc->result = S3GW_HC_RES_CONN;
+		hc->reason = "cannot connect";
+		task_wakeup(hc->task, TASK_WOKEN_OTHER);
+	}
+}
+
+/* Task of a connection of the pool. It deals with what the callbacks reported,
+ * with the request timeout and with the delay before a retry.
+ */
+static struct task *hconn_task(struct task *t) {
+	struct s3gw_hconn *hc = t->context;
+	struct s3gw_shard *shard = hc->wh->shard;
+	struct s3gw_cmd *cmd = hc->cmd;
+	int result = hc->result;
+	const char *why = hc->reason;
+	char reason[32];
+
+	hc->result = S3GW_HC_RES_NONE;
+
+	switch (result) {
+	case S3GW_HC_RES_NONE:
+		if (!tick_is_expired(t->expire, now_ms))
+			return t;
+		t->expire = TICK_ETERNITY;
+		if (hc->state == S3GW_HC_WAIT)
+			hconn_send(hc);
+		else if (hc->state == S3GW_HC_BUSY)
+			hconn_failed(hc, 1, "timeout");
+		break;
+
+	case S3GW_HC_RES_OK:
+		t->expire = TICK_ETERNITY;
+		hc->cmd = NULL;
+		hc->tries = 0;
+		hc->state = S3GW_HC_IDLE;
+		if (hc->must_close)
+			hconn_close(hc);
+		else
+			conn_data_want_recv(&hc->conn);
+		s3gw_cmd_done(shard, cmd, 1);
+		break;
+
+	case S3GW_HC_RES_HTTP:
+		t->expire = TICK_ETERNITY;
+		snprintf(reason, sizeof(reason), "status %d", hc->status);
+		/* only overload and server errors may go away */
+		if (hc->status == 429 || hc->status >= 500) {
+			hconn_failed(hc, 0, reason);
+			break;
+		}
+		hconn_close(hc);
+		hconn_drop(hc, reason);
+		break;
+
+	case S3GW_HC_RES_CONN:
+		t->expire = TICK_ETERNITY;
+		hconn_failed(hc, 1, why);
+		break;
+
+	case S3GW_HC_RES_CLOSED:
+		hconn_close(hc);
+		break;
+	}
+	return t;
+}
+
+/* allocates the pool of connections of <wh>. Returns non-zero on failure. */
+static int webhook_alloc(struct s3gw_webhook *wh) {
+	struct s3gw_hconn *hc;
+	int i;
+
+	wh->conns = calloc(wh->nb_conns, sizeof(*wh->conns));
+	if (!wh->conns)
+		return 1;
+
+	for (i = 0; i < wh->nb_conns; i++) {
+		hc = &wh->conns[i];
+		hc->wh = wh;
+		conn_init(&hc->conn);
+		hc->bo = calloc(1, sizeof(struct buffer) + global.tune.bufsize);
+		hc->bi = calloc(1, sizeof(struct buffer) + global.tune.bufsize);
+		hc->task = task_new();
+		if (!hc->bo || !hc->bi || !hc->task)
+			return 1;
+		hc->bo->size = hc->bi->size = global.tune.bufsize;
+		hc->bo->p = hc->bo->data;
+		hc->bi->p = hc->bi->data;
+		hc->task->process = hconn_task;
+		hc->task->context = hc;
+		hc->task->expire = TICK_ETERNITY;
+	}
+	return 0;
+}
+
+/* releases the connections of <wh>, which are closed */
+static void webhook_free(struct s3gw_webhook *wh) {
+	int i;
+
+	if (!wh->conns)
+		return;
+
+	for (i = 0; i < wh->nb_conns; i++) {
+		if (wh->conns[i].task) {
+			task_delete(wh->conns[i].task);
+			task_free(wh->conns[i].task);
+		}
+		free(wh->conns[i].bo);
+		free(wh->conns[i].bi);
+	}
+	free(wh->conns);
+	wh->conns = NULL;
+}
+
+/* Closes the connections of <shard> which carry no batch, after a probe
+ * timeout. The batches in progress keep their own timeouts and retries, and
+ * are only lost on exit.
+ */
+static void webhook_close(struct s3gw_shard *shard) {
+	struct s3gw_webhook *wh = shard->webhook;
+	struct s3gw_hconn *hc;
+	int i;
+
+	if (!wh->conns)
+		return;
+
+	for (i = 0; i < wh->nb_conns; i++) {
+		hc = &wh->conns[i];
+		if (!hc->bo || !hc->bi || !hc->task)
+			continue;
+		if (hc->cmd && global.s3.enabled)
+			continue;
+		hconn_close(hc);
+		if (hc->cmd) {
+			s3gw_cmd_done(shard, hc->cmd, 0);
+			hc->cmd = NULL;
+		}
+	}
+}
+
+/* Probes the endpoint of <shard> with a connection of its pool, which is ready
+ * once the connection is established.
+ */
+static void webhook_connect(struct s3gw_shard *shard) {
+	struct s3gw_webhook *wh = shard->webhook;
+	struct s3gw_hconn *hc = NULL;
+	int i;
+
+	shard->state = S3GW_SHARD_CONNECTING;
+
+	if (!wh->conns && webhook_alloc(wh)) {
+		webhook_free(wh);
+		S3_LOG(NULL, LOG_ERR, "connect to webhook %s failed: out of memory", shard->addr);
+		s3gw_shard_retry(shard);
+		return;
+	}
+
+	for (i = 0; i < wh->nb_conns; i++) {
+		if (wh->conns[i].cmd)
+			continue;
+		if (wh->conns[i].state == S3GW_HC_IDLE) {
+			s3gw_shard_ready(shard);
+			return;
+		}
+		if (!hc && wh->conns[i].state == S3GW_HC_CLOSED)
+			hc = &wh->conns[i];
+	}
+
+	/* every connection carries a batch, which tells whether it is back */
+	if (!hc) {
+		s3gw_shard_ready(shard);
+		return;
+	}
+
+	hc->probing = 1;
+	hc->state = S3GW_HC_CONNECTING;
+	if (hconn_connect(hc, 0)) {
+		hconn_failed(hc, 1, "cannot connect");
+		return;
+	}
+	shard->conn_task->expire = tick_add(now_ms, global.s3.webhook_timeout);
+	task_queue(shard->conn_task);
+}
+
+/* Encodes into the request of <hc> the oldest events of <shard> of the same
+ * bucket, up to <count>, as a JSON array, or a MessagePack one if it is the
+ * encoding of the bucket. The latter always has a 32-bit length so that it is
+ * only filled at the end. Returns the number of events taken
+ * from the ring, and leaves hc->cmd NULL if none is to be sent.
+ */
+static int webhook_encode(struct s3gw_shard *shard, struct s3gw_hconn *hc, int count) {
+	struct s3gw_webhook *wh = shard->webhook;
+	struct s3gw_event *first, *ev;
+	struct s3gw_bucket *b;
+	struct s3gw_cmd *cmd;
+	struct chunk body;
+	const char *type;
+	unsigned int n;
+	char *hdr;
+	int room, hlen, mp, i;
+
+	first = s3gw_ring_peek(&shard->ring, 0);
+	b = s3gw_bucket_lookup(first->data, first->bucket_len);
+	cmd = s3gw_cmd_new(b, NULL, 0);
+	if (!cmd)
+		return 0;
+
+	mp = b && b->encoding == S3GW_ENC_MSGPACK;
+	type = mp ? "application/msgpack" : "application/json";
+
+	/* the body goes after the longest possible headers, which are copied
+	 * right before it once its length is known.
+	 */
+	room = snprintf(NULL, 0, S3GW_WEBHOOK_REQ, wh->path, wh->host, type, ~0U,
+	                first->bucket_len, first->data);
+	body.str = hc->bo->data + room;
+	body.size = hc->bo->size - room - !mp;  /* the closing ']' */
+	body.len = mp ? 5 : 1;
+	if (body.size <= body.len)
+		goto drop_all;
+	body.str[0] = mp ? 0xdd : '[';
+
+	for (i = 0; i < count; i++) {
+		int start = body.len;
+
+		ev = s3gw_ring_peek(&shard->ring, i);
+		if (ev->bucket_len != first->bucket_len ||
+		    memcmp(ev->data, first->data, ev->bucket_len) != 0)
+			break;
+
+		if (cmd->events && !mp)
+			body.str[body.len++] = ',';
+		if (body.len >= body.size || !s3gw_encode_event(&body, ev, b)) {
+			body.len = start;
+			if (cmd->events)
+				break;
+			s3gw_dropped(1);
+			S3_LOG(NULL, LOG_ERR, "notification too large, dropped");
+			continue;
+		}
+		cmd->stamps[cmd->events++] = ev->stamp;
+	}
+
+	if (!cmd->events) {
+		s3gw_cmd_free(cmd);
+		return i;
+	}
+	if (mp) {
+		n = htonl(cmd->events);
+		memcpy(body.str + 1, &n, 4);
+	}
+	else
+		body.str[body.len++] = ']';
+
+	hdr = trash.str;
+	hlen = snprintf(hdr, trash.size, S3GW_WEBHOOK_REQ, wh->path, wh->host, type, body.len,
+	                first->bucket_len, first->data);
+	memcpy(body.str - hlen, hdr, hlen);
+	hc->req_len = hlen + body.len;
+	hc->req_end = room + body.len;
+	hc->cmd = cmd;
+	s3gw_cmd_sent(shard, cmd);
+	return i;
+
+ drop_all:
+	s3gw_cmd_free(cmd);
+	s3gw_dropped(1);
+	S3_LOG(NULL, LOG_ERR, "notification too large, dropped");
+	return 1;
+}
+
+/* Sends a batch of the oldest events of <shard> on one of its connections
+ * which is free, preferably an idle one. Returns the number of events taken,
+ * which is 0 while all of them are busy.
+ */
+static int webhook_flush(struct s3gw_shard *shard, int count) {
+	struct s3gw_webhook *wh = shard->webhook;
+	struct s3gw_hconn *hc = NULL;
+	int i, taken;
+
+	if (!wh->conns)
+		return 0;
+
+	for (i = 0; i < wh->nb_conns; i++) {
+		if (wh->conns[i].cmd)
+			continue;
+		/* an idle connection may just have been closed by the server */
+		if (wh->conns[i].state == S3GW_HC_IDLE && !wh->conns[i].result) {
+			hc = &wh->conns[i];
+			break;
+		}
+		if (!hc && wh->conns[i].state == S3GW_HC_CLOSED)
+			hc = &wh->conns[i];
+	}
+	if (!hc)
+		return 0;
+
+	taken = webhook_encode(shard, hc, count);
+	if (hc->cmd)
+		hconn_send(hc);
+	return taken;
+}
+
+/* frees the endpoint of <shard> on exit, once closed */
+static void webhook_release(struct s3gw_shard *shard) {
+	struct s3gw_webhook *wh = shard->webhook;
+
+	shard->webhook = NULL;
+	if (!wh)
+		return;
+	webhook_free(wh);
+	free(wh->path);
+	free(wh->host);
+	free(wh);
+}
+
+const struct s3gw_sink_ops s3gw_webhook_sink = {
+	.name    = "webhook",
+	.type    = "webhook",
+	.connect = webhook_connect,
+	.flush   = webhook_flush,
+	.close   = webhook_close,
+	.release = webhook_release,
+};
+
+/* Declares a webhook from the arguments of "s3.webhook", which are
+ * <ip:port> [path <path>] [host <host>] [weight <n>] [conns <n>]. Returns the
+ * server, or NULL with an error message in <err>.
+ */
+struct s3gw_shard *s3gw_webhook_add(char **args, char **err) {
+	struct s3gw_webhook *wh;
+	struct s3gw_shard *shard;
+	struct sockaddr_storage *sk;
+	int port1, port2;
+	int weight = 1;
+	int cur;
+
+	if (!*args[0]) {
+		memprintf(err, "expects <ip:port> [path <path>] [host <host>] [weight <n>] [conns <n>]");
+		return NULL;
+	}
+
+	wh = calloc(1, sizeof(*wh));
+	if (!wh) {
+		memprintf(err, "out of memory");
+		return NULL;
+	}
+	wh->nb_conns = S3GW_DEF_WEBHOOK_CONNS;
+
+	sk = str2sa_range(args[0], &port1, &port2, err, NULL);
+	if (!sk)
+		goto fail;
+	if (sk->ss_family != AF_INET && sk->ss_family != AF_INET6) {
+		memprintf(err, "'%s' is not an IPv4 or IPv6 address", args[0]);
+		goto fail;
+	}
+	if (port1 != port2 || !port1) {
+		memprintf(err, "'%s' needs a single port", args[0]);
+		goto fail;
+	}
+	wh->addr = *sk;
+	wh->proto = protocol_by_family(sk->ss_family);
+
+	for (cur = 1; *args[cur]; cur += 2) {
+		if (!*args[cur + 1]) {
+			memprintf(err, "'%s' expects a value", args[cur]);
+			goto fail;
+		}
+		if (!strcmp(args[cur], "path")) {
+			if (*args[cur + 1] != '/') {
+				memprintf(err, "the path must start with '/'");
+				goto fail;
+			}
+			free(wh->path);
+			wh->path = strdup(args[cur + 1]);
+		}
+		else if (!strcmp(args[cur], "host")) {
+			free(wh->host);
+			wh->host = strdup(args[cur + 1]);
+		}
+		else if (!strcmp(args[cur], "weight")) {
+			weight = atol(args[cur + 1]);
+			if (weight < 1 || weight > S3GW_SHARD_MAX_WEIGHT) {
+				memprintf(err, "weight must be between 1 and %d", S3GW_SHARD_MAX_WEIGHT);
+				goto fail;
+			}
+		}
+		else if (!strcmp(args[cur], "conns")) {
+			wh->nb_conns = atol(args[cur + 1]);
+			if (wh->nb_conns < 1 || wh->nb_conns > S3GW_MAX_WEBHOOK_CONNS) {
+				memprintf(err, "conns must be between 1 and %d", S3GW_MAX_WEBHOOK_CONNS);
+				goto fail;
+			}
+		}
+		else {
+			memprintf(err, "unknown option '%s'", args[cur]);
+			goto fail;
+		}
+	}
+
+	if (!wh->path)
+		wh->path = strdup("/");
+	if (!wh->host)
+		wh->host = strdup(args[0]);
+	if (!wh->proto || !wh->path || !wh->host) {
+		memprintf(err, "out of memory");
+		goto fail;
+	}
+
+	if (!webhook_px.id) {
+		init_new_proxy(&webhook_px);
+		webhook_px.id = "s3gw-webhook";
+		webhook_px.cap = PR_CAP_BE;
+	}
+
+	shard = s3gw_shard_add(args[0], weight, &s3gw_webhook_sink);
+	if (!shard) {
+		memprintf(err, "invalid address '%s'", args[0]);
+		goto fail;
+	}
+	shard->webhook = wh;
+	wh->shard = shard;
+	return shard;
+
+ fail:
+	free(wh->path);
+	free(wh->host);
+	free(wh);
+	return NULL;
+}
@@ -530,6 +530,12 @@ int session_complete(struct session *s)
 	txn->srv_cookie = NULL;
 	txn->cli_cookie = NULL;
 	txn->uri = NULL;
+#ifdef USE_S3GW
+	txn->s3gw.bucket = NULL;
+	txn->s3gw.key = NULL;
+	txn->s3gw.del = NULL;
+	txn->s3gw.query = 0;
+#endif
 	txn->req.cap = NULL;
 	txn->rsp.cap = NULL;
 	txn->hdr_idx.v = NULL;
@@ -0,0 +1,318 @@
+#!/usr/bin/env python3
+"""
+Load test of the notification path.
+
+Runs haproxy in front of a stub S3 origin twice with the same seeded request
+schedule, once without and once with notifications, publishing to a local
+RESP sink, and reports the latency percentiles of both runs, the rate of
+published events and the CPU cost of each event. Run it from the top
+directory once haproxy is built:
+
+    python3 test_s3/bench_notifications.py --rate 1000 --duration 20
+
+The load is open-loop: request <n> is due at <n>/<rate> seconds and its
+latency is counted from that time, so that a stalled haproxy shows up in
+the percentiles instead of slowing the load down. The sink is
+bench_servers.py unless --redis-server gives a redis-server binary; only the
+former knows when each event arrived, which gives the notification lag.
+--webhook publishes to the HTTP stub of bench_servers.py instead.
+
+The exit status is 1 if one of the --max-* limits is exceeded, so that the
+script may run in CI to catch regressions.
+"""
+
+import argparse
+import http.client
+import itertools
+import json
+import os
+import random
+import shutil
+import socket
+import sys
+import threading
+import time
+from subprocess import Popen
+from tempfile import NamedTemporaryFile, mkdtemp
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+BUCKET = 'bench'
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+
+
+def get_free_port():
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+def wait_port(port, timeout=5.0):
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.2).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError('nothing listens on port %d' % port)
+
+
+def haproxy_cfg(opts, port, origin, sink):
+    """ the same proxy with or without notifications, <sink> being None """
+    cfg = ['global', '\tmaxconn 4096']
+    if sink:
+        cfg += ['\ts3.enable']
+        if opts.webhook:
+            cfg += ['\ts3.webhook 127.0.0.1:%d' % sink]
+        else:
+            cfg += ['\ts3.redis_server 127.0.0.1:%d' % sink,
+                    '\ts3.redis_sink %s' % opts.redis_sink]
+        cfg += ['\ts3.bucket_prefix bucket',
+                '\ts3.buckets %s schema %s' % (BUCKET, opts.schema)]
+    cfg += ['', 'defaults',
+            '\tmode http',
+            '\toption http-keep-alive',
+            '\ttimeout connect 1s',
+            '\ttimeout client 10s',
+            '\ttimeout server 10s',
+            '', 'listen bench 127.0.0.1:%d' % port,
+            '\tserver origin 127.0.0.1:%d' % origin, '']
+    return '\n'.join(cfg)
+
+
+def build_schedule(opts):
+    """ returns the list of (method, path, headers, body) sent by a run, the
+    same for a given seed """
+    rnd = random.Random(opts.seed)
+    weights = [int(w) for w in opts.mix.split(':')]
+    body = b'x' * opts.body_size
+    reqs = []
+    for n in range(int(opts.rate * (opts.warmup + opts.duration))):
+        path = '/%s/obj-%08d' % (BUCKET, n)
+        kind = rnd.choices(('put', 'delete', 'copy'), weights)[0]
+        if kind == 'put':
+            reqs.append(('PUT', path, {}, body))
+        elif kind == 'delete':
+            reqs.append(('DELETE', path, {}, None))
+        else:
+            reqs.append(('PUT', path, {'x-amz-copy-source': '/%s/source' % BUCKET}, None))
+    return reqs
+
+
+def cpu_ticks(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return int(fields[11]) + int(fields[12])
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def drive(opts, port, reqs):
+    """ sends <reqs> at the configured rate, returns the latencies in ms of
+    the requests after the warmup, their completion times by key and the
+    number of errors """
+    warmup = int(opts.rate * opts.warmup)
+    latencies = [None] * len(reqs)
+    done = [None] * len(reqs)
+    errors = [0]
+    counter = itertools.count()
+    lock = threading.Lock()
+    start = time.monotonic() + 0.1
+
+    def worker():
+        conn = http.client.HTTPConnection('127.0.0.1', port, timeout=10)
+        while True:
+            with lock:
+                n = next(counter)
+            if n >= len(reqs):
+                break
+            due = start + n / opts.rate
+            delay = due - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            method, path, headers, body = reqs[n]
+            try:
+                conn.request(method, path, body=body, headers=headers)
+                resp = conn.getresponse()
+                resp.read()
+                if resp.status >= 300:
+                    errors[0] += 1
+            except (OSError, http.client.HTTPException):
+                errors[0] += 1
+                conn.close()
+                conn = http.client.HTTPConnection('127.0.0.1', port, timeout=10)
+                continue
+            now = time.monotonic()
+            latencies[n] = (now - due) * 1000.0
+            done[n] = now
+        conn.close()
+
+    threads = [threading.Thread(target=worker) for _ in range(opts.workers)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    measured = sorted(l for l in latencies[warmup:] if l is not None)
+    completions = dict((reqs[n][1].split('/', 2)[2], done[n])
+                       for n in range(warmup, len(reqs)) if done[n] is not None)
+    return measured, completions, errors[0]
+
+
+def resp_count(port, key, cmd):
+    """ returns the length of list or stream <key> in a real Redis server """
+    with socket.create_connection(('127.0.0.1', port)) as s:
+        s.sendall(b'*2\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n' %
+                  (len(cmd), cmd, len(key), key))
+        reply = s.recv(64)
+    return int(reply[1:reply.index(b'\r\n')])
+
+
+def run(opts, notify, reqs, tmpdir):
+    procs = []
+    origin = get_free_port()
+    port = get_free_port()
+    sink = get_free_port() if notify else None
+    stats_file = os.path.join(tmpdir, 'sink-%d.json' % sink) if notify else None
+
+    procs.append(Popen([sys.executable, os.path.join(HERE, 'bench_servers.py'), 'origin', str(origin)]))
+    if notify:
+        if opts.redis_server and not opts.webhook:
+            procs.append(Popen([opts.redis_server, '--port', str(sink), '--save', '',
+                                '--appendonly', 'no', '--loglevel', 'warning']))
+        else:
+            procs.append(Popen([sys.executable, os.path.join(HERE, 'bench_servers.py'),
+                                'webhook' if opts.webhook else 'sink', str(sink), stats_file]))
+    cfg = NamedTemporaryFile('w', suffix='.cfg', dir=tmpdir, delete=False)
+    cfg.write(haproxy_cfg(opts, port, origin, sink))
+    cfg.close()
+
+    try:
+        wait_port(origin)
+        if notify:
+            wait_port(sink)
+        haproxy = Popen([opts.haproxy, '-db', '-f', cfg.name])
+        procs.append(haproxy)
+        wait_port(port)
+        time.sleep(0.5)
+
+        ticks = cpu_ticks(haproxy.pid)
+        t0 = time.monotonic()
+        latencies, completions, errors = drive(opts, port, reqs)
+        elapsed = time.monotonic() - t0
+        time.sleep(opts.drain)
+        cpu = (cpu_ticks(haproxy.pid) - ticks) / float(CLK_TCK)
+        if notify and opts.redis_server and not opts.webhook:
+            redis_events = resp_count(sink, ('bucket:%s' % BUCKET).encode(),
+                                      b'XLEN' if opts.redis_sink == 'stream' else b'LLEN')
+    finally:
+        for p in reversed(procs):
+            p.terminate()
+        for p in reversed(procs):
+            p.wait()
+
+    res = {
+        'requests': len(reqs),
+        'errors': errors,
+        'elapsed': elapsed,
+        'cpu': cpu,
+        'p50': percentile(latencies, 50),
+        'p99': percentile(latencies, 99),
+        'p999': percentile(latencies, 99.9),
+    }
+    if not notify:
+        return res
+
+    if opts.redis_server and not opts.webhook:
+        res['events'] = redis_events
+        return res
+
+    with open(stats_file) as f:
+        stats = json.load(f)
+    res['events'] = stats['events']
+    lags = sorted((stats['keys'][k] - t) * 1000.0
+                  for k, t in completions.items() if k in stats['keys'])
+    res['lag_p50'] = percentile(lags, 50)
+    res['lag_p99'] = percentile(lags, 99)
+    res['lag_p999'] = percentile(lags, 99.9)
+    return res
+
+
+def report(opts, off, on):
+    print('%d requests at %d/s, mix put:delete:copy %s, seed %d' %
+          (off['requests'], opts.rate, opts.mix, opts.seed))
+    print('%-24s %12s %12s %12s' % ('', 'off', 'on', 'delta'))
+    for name in ('p50', 'p99', 'p999'):
+        print('%-24s %12.3f %12.3f %+12.3f' %
+              ('latency %s (ms)' % name, off[name], on[name], on[name] - off[name]))
+    print('%-24s %12d %12d' % ('errors', off['errors'], on['errors']))
+    for res in (off, on):
+        res['cpu_per_req'] = res['cpu'] * 1e6 / res['requests']
+    print('%-24s %12.1f %12.1f %+12.1f' % ('haproxy CPU (us/req)', off['cpu_per_req'],
+                                            on['cpu_per_req'], on['cpu_per_req'] - off['cpu_per_req']))
+
+    events = on.get('events')
+    if events:
+        on['events_per_sec'] = events / on['elapsed']
+        on['cpu_per_event'] = (on['cpu'] - off['cpu']) * 1e6 / events
+        print('%-24s %12s %12.1f' % ('events/s', '', on['events_per_sec']))
+        print('%-24s %12s %12.1f' % ('CPU per event (us)', '', on['cpu_per_event']))
+    if 'lag_p50' in on:
+        for name in ('p50', 'p99', 'p999'):
+            print('%-24s %12s %12.3f' % ('notify lag %s (ms)' % name, '', on['lag_' + name]))
+
+    failed = []
+    if opts.max_p99_delta is not None and on['p99'] - off['p99'] > opts.max_p99_delta:
+        failed.append('p99 latency delta above %.3f ms' % opts.max_p99_delta)
+    if opts.max_cpu_per_event is not None and on.get('cpu_per_event', 0) > opts.max_cpu_per_event:
+        failed.append('CPU per event above %.1f us' % opts.max_cpu_per_event)
+    if on['errors'] or off['errors']:
+        failed.append('requests failed')
+    for msg in failed:
+        print('FAILED: %s' % msg)
+    return not failed
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split('\n\n')[0].strip())
+    ap.add_argument('--haproxy', default='./haproxy')
+    ap.add_argument('--rate', type=int, default=500, help='requests per second')
+    ap.add_argument('--duration', type=float, default=10, help='measured seconds')
+    ap.add_argument('--warmup', type=float, default=1, help='seconds not measured')
+    ap.add_argument('--drain', type=float, default=1, help='seconds left to publish after the load')
+    ap.add_argument('--workers', type=int, default=32, help='concurrent connections')
+    ap.add_argument('--mix', default='70:20:10', help='weights of PUT:DELETE:COPY')
+    ap.add_argument('--body-size', type=int, default=1024)
+    ap.add_argument('--seed', type=int, default=1)
+    ap.add_argument('--schema', choices=('v1', 'v2'), default='v1')
+    ap.add_argument('--redis-sink', choices=('list', 'stream'), default='list')
+    ap.add_argument('--redis-server', help='redis-server binary to use instead of the fake sink')
+    ap.add_argument('--webhook', action='store_true', help='publish to an HTTP endpoint instead of Redis')
+    ap.add_argument('--max-p99-delta', type=float, help='fail above this p99 increase, in ms')
+    ap.add_argument('--max-cpu-per-event', type=float, help='fail above this CPU cost per event, in us')
+    ap.add_argument('--json', help='also write the results to this file')
+    opts = ap.parse_args()
+
+    if not os.access(opts.haproxy, os.X_OK):
+        sys.exit('%s not found, build haproxy and run from the top directory' % opts.haproxy)
+
+    reqs = build_schedule(opts)
+    tmpdir = mkdtemp(prefix='s3bench-')
+    try:
+        off = run(opts, False, reqs, tmpdir)
+        on = run(opts, True, reqs, tmpdir)
+    finally:
+        shutil.rmtree(tmpdir)
+    ok = report(opts, off, on)
+    if opts.json:
+        with open(opts.json, 'w') as f:
+            json.dump({'off': off, 'on': on}, f, indent=1)
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
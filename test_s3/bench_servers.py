@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+"""
+Local peers of haproxy for bench_notifications.py, each run as its own
+process so that they do not share a GIL with the load generator:
+
+  bench_servers.py origin <port>
+      stub S3 origin, answers every request with a success and the headers
+      the schema v2 notifications pick up.
+
+  bench_servers.py sink <port> <stats.json>
+      RESP server standing in for Redis. It acknowledges LPUSH, RPUSH and
+      XADD, records the monotonic time at which each object key was first
+      notified, and writes what it saw to <stats.json> on SIGTERM.
+
+  bench_servers.py webhook <port> <stats.json>
+      the same for the webhook sink: it accepts the POSTed arrays of
+      notifications on keep-alive connections and answers 204.
+
+All of them only use the standard library.
+"""
+
+import json
+import selectors
+import signal
+import socket
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class OriginHandler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def handle_any(self):
+        length = int(self.headers.get('Content-Length') or 0)
+        while length > 0:
+            chunk = self.rfile.read(min(length, 65536))
+            if not chunk:
+                return
+            length -= len(chunk)
+        self.send_response(204 if self.command == 'DELETE' else 200)
+        self.send_header('ETag', '"d41d8cd98f00b204e9800998ecf8427e"')
+        self.send_header('x-amz-request-id', 'tx000000000000000000001')
+        self.send_header('x-amz-version-id', 'v1')
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    do_GET = do_HEAD = do_PUT = do_POST = do_DELETE = handle_any
+
+    def log_message(self, *args):
+        pass
+
+
+class OriginServer(ThreadingHTTPServer):
+    daemon_threads = True
+    request_queue_size = 1024
+
+    def handle_error(self, request, client_address):
+        # haproxy resets its idle server connections when it stops
+        if not isinstance(sys.exc_info()[1], ConnectionError):
+            ThreadingHTTPServer.handle_error(self, request, client_address)
+
+
+def run_origin(port):
+    OriginServer(('127.0.0.1', port), OriginHandler).serve_forever()
+
+
+def parse_command(buf, pos):
+    """ returns (args, next position) of the RESP array at <pos>, or
+    (None, pos) if it is not complete yet """
+    if pos >= len(buf):
+        return None, pos
+    if buf[pos:pos + 1] != b'*':
+        raise ValueError('unexpected RESP type %r' % buf[pos:pos + 1])
+    eol = buf.find(b'\r\n', pos)
+    if eol < 0:
+        return None, pos
+    count = int(buf[pos + 1:eol])
+    cur = eol + 2
+    args = []
+    for _ in range(count):
+        eol = buf.find(b'\r\n', cur)
+        if eol < 0:
+            return None, pos
+        size = int(buf[cur + 1:eol])
+        start = eol + 2
+        if len(buf) < start + size + 2:
+            return None, pos
+        args.append(bytes(buf[start:start + size]))
+        cur = start + size + 2
+    return args, cur
+
+
+def event_key(payload):
+    """ object key of a v1 or v2 notification """
+    doc = json.loads(payload)
+    if 'Records' in doc:
+        return doc['Records'][0]['s3']['object']['key']
+    return doc.get('objectKey')
+
+
+class Events(object):
+    """ what a sink saw, written to <stats_file> on SIGTERM """
+    def __init__(self, stats_file):
+        self.stats_file = stats_file
+        self.commands = 0
+        self.events = 0
+        self.first = None
+        self.last = None
+        self.keys = {}
+
+    def record(self, payloads, now):
+        for payload in payloads:
+            self.events += 1
+            key = event_key(payload)
+            if key not in self.keys:
+                self.keys[key] = now
+        if self.first is None:
+            self.first = now
+        self.last = now
+
+    def dump(self, *args):
+        with open(self.stats_file, 'w') as f:
+            json.dump({'commands': self.commands, 'events': self.events,
+                       'first': self.first, 'last': self.last,
+                       'keys': self.keys}, f)
+        sys.exit(0)
+
+
+class Sink(Events):
+    def __init__(self, port, stats_file):
+        Events.__init__(self, stats_file)
+        self.lists = {}
+        self.sel = selectors.DefaultSelector()
+        self.srv = socket.socket()
+        self.srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.srv.bind(('127.0.0.1', port))
+        self.srv.listen(64)
+        self.srv.setblocking(False)
+        self.sel.register(self.srv, selectors.EVENT_READ, None)
+
+    def reply(self, args, now):
+        name = args[0].upper()
+        self.commands += 1
+        if name == b'PING':
+            return b'+PONG\r\n'
+        if name in (b'LPUSH', b'RPUSH'):
+            self.record(args[2:], now)
+            self.lists[args[1]] = self.lists.get(args[1], 0) + len(args) - 2
+            return b':%d\r\n' % self.lists[args[1]]
+        if name == b'XADD':
+            self.record(args[-1:], now)
+            return b'$3\r\n0-1\r\n'
+        return b'+OK\r\n'
+
+    def serve(self, conn, buf):
+        data = conn.recv(262144)
+        if not data:
+            self.sel.unregister(conn)
+            conn.close()
+            return
+        now = time.monotonic()
+        buf += data
+        pos = 0
+        out = []
+        while True:
+            args, pos = parse_command(buf, pos)
+            if args is None:
+                break
+            out.append(self.reply(args, now))
+        del buf[:pos]
+        if out:
+            conn.sendall(b''.join(out))
+
+    def run(self):
+        signal.signal(signal.SIGTERM, self.dump)
+        while True:
+            for key, _ in self.sel.select():
+                if key.data is None:
+                    conn, _ = self.srv.accept()
+                    conn.setblocking(True)
+                    self.sel.register(conn, selectors.EVENT_READ, bytearray())
+                else:
+                    self.serve(key.fileobj, key.data)
+
+
+class WebhookHandler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get('Content-Length') or 0))
+        now = time.monotonic()
+        with self.server.lock:
+            self.server.sink.commands += 1
+            self.server.sink.record([json.dumps(ev) for ev in json.loads(body)], now)
+        self.send_response(204)
+        self.end_headers()
+
+    def log_message(self, *args):
+        pass
+
+
+def run_webhook(port, stats_file):
+    sink = Events(stats_file)
+    srv = OriginServer(('127.0.0.1', port), WebhookHandler)
+    srv.sink = sink
+    srv.lock = threading.Lock()
+    signal.signal(signal.SIGTERM, sink.dump)
+    srv.serve_forever()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) >= 3 and sys.argv[1] == 'origin':
+        run_origin(int(sys.argv[2]))
+    elif len(sys.argv) >= 4 and sys.argv[1] == 'sink':
+        Sink(int(sys.argv[2]), sys.argv[3]).run()
+    elif len(sys.argv) >= 4 and sys.argv[1] == 'webhook':
+        run_webhook(int(sys.argv[2]), sys.argv[3])
+    else:
+        sys.exit('usage: %s origin <port> | sink|webhook <port> <stats.json>' % sys.argv[0])
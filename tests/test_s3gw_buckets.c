@@ -0,0 +1,119 @@
+/*
+ * Compares the cost of looking up a notification bucket in a list, as was
+ * done before, and in the ebtree index used by s3gw.c, for a growing number
+ * of configured buckets. The index cost must not depend on the bucket count.
+ *
+ * Build with :
+ *   gcc -O2 -I../include -I../ebtree -o test_s3gw_buckets test_s3gw_buckets.c \
+ *       ../ebtree/ebtree.c ../ebtree/ebmbtree.c ../ebtree/ebsttree.c
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <ebsttree.h>
+
+#define LOOKUPS 1000000
+
+struct bucket {
+	struct bucket *next;
+	struct ebmb_node node;
+};
+
+static struct bucket *list = NULL;
+static struct eb_root bucket_index = EB_ROOT_UNIQUE;
+
+static double now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1.0e6 + tv.tv_usec;
+}
+
+static void add_bucket(const char *name)
+{
+	int len = strlen(name);
+	struct bucket *b = calloc(1, sizeof(*b) + len + 1);
+
+	memcpy(b->node.key, name, len + 1);
+	ebst_insert(&bucket_index, &b->node);
+	b->next = list;
+	list = b;
+}
+
+static struct bucket *list_lookup(const char *name, int len)
+{
+	struct bucket *b;
+
+	for (b = list; b; b = b->next) {
+		if (strncmp((char *)b->node.key, name, len) == 0 && !b->node.key[len])
+			return b;
+	}
+	return NULL;
+}
+
+/* same as s3gw_bucket_lookup() */
+static struct bucket *tree_lookup(const char *name, int len)
+{
+	char key[256];
+	struct ebmb_node *node;
+
+	memcpy(key, name, len);
+	key[len] = 0;
+	node = ebst_lookup(&bucket_index, key);
+	return node ? ebmb_entry(node, struct bucket, node) : NULL;
+}
+
+/* adds buckets <from> to <to> - 1 and measures the lookups */
+static void run(int from, int to)
+{
+	/* names are taken from the request path, not zero-terminated */
+	const char *hit = "bucket-00000000/some/object";
+	const char *miss = "unknown-bucket/some/object";
+	struct bucket *(*fct[2])(const char *, int) = { list_lookup, tree_lookup };
+	const char *names[2] = { "list", "tree" };
+	char name[32];
+	double start, hit_ns, miss_ns;
+	int i, f, loops;
+
+	while (from < to) {
+		snprintf(name, sizeof(name), "bucket-%08d", from++);
+		add_bucket(name);
+	}
+
+	for (f = 0; f < 2; f++) {
+		/* the list walk gets too slow with many buckets */
+		loops = f ? LOOKUPS : LOOKUPS / 1000;
+
+		start = now_us();
+		for (i = 0; i < loops; i++) {
+			if (!fct[f](hit, 15))
+				abort();
+		}
+		hit_ns = (now_us() - start) * 1000.0 / loops;
+
+		start = now_us();
+		for (i = 0; i < loops; i++) {
+			if (fct[f](miss, 14))
+				abort();
+		}
+		miss_ns = (now_us() - start) * 1000.0 / loops;
+
+		printf("  %s: hit %8.1f ns, miss %8.1f ns\n", names[f], hit_ns, miss_ns);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const int counts[] = { 10, 100, 1000, 10000, 100000 };
+	int prev = 0, i;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		printf("%d buckets\n", counts[i]);
+		run(prev, counts[i]);
+		prev = counts[i];
+	}
+	return 0;
+}